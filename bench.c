@@ -0,0 +1,189 @@
+/* bench.c
+ *
+ *  Throughput benchmark for dem2tga.  Times the stages of a conversion
+ *  separately on one DEM (ideally one made by gendem, see `make bench')
+ *  and reports MB/s and samples/s for each:
+ *
+ *    header    parsing the Type A record
+ *    decode    checking and decoding every Type B profile
+ *    quantize  mapping decoded elevations to 8 bit pixels
+ *    write     writing the TGA header and rows
+ *    convert   the whole of a dem2tga run, as convertdem() does it
+ *
+ *  Each stage is repeated until it has run for at least -t seconds.
+ *  This builds against dem2tga.c itself and libdem, so it measures
+ *  exactly the code the program runs.
+ */
+
+#define DEM2TGA_NO_MAIN
+#include "dem2tga.c"
+
+#include <time.h>
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void report(const char *phase, double seconds, long iterations, double bytes, double samples) {
+  fprintf(stdout,"%-10s %10.1f ", phase, bytes / seconds / 1e6);
+  if ( samples > 0.0 ) {
+	fprintf(stdout,"%12.1f ", samples / seconds / 1e6);
+  } else {
+	fprintf(stdout,"%12s ", "-");
+  }
+  fprintf(stdout,"%9.3f %8ld\n", seconds, iterations);
+}
+
+void benchusage() {
+  fprintf(stderr,"usage: dembench [-t seconds] [-j threads] dem_file\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  struct demmap dem;
+  struct demheader h;
+  struct profileinfo pi;
+  struct convopts opts;
+  static struct quantizer q;
+  char errmsg[256], *tga_name;
+  double min_time, start, elapsed, scale, bytes, samples;
+  unsigned char *row;
+  int *elevs, profile_elevs, ch, p, nthreads;
+  long n;
+  FILE *fp;
+
+  min_time = 1.0;
+  nthreads = 1;
+  while ((ch = getopt(argc, argv, "j:t:")) != -1)
+	switch(ch) {
+	case 'j':
+	  if ((nthreads = atoi(optarg)) < 1) {
+		benchusage();
+	  }
+	  break;
+	case 't':
+	  if ((min_time = atof(optarg)) <= 0.0) {
+		benchusage();
+	  }
+	  break;
+	default:
+	  benchusage();
+	}
+  argc -= optind;
+  argv += optind;
+  if ( argc != 1 ) {
+	benchusage();
+  }
+
+  if ( mapdem(&dem, argv[0]) != 0 ) {
+	fprintf(stderr,"%s: %s.  Exiting.\n",argv[0],strerror(errno));
+	exit(1);
+  }
+  if ( dem.size < kTYPE_A_SIZE + 18 ) {
+	fprintf(stderr,"%s: truncated DEM file.  Exiting.\n",argv[0]);
+	exit(1);
+  }
+  parsetypea(dem.data, &h);
+  profile_elevs = getnextint(&dem.data[kTYPE_A_SIZE + 12]);
+  if ( h.profile_num < 1 || profile_elevs < 1 || indexdem(&dem, h.profile_num) != 0 ) {
+	fprintf(stderr,"%s: no profiles.  Exiting.\n",argv[0]);
+	exit(1);
+  }
+  scale = h.max_elev > h.min_elev ? 255.0 / (h.max_elev - h.min_elev) : 0.0;
+  linearlut(&q, h.min_elev, scale);
+  samples = (double)h.profile_num * profile_elevs;
+  if ((elevs = malloc(samples * sizeof(int))) == NULL ||
+	  (row = malloc(profile_elevs)) == NULL) {
+	fprintf(stderr,"Out of memory.  Exiting.\n");
+	exit(1);
+  }
+
+  fprintf(stdout,"%s: %d profiles of %d samples, %.1f MB\n",argv[0],h.profile_num,profile_elevs,dem.size / 1e6);
+  fprintf(stdout,"%-10s %10s %12s %9s %8s\n","phase","MB/s","Msamples/s","seconds","runs");
+
+  n = 0;
+  start = now();
+  do {
+	parsetypea(dem.data, &h);
+	n++;
+  } while ((elapsed = now() - start) < min_time);
+  report("header", elapsed, n, (double)n * kTYPE_A_SIZE, 0.0);
+
+  n = 0;
+  start = now();
+  do {
+	for(p=1; p <= h.profile_num; p++) {
+	  if ( readprofile(&dem, p, h.profile_dim, profile_elevs, &pi,
+					   &elevs[(size_t)(p - 1) * profile_elevs], errmsg, sizeof(errmsg)) != 0 ) {
+		fprintf(stderr,"%s: %s  Exiting.\n",argv[0],errmsg);
+		exit(1);
+	  }
+	}
+	n++;
+  } while ((elapsed = now() - start) < min_time);
+  bytes = (double)h.profile_num * recordbytes(profile_elevs);
+  report("decode", elapsed, n, n * bytes, n * samples);
+
+  n = 0;
+  start = now();
+  do {
+	for(p=0; p < h.profile_num; p++) {
+	  quantizerow(&elevs[(size_t)p * profile_elevs], profile_elevs, &q, row);
+	}
+	n++;
+  } while ((elapsed = now() - start) < min_time);
+  report("quantize", elapsed, n, n * samples, n * samples);
+
+  if ((fp = tmpfile()) == NULL) {
+	fprintf(stderr,"tmpfile: %s.  Exiting.\n",strerror(errno));
+	exit(1);
+  }
+  n = 0;
+  start = now();
+  do {
+	rewind(fp);
+	if ( writetgaheader(fp, h.profile_num, profile_elevs, kTGA_MAPPED, kTGA_BOTTOM_LEFT) != 0 ) {
+	  fprintf(stderr,"write: %s.  Exiting.\n",strerror(errno));
+	  exit(1);
+	}
+	for(p=0; p < h.profile_num; p++) {
+	  if ( writetgarow(fp, row, profile_elevs, kTGA_MAPPED) != 0 ) {
+		fprintf(stderr,"write: %s.  Exiting.\n",strerror(errno));
+		exit(1);
+	  }
+	}
+	fflush(fp);
+	n++;
+  } while ((elapsed = now() - start) < min_time);
+  fclose(fp);
+  report("write", elapsed, n, n * (kTGA_HEADER_SIZE + samples), n * samples);
+
+  // the whole thing, through a scratch file next to the DEM
+  if ((tga_name = malloc(strlen(argv[0]) + 16)) == NULL) {
+	fprintf(stderr,"Out of memory.  Exiting.\n");
+	exit(1);
+  }
+  sprintf(tga_name, "%s.bench.tga", argv[0]);
+  memset(&opts, 0, sizeof(opts));
+  opts.nthreads = nthreads;
+  n = 0;
+  start = now();
+  do {
+	if ( convertdem(argv[0], tga_name, &opts, errmsg, sizeof(errmsg)) != 0 ) {
+	  fprintf(stderr,"%s  Exiting.\n",errmsg);
+	  unlink(tga_name);
+	  exit(1);
+	}
+	n++;
+  } while ((elapsed = now() - start) < min_time);
+  unlink(tga_name);
+  report("convert", elapsed, n, n * (double)dem.size, n * samples);
+
+  free(tga_name);
+  free(row);
+  free(elevs);
+  unmapdem(&dem);
+  return(0);
+}
@@ -0,0 +1,1209 @@
+/* dem.c
+ *
+ *  libdem: USGS DEM decoding and TGA writing, shared by dem2tga and
+ *  anything else that wants DEM elevations in-process.  See dem.h.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "dem.h"
+
+const char *demerror(int code) { 
+  switch(code) { 
+  case kDEM_OK: return("no error");
+  case kDEM_ERR_IO: return(strerror(errno));
+  case kDEM_ERR_NOMEM: return("out of memory");
+  case kDEM_ERR_TRUNCATED: return("truncated DEM file");
+  case kDEM_ERR_FORMAT: return("not a DEM this library can read");
+  case kDEM_ERR_WINDOW: return("window outside the DEM");
+  }
+  return("unknown error");
+}
+
+/* Fill hdr (kTGA_HEADER_SIZE bytes) with the TGA header and grayscale
+   palette for an r x c image of the given type, kTGA_MAPPED or
+   kTGA_MAPPED_RLE, whose first row is at origin, kTGA_BOTTOM_LEFT or
+   kTGA_TOP_LEFT
+*/
+void tgaheader(unsigned char *hdr, int r, int c, int type, int origin) { 
+  int i;
+  memset(hdr, 0, 18);
+  hdr[1] = 1;   // color mapped
+  hdr[2] = (unsigned char)type;
+  hdr[6] = 1;   // 256 palette entries
+  hdr[7] = 24;  // of 24 bits each
+  hdr[12] = (unsigned char)(c & 0x00ff);
+  hdr[13] = (unsigned char)((c & 0xff00) >> 8);
+  hdr[14] = (unsigned char)(r & 0x00ff);
+  hdr[15] = (unsigned char)((r & 0xff00) >> 8);
+  hdr[16] = 8;
+  hdr[17] = (unsigned char)origin;
+
+  for(i=0; i<=255; i++) { 
+	hdr[18 + i*3] = i;
+	hdr[18 + i*3 + 1] = i;
+	hdr[18 + i*3 + 2] = i;
+  }
+}
+
+/* Write the TGA header and grayscale palette as a single block. */
+int writetgaheader(FILE *fptr, int r, int c, int type, int origin) {
+  unsigned char hdr[kTGA_HEADER_SIZE];
+  tgaheader(hdr, r, c, type, origin);
+  if ( fwrite(hdr, 1, kTGA_HEADER_SIZE, fptr) != kTGA_HEADER_SIZE ) { 
+	return(kDEM_ERR_IO);
+  }
+  return(0);
+}
+
+/* Run length encoding.
+
+   A type 9 scanline is a series of packets: a count byte with the top
+   bit set and one pixel repeated count+1 times, or a count byte
+   without it and count+1 literal pixels.  Runs of 3 or more become
+   repeat packets and everything else literals, which can never grow
+   a row by more than a byte per 128 pixels and one more.  Finding the
+   next run and its length is done 8 bytes at a time where the
+   machine is little endian, since rows are mostly one or the other.
+*/
+#define kRLE_PACKET 128
+#define kRLE_CHUNK 4096
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define kRLE_WORDS 1
+#define kBYTES_01 0x0101010101010101ULL
+#define kBYTES_80 0x8080808080808080ULL
+
+static inline uint64_t load64(const unsigned char *p) { 
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return(v);
+}
+#endif
+
+/* First i at or after from starting 3 equal pixels, or c if none */
+static int findrun(const unsigned char *row, int from, int c) { 
+  int i = from;
+#if defined(kRLE_WORDS)
+  for(; i + 10 <= c; i += 8) { 
+	uint64_t t = (load64(row + i) ^ load64(row + i + 1)) | (load64(row + i + 1) ^ load64(row + i + 2));
+	uint64_t z = (t - kBYTES_01) & ~t & kBYTES_80;   // lowest zero byte is exact
+	if ( z != 0 ) { 
+	  return(i + (__builtin_ctzll(z) >> 3));
+	}
+  }
+#endif
+  for(; i + 2 < c; i++) { 
+	if ( row[i] == row[i+1] && row[i+1] == row[i+2] ) { 
+	  return(i);
+	}
+  }
+  return(c);
+}
+
+/* Pixels equal to row[i] starting there, at most one packet's worth */
+static int runlength(const unsigned char *row, int i, int c) { 
+  int n, k;
+  n = c - i < kRLE_PACKET ? c - i : kRLE_PACKET;
+  k = 1;
+#if defined(kRLE_WORDS)
+  { 
+	uint64_t v = row[i] * kBYTES_01, d;
+	for(k=0; k + 8 <= n; k += 8) { 
+	  if ((d = load64(row + i + k) ^ v) != 0) { 
+		return(k + (__builtin_ctzll(d) >> 3));
+	  }
+	}
+  }
+#endif
+  while ( k < n && row[i + k] == row[i] ) { 
+	k++;
+  }
+  return(k);
+}
+
+/* Most bytes encodetgarow() can make of c pixels */
+size_t tgarowbound(int c) { 
+  return((size_t)c + (size_t)c / kRLE_PACKET + 2);
+}
+
+/* Encode a scanline of c pixels into out, which holds tgarowbound(c)
+   bytes.  Returns the bytes used.
+*/
+size_t encodetgarow(const unsigned char *row, int c, unsigned char *out) { 
+  unsigned char *o = out;
+  int i, j, n;
+  for(i=0; i < c; ) { 
+	j = findrun(row, i, c);
+	while ( i < j ) { 
+	  n = j - i < kRLE_PACKET ? j - i : kRLE_PACKET;
+	  *o++ = (unsigned char)(n - 1);
+	  memcpy(o, row + i, n);
+	  o += n;
+	  i += n;
+	}
+	if ( i < c ) { 
+	  n = runlength(row, i, c);
+	  *o++ = (unsigned char)(0x80 | (n - 1));
+	  *o++ = row[i];
+	  i += n;
+	}
+  }
+  return((size_t)(o - out));
+}
+
+/* Write one scanline of c pixels, encoding it for kTGA_MAPPED_RLE.
+   Long rows are encoded a piece at a time, so packets break at the
+   piece boundaries too.
+*/
+int writetgarow(FILE *fptr, const unsigned char *row, int c, int type) { 
+  unsigned char buf[kRLE_CHUNK + kRLE_CHUNK / kRLE_PACKET + 2];
+  size_t len;
+  int i, n;
+  if ( type != kTGA_MAPPED_RLE ) { 
+	if ( fwrite(row, 1, (size_t)c, fptr) != (size_t)c ) { 
+	  return(kDEM_ERR_IO);
+	}
+	return(0);
+  }
+  for(i=0; i < c; i += n) { 
+	n = c - i < kRLE_CHUNK ? c - i : kRLE_CHUNK;
+	len = encodetgarow(row + i, n, buf);
+	if ( fwrite(buf, 1, len, fptr) != len ) { 
+	  return(kDEM_ERR_IO);
+	}
+  }
+  return(0);
+}
+
+/* Linear table, min_elev maps to 0 and each unit above it adds
+   scaling_factor
+*/
+void linearlut(struct quantizer *q, double min_elev, double scaling_factor) { 
+  int i, v;
+  q->min_elev = min_elev;
+  q->scaling_factor = scaling_factor;
+  q->equalized = 0;
+  for(i=0; i < kLUT_SIZE; i++) { 
+	v = (int)((i - kLUT_OFFSET - min_elev) * scaling_factor);
+	q->lut[i] = v < 0 ? 0 : (v > 255 ? 255 : v);
+  }
+}
+
+/* Map each elevation to its rank in hist (kLUT_SIZE counts indexed
+   like the table), spreading the samples evenly over 0..255
+*/
+void equalizedlut(struct quantizer *q, const uint32_t *hist) { 
+  uint64_t total, below, first;
+  int i;
+
+  q->min_elev = 0.0;
+  q->scaling_factor = 0.0;
+  q->equalized = 1;
+  for(total=0, i=0; i < kLUT_SIZE; i++) { 
+	total += hist[i];
+  }
+  for(first=0, i=0; i < kLUT_SIZE && first == 0; i++) { 
+	first = hist[i];
+  }
+  for(below=0, i=0; i < kLUT_SIZE; i++) { 
+	below += hist[i];
+	if ( below <= first || total == first ) { 
+	  q->lut[i] = 0;
+	} else { 
+	  q->lut[i] = (unsigned char)((double)(below - first) * 255.0 / (double)(total - first) + 0.5);
+	}
+  }
+}
+
+/* Map n elevations to 8 bit pixel values.  With SSE2, eight at a time
+   are clamped to int16 by a saturating pack and biased to table
+   indices in registers, leaving only the table loads.
+*/
+void quantizerow(const int *elevs, int n, const struct quantizer *q, unsigned char *row) { 
+  const unsigned char *lut = q->lut + kLUT_OFFSET;
+  int i, e;
+  i = 0;
+#if defined(__SSE2__)
+  { 
+	const __m128i bias = _mm_set1_epi16((short)0x8000);
+	uint16_t ix[8];
+	for(; i + 8 <= n; i += 8) { 
+	  __m128i v = _mm_packs_epi32(_mm_loadu_si128((const __m128i *)&elevs[i]),
+								  _mm_loadu_si128((const __m128i *)&elevs[i + 4]));
+	  _mm_storeu_si128((__m128i *)ix, _mm_xor_si128(v, bias));
+	  row[i]   = q->lut[ix[0]]; row[i+1] = q->lut[ix[1]];
+	  row[i+2] = q->lut[ix[2]]; row[i+3] = q->lut[ix[3]];
+	  row[i+4] = q->lut[ix[4]]; row[i+5] = q->lut[ix[5]];
+	  row[i+6] = q->lut[ix[6]]; row[i+7] = q->lut[ix[7]];
+	}
+  }
+#endif
+  for(; i < n; i++) { 
+	e = elevs[i];
+	e = e < INT16_MIN ? INT16_MIN : (e > INT16_MAX ? INT16_MAX : e);
+	row[i] = lut[e];
+  }
+}
+
+/* Decode a 6 character integer field in place.  Behaves exactly like
+   atoi() on a NUL terminated copy of the field, without the copy.
+*/
+int getnextint(const char *s) { 
+  int i, neg, val;
+  i = 0;
+  while ( i < kINT_LENGTH && isspace((unsigned char)s[i]) ) { i++; }
+  neg = 0;
+  if ( i < kINT_LENGTH && (s[i] == '-' || s[i] == '+') ) { 
+	neg = (s[i] == '-');
+	i++;
+  }
+  val = 0;
+  while ( i < kINT_LENGTH && isdigit((unsigned char)s[i]) ) { 
+	val = val * 10 + (s[i] - '0');
+	i++;
+  }
+  return(neg ? -val : val);
+}
+
+double getnextdouble(const char *s) { 
+  char buf[kDOUBLE_LENGTH+1];
+  int i;
+  for(i=0;i<kDOUBLE_LENGTH;i++) { 
+	buf[i] = s[i]; 
+	if( buf[i] == 'D' ) { 
+	  buf[i] = 'E';
+	}
+  }
+  buf[kDOUBLE_LENGTH] = '\0';
+  return(atof(buf));
+}
+
+float getnextfloat(const char *s) { 
+  char buf[kFLOAT_LENGTH+1];
+  int i;
+  for(i=0;i<kFLOAT_LENGTH;i++) { 
+	buf[i] = s[i]; 
+	if( buf[i] == 'D' ) { 
+	  buf[i] = 'E';
+	}
+  }
+  buf[kFLOAT_LENGTH] = '\0';
+  return((float)atof(buf));
+}
+
+/* Bulk elevation decoding.
+
+   Elevations are right justified, space padded 6 character fields.  A
+   well formed field is some spaces, an optional '-', then digits, so
+   each character position has a fixed decimal weight and the value
+   can be computed without scanning for where the number starts.  The
+   vector kernels classify 8 (or 16) fields at a time, compute those
+   weighted sums, and hand any field that doesn't fit the pattern
+   (a '+', a tab, left justified digits ...) to getnextint() so the
+   result always matches atoi().
+*/
+
+/* Given bitmasks of the space, minus and digit characters of nfields
+   consecutive fields (6 bits per field, lowest bit first), return a
+   mask with a bit set for every field that isn't well formed, and
+   store in *neg a mask of the negative ones.
+*/
+static unsigned badfields(uint64_t sp, uint64_t mi, uint64_t dg, int nfields, unsigned *neg) { 
+  unsigned bad, n;
+  uint64_t s, m, d;
+  int k;
+  bad = 0;
+  n = 0;
+  for(k=0; k < nfields; k++) { 
+	s = (sp >> (k * kINT_LENGTH)) & 0x3f;
+	m = (mi >> (k * kINT_LENGTH)) & 0x3f;
+	d = (dg >> (k * kINT_LENGTH)) & 0x3f;
+	if ( (s | m | d) != 0x3f || (s & (s + 1)) != 0 || (m != 0 && m != s + 1) ) { 
+	  bad |= 1u << k;
+	} else if ( m != 0 ) { 
+	  n |= 1u << k;
+	}
+  }
+  *neg = n;
+  return(bad);
+}
+
+#if defined(__SSSE3__)
+/* Digits of the 2 fields in bytes 0 to 11 of d (already converted to
+   0-9, other characters 0) to the two 32 bit values in lanes 0 and 1,
+   via 16 bit intermediates [100*p0, 100*p1+p2] where pN are the digit
+   pairs of each field.
+*/
+#define kSHUF_FIELDS  -1,-1,0,1,2,3,4,5,-1,-1,6,7,8,9,10,11
+#define kPAIR_WEIGHTS 0,0,10,1,10,1,10,1,0,0,10,1,10,1,10,1
+#define kHALF_WEIGHTS 0,100,100,1,0,100,100,1
+#endif
+
+#if defined(__AVX2__)
+static inline __m256i load2x128(const char *lo, const char *hi) { 
+  return(_mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)lo)),
+								 _mm_loadu_si128((const __m128i *)hi), 1));
+}
+
+static inline __m256i applysign4(__m256i v, unsigned neglo, unsigned neghi) { 
+  __m256i m = _mm256_setr_epi32(-(int)(neglo & 1), -(int)((neglo >> 1) & 1), 
+								-(int)((neglo >> 2) & 1), -(int)((neglo >> 3) & 1),
+								-(int)(neghi & 1), -(int)((neghi >> 1) & 1), 
+								-(int)((neghi >> 2) & 1), -(int)((neghi >> 3) & 1));
+  return(_mm256_sub_epi32(_mm256_xor_si256(v, m), m));
+}
+
+/* 16 fields (96 bytes), 8 in each 128 bit lane */
+static void decode16(const char *s, int *out) { 
+  const __m256i zero = _mm256_set1_epi8('0');
+  const __m256i nine = _mm256_set1_epi8(9);
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i minus = _mm256_set1_epi8('-');
+  const __m256i shuf = _mm256_setr_epi8(kSHUF_FIELDS, kSHUF_FIELDS);
+  const __m256i wpair = _mm256_setr_epi8(kPAIR_WEIGHTS, kPAIR_WEIGHTS);
+  const __m256i whalf = _mm256_setr_epi16(kHALF_WEIGHTS, kHALF_WEIGHTS);
+  const __m256i wlast = _mm256_set1_epi32((1 << 16) | 100);
+  __m256i v[3], d[3], x[4], q[4], lo, hi;
+  uint64_t sp[2], mi[2], dg[2];
+  unsigned bad[2], neg[2], b;
+  int i, k;
+
+  for(i=0; i < 3; i++) { 
+	__m256i isdig;
+	uint32_t ms, mm, md;
+	v[i] = load2x128(s + 16 * i, s + 48 + 16 * i);
+	d[i] = _mm256_sub_epi8(v[i], zero);
+	isdig = _mm256_cmpeq_epi8(_mm256_subs_epu8(d[i], nine), _mm256_setzero_si256());
+	d[i] = _mm256_and_si256(d[i], isdig);
+	ms = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v[i], space));
+	mm = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v[i], minus));
+	md = (uint32_t)_mm256_movemask_epi8(isdig);
+	if ( i == 0 ) { sp[0] = sp[1] = mi[0] = mi[1] = dg[0] = dg[1] = 0; }
+	sp[0] |= (uint64_t)(ms & 0xffff) << (16 * i); sp[1] |= (uint64_t)(ms >> 16) << (16 * i);
+	mi[0] |= (uint64_t)(mm & 0xffff) << (16 * i); mi[1] |= (uint64_t)(mm >> 16) << (16 * i);
+	dg[0] |= (uint64_t)(md & 0xffff) << (16 * i); dg[1] |= (uint64_t)(md >> 16) << (16 * i);
+  }
+  bad[0] = badfields(sp[0], mi[0], dg[0], 8, &neg[0]);
+  bad[1] = badfields(sp[1], mi[1], dg[1], 8, &neg[1]);
+
+  x[0] = d[0];
+  x[1] = _mm256_alignr_epi8(d[1], d[0], 12);
+  x[2] = _mm256_alignr_epi8(d[2], d[1], 8);
+  x[3] = _mm256_srli_si256(d[2], 4);
+  for(k=0; k < 4; k++) { 
+	q[k] = _mm256_madd_epi16(_mm256_maddubs_epi16(_mm256_shuffle_epi8(x[k], shuf), wpair), whalf);
+  }
+  lo = applysign4(_mm256_madd_epi16(_mm256_packs_epi32(q[0], q[1]), wlast), neg[0] & 0xf, neg[1] & 0xf);
+  hi = applysign4(_mm256_madd_epi16(_mm256_packs_epi32(q[2], q[3]), wlast), neg[0] >> 4, neg[1] >> 4);
+  _mm_storeu_si128((__m128i *)&out[0], _mm256_castsi256_si128(lo));
+  _mm_storeu_si128((__m128i *)&out[4], _mm256_castsi256_si128(hi));
+  _mm_storeu_si128((__m128i *)&out[8], _mm256_extracti128_si256(lo, 1));
+  _mm_storeu_si128((__m128i *)&out[12], _mm256_extracti128_si256(hi, 1));
+
+  for(b = bad[0] | (bad[1] << 8), k = 0; b != 0; b >>= 1, k++) { 
+	if ( b & 1 ) { 
+	  out[k] = getnextint(&s[k * kINT_LENGTH]);
+	}
+  }
+}
+#endif
+
+#if defined(__SSE2__)
+/* 8 fields (48 bytes) */
+static void decode8(const char *s, int *out) { 
+  const __m128i zero = _mm_set1_epi8('0');
+  const __m128i nine = _mm_set1_epi8(9);
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i minus = _mm_set1_epi8('-');
+  __m128i v[3], d[3];
+  uint64_t sp, mi, dg;
+  unsigned bad, neg, b;
+  int i, k;
+
+  sp = mi = dg = 0;
+  for(i=0; i < 3; i++) { 
+	__m128i isdig;
+	v[i] = _mm_loadu_si128((const __m128i *)(s + 16 * i));
+	d[i] = _mm_sub_epi8(v[i], zero);
+	isdig = _mm_cmpeq_epi8(_mm_subs_epu8(d[i], nine), _mm_setzero_si128());
+	d[i] = _mm_and_si128(d[i], isdig);
+	sp |= (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[i], space)) << (16 * i);
+	mi |= (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[i], minus)) << (16 * i);
+	dg |= (uint64_t)_mm_movemask_epi8(isdig) << (16 * i);
+  }
+  bad = badfields(sp, mi, dg, 8, &neg);
+
+#if defined(__SSSE3__)
+  { 
+	const __m128i shuf = _mm_setr_epi8(kSHUF_FIELDS);
+	const __m128i wpair = _mm_setr_epi8(kPAIR_WEIGHTS);
+	const __m128i whalf = _mm_setr_epi16(kHALF_WEIGHTS);
+	const __m128i wlast = _mm_set1_epi32((1 << 16) | 100);
+	__m128i x[4], q[4], r;
+	x[0] = d[0];
+	x[1] = _mm_alignr_epi8(d[1], d[0], 12);
+	x[2] = _mm_alignr_epi8(d[2], d[1], 8);
+	x[3] = _mm_srli_si128(d[2], 4);
+	for(k=0; k < 4; k++) { 
+	  q[k] = _mm_madd_epi16(_mm_maddubs_epi16(_mm_shuffle_epi8(x[k], shuf), wpair), whalf);
+	}
+	for(k=0; k < 2; k++) { 
+	  __m128i m = _mm_setr_epi32(-(int)((neg >> (4*k)) & 1), -(int)((neg >> (4*k+1)) & 1),
+								 -(int)((neg >> (4*k+2)) & 1), -(int)((neg >> (4*k+3)) & 1));
+	  r = _mm_madd_epi16(_mm_packs_epi32(q[2*k], q[2*k+1]), wlast);
+	  r = _mm_sub_epi32(_mm_xor_si128(r, m), m);
+	  _mm_storeu_si128((__m128i *)&out[4 * k], r);
+	}
+  }
+#else
+  { 
+	// no byte shuffle in plain SSE2: reduce digit pairs in vector
+	// registers, then combine each field's 3 pairs in scalar code
+	const __m128i wpair = _mm_set1_epi32((1 << 16) | 10);
+	int16_t pairs[24];
+	for(i=0; i < 3; i++) { 
+	  __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(d[i], _mm_setzero_si128()), wpair);
+	  __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(d[i], _mm_setzero_si128()), wpair);
+	  _mm_storeu_si128((__m128i *)&pairs[8 * i], _mm_packs_epi32(lo, hi));
+	}
+	for(k=0; k < 8; k++) { 
+	  int val = (pairs[3*k] * 100 + pairs[3*k+1]) * 100 + pairs[3*k+2];
+	  out[k] = ((neg >> k) & 1) ? -val : val;
+	}
+  }
+#endif
+
+  for(b = bad, k = 0; b != 0; b >>= 1, k++) { 
+	if ( b & 1 ) { 
+	  out[k] = getnextint(&s[k * kINT_LENGTH]);
+	}
+  }
+}
+#endif
+
+/* Decode n consecutive integer fields starting at s */
+void decodefields(const char *s, int n, int *out) { 
+  int i;
+  i = 0;
+#if defined(__AVX2__)
+  for(; i + 16 <= n; i += 16) { 
+	decode16(&s[i * kINT_LENGTH], &out[i]);
+  }
+#endif
+#if defined(__SSE2__)
+  for(; i + 8 <= n; i += 8) { 
+	decode8(&s[i * kINT_LENGTH], &out[i]);
+  }
+#endif
+  for(; i < n; i++) { 
+	out[i] = getnextint(&s[i * kINT_LENGTH]);
+  }
+}
+
+/* Offset of sample s from the start of its Type B record.  The first
+   146 follow the profile header, then 170 more at the start of every
+   following 1024 byte block.
+*/
+size_t sampleoffset(int s) { 
+  if ( s < kFIRST_BLOCK_ELEVS ) { 
+	return(kPROFILE_HEADER_SIZE + (size_t)s * kINT_LENGTH);
+  }
+  s -= kFIRST_BLOCK_ELEVS;
+  return((size_t)(1 + s / kBLOCK_ELEVS) * kBLOCK_SIZE + (size_t)(s % kBLOCK_ELEVS) * kINT_LENGTH);
+}
+
+/* Decode samples first to first+n-1 of the Type B record at rec into
+   out, a block's run at a time.
+*/
+void decoderange(const char *rec, int first, int n, int *out) { 
+  int s, end, run;
+  for(s = first, end = first + n; s < end; s += run) { 
+	if ( s < kFIRST_BLOCK_ELEVS ) { 
+	  run = (end < kFIRST_BLOCK_ELEVS ? end : kFIRST_BLOCK_ELEVS) - s;
+	} else { 
+	  run = kBLOCK_ELEVS - (s - kFIRST_BLOCK_ELEVS) % kBLOCK_ELEVS;
+	  run = end - s < run ? end - s : run;
+	}
+	decodefields(rec + sampleoffset(s), run, out + (s - first));
+  }
+}
+
+/* Map an entire DEM file for reading.  Returns 0 on success,
+   kDEM_ERR_IO with errno set on failure.
+*/
+int mapdem(struct demmap *m, const char *path) { 
+  struct stat st;
+  size_t len, cap;
+  ssize_t n;
+  int fd;
+
+  m->data = NULL;
+  m->size = 0;
+  m->mapped = 0;
+  m->record = NULL;
+  m->records = 0;
+  if ((fd = open(path, O_RDONLY)) < 0) { 
+	return(kDEM_ERR_IO);
+  }
+  if ( fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 ) { 
+	m->data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if ( m->data != MAP_FAILED ) { 
+	  m->size = (size_t)st.st_size;
+	  m->mapped = 1;
+	  madvise(m->data, m->size, MADV_SEQUENTIAL);
+	  close(fd);
+	  return(0);
+	}
+	m->data = NULL;
+  }
+
+  // not mappable, slurp it instead
+  len = 0;
+  cap = kTYPE_A_SIZE + kTYPE_B_SIZE;
+  if ((m->data = malloc(cap)) == NULL) { 
+	close(fd);
+	return(kDEM_ERR_IO);
+  }
+  while ((n = read(fd, m->data + len, cap - len)) != 0) { 
+	if ( n < 0 ) { 
+	  if ( errno == EINTR ) { continue; }
+	  free(m->data);
+	  m->data = NULL;
+	  close(fd);
+	  return(kDEM_ERR_IO);
+	}
+	len += (size_t)n;
+	if ( len == cap ) { 
+	  char *p;
+	  cap *= 2;
+	  if ((p = realloc(m->data, cap)) == NULL) { 
+		free(m->data);
+		m->data = NULL;
+		close(fd);
+		return(kDEM_ERR_IO);
+	  }
+	  m->data = p;
+	}
+  }
+  m->size = len;
+  close(fd);
+  return(0);
+}
+
+void unmapdem(struct demmap *m) { 
+  if ( m->data != NULL ) { 
+	if ( m->mapped ) { 
+	  munmap(m->data, m->size);
+	} else { 
+	  free(m->data);
+	}
+  }
+  free(m->record);
+  m->data = NULL;
+  m->size = 0;
+  m->record = NULL;
+  m->records = 0;
+}
+
+/* Number of bytes from the start of a Type B record through the end
+   of its last elevation, including the 4 filler bytes at the end of
+   every 1024 byte block the samples cross.
+*/
+size_t profilebytes(int elevs) { 
+  size_t n;
+  n = kPROFILE_HEADER_SIZE + (size_t)elevs * kINT_LENGTH;
+  if ( elevs > kFIRST_BLOCK_ELEVS ) { 
+	n += 4 * (size_t)((elevs - kFIRST_BLOCK_ELEVS + kBLOCK_ELEVS - 1) / kBLOCK_ELEVS);
+  }
+  return(n);
+}
+
+/* Bytes a Type B record of elevs samples takes in the file, whole
+   1024 byte blocks
+*/
+size_t recordbytes(int elevs) { 
+  return((profilebytes(elevs) + kBLOCK_SIZE - 1) / kBLOCK_SIZE * kBLOCK_SIZE);
+}
+
+static int recordid(const struct demmap *m, size_t off) { 
+  return(off + 12 <= m->size ? getnextint(&m->data[off + 6]) : -1);
+}
+
+/* Find the offset of each of the profile_num Type B records of a DEM.
+
+   Each record is as many 1024 byte blocks as its sample count (bytes
+   12 to 17) needs, so long profiles span as many blocks as they like.
+   Some producers pad every record out to 8192 bytes regardless.  If
+   the file size says all the records are one size (the usual case),
+   the offsets just step by that; otherwise each record's count says
+   where the next starts, checked against the next record's id.  A
+   DEM that ends early gets fewer records, and readprofile() reports
+   the first missing one as truncated.  Returns 0, or kDEM_ERR_NOMEM.
+*/
+int indexdem(struct demmap *m, int profile_num) { 
+  size_t off, next, stride, limit;
+  int p, elevs;
+
+  free(m->record);
+  m->records = 0;
+  if ((m->record = malloc(((size_t)(profile_num > 0 ? profile_num : 0) + 1) * sizeof(size_t))) == NULL) { 
+	return(kDEM_ERR_NOMEM);
+  }
+  if ( profile_num < 1 || m->size < kTYPE_A_SIZE + 18 ) { 
+	return(0);
+  }
+
+  // uniform records, either the size the first profile needs or 8192
+  elevs = getnextint(&m->data[kTYPE_A_SIZE + 12]);
+  stride = elevs > 0 ? recordbytes(elevs) : 0;
+  if ( stride > 0 && m->size != kTYPE_A_SIZE + (size_t)profile_num * stride ) { 
+	stride = kTYPE_B_SIZE;
+  }
+  if ( stride > 0 && m->size == kTYPE_A_SIZE + (size_t)profile_num * stride &&
+	   recordid(m, kTYPE_A_SIZE + (size_t)(profile_num - 1) * stride) == profile_num ) { 
+	for(p=0; p < profile_num; p++) { 
+	  m->record[p] = kTYPE_A_SIZE + (size_t)p * stride;
+	}
+	m->records = profile_num;
+	return(0);
+  }
+
+  // otherwise walk the records
+  off = kTYPE_A_SIZE;
+  for(p=0; p < profile_num && off + 18 <= m->size; p++) { 
+	m->record[p] = off;
+	m->records = p + 1;
+	elevs = getnextint(&m->data[off + 12]);
+	next = off + recordbytes(elevs > 0 ? elevs : 0);
+	// allow for padding after the record, up to the 8192 byte kind
+	limit = off + (next - off > kTYPE_B_SIZE ? next - off : kTYPE_B_SIZE);
+	for(stride = next; stride <= limit && recordid(m, stride) != p + 2; stride += kBLOCK_SIZE) { 
+	  ;
+	}
+	off = stride <= limit ? stride : next;
+  }
+  return(0);
+}
+
+/* Locate Type B record `profile' (counting from 1), check its header
+   against what the Type A record told us and decode its samples first
+   to first+n-1 into elevs.  Only the blocks holding those samples are
+   touched.  Fills in info if it isn't NULL.  Returns 0, or
+   kDEM_ERR_TRUNCATED or kDEM_ERR_FORMAT with a message in err.
+*/
+int readslice(const struct demmap *dem, int profile, int profile_dim, int profile_elevs, int first, int n,
+			  struct profileinfo *info, int *elevs, char *err, size_t errlen) { 
+  struct profileinfo pi;
+  const char *type_b_record;
+
+  // located by indexdem(); records past the end of the file are missing
+  if ( profile > dem->records ) { 
+	snprintf(err, errlen, "Profile %d is truncated.", profile);
+	return(kDEM_ERR_TRUNCATED);
+  }
+  type_b_record = dem->data + dem->record[profile - 1];
+  if ( (size_t)(type_b_record - dem->data) + profilebytes(first + n) > dem->size ) { 
+	snprintf(err, errlen, "Profile %d is truncated.", profile);
+	return(kDEM_ERR_TRUNCATED);
+  }
+  
+  /* Field 1 int x 2
+	 profile row and column id
+	 column appears to be profile id
+	 row appears to be this profiles dimension number
+	 bytes 0 to 5 and 6 to 11
+  */
+  pi.dim = getnextint(&type_b_record[0]);
+  pi.id = getnextint(&type_b_record[6]);
+  if ( pi.id != profile ) { 
+	snprintf(err, errlen, "Expecting profile id %d, got %d.", profile, pi.id);
+	return(kDEM_ERR_FORMAT);
+  }
+  if ( pi.dim != profile_dim ) { 
+	snprintf(err, errlen, "Expecting profile dimension %d, got %d.", profile_dim, pi.dim);
+	return(kDEM_ERR_FORMAT);
+  }
+  /* Field 2 int x 2 
+	 profile rows and columns
+	 rows is elevations (samples) in this profile
+	 columns  matches dimensions?	   
+	 bytes 12 to 17 and 18 to 23
+  */
+  pi.elevs = getnextint(&type_b_record[12]);
+  pi.columns = getnextint(&type_b_record[18]);
+  if ( pi.elevs != profile_elevs ) { 
+	snprintf(err, errlen, "Expecting %d elevations, got %d.", profile_elevs, pi.elevs);
+	return(kDEM_ERR_FORMAT);
+  }
+  if ( pi.columns != 1 ) { 
+	snprintf(err, errlen, "Expecting 1 profile columns, got %d.", pi.columns);
+	return(kDEM_ERR_FORMAT);
+  }
+  
+  /* Field 3 double x 2
+	 ground coords of first elevation in profile
+	 bytes 24 to 47 and 48 to 71 
+  */
+  pi.x = getnextdouble(&type_b_record[24]);
+  pi.y = getnextdouble(&type_b_record[48]);
+  /* !!! check to make sure these are not out of bounds of the information in the DEM header */
+  
+  /* Field 4 double 
+	 profile local datum elevation
+	 always 0.0 (sealevel) for 1 degree DEM
+	 bytes 72 to 95
+  */
+  pi.local_elev = getnextdouble(&type_b_record[72]);
+  if ( pi.local_elev != 0.0 ) { 
+	snprintf(err, errlen, "Expecting 0.0, got %.1f.", pi.local_elev);
+	return(kDEM_ERR_FORMAT);
+  } 
+  
+  /* Field 5 double x 2 
+	 min and max elevations for this profile 
+	 bytes 96 to 119 and 120 to 143
+  */
+  pi.min_elev = getnextdouble(&type_b_record[96]);
+  pi.max_elev = getnextdouble(&type_b_record[120]);
+  /* !!! check to make sure these are not out of bounds of the information in the DEM header */
+  
+  /* Field 6 int x profile_elevs
+	 elevation samples
+	 byte 144 to the end
+  */
+  decoderange(type_b_record, first, n, elevs);
+  if ( info != NULL ) { 
+	*info = pi;
+  }
+  return(0);
+}
+
+/* readslice() of the whole profile */
+int readprofile(const struct demmap *dem, int profile, int profile_dim, int profile_elevs,
+				struct profileinfo *info, int *elevs, char *err, size_t errlen) { 
+  return(readslice(dem, profile, profile_dim, profile_elevs, 0, profile_elevs, info, elevs, err, errlen));
+}
+
+const char *groundunits(int code) { 
+  switch(code) { 
+  case 0: return("radians");
+  case 1: return("feet");
+  case 2: return("meters");
+  case 3: return("arc-seconds");
+  }
+  return("unknown");
+}
+
+const char *elevunits(int code) { 
+  switch(code) { 
+  case 1: return("feet");
+  case 2: return("meters");
+  }
+  return("unknown");
+}
+
+/* Check the Type A record describes something we can decode: a
+   rectangular DEM of 1 dimensional profiles, as many as its corners
+   and resolution say, with a sensible elevation range.  Returns 0, or
+   kDEM_ERR_FORMAT with a message in err.
+*/
+int checkheader(const struct demheader *h, char *err, size_t errlen) { 
+  double height;
+  if ( h->poly_sides != 4 ) {
+	snprintf(err, errlen, "I don't know how to deal with non-rectangluar DEMs.");
+	return(kDEM_ERR_FORMAT);
+  } 
+  if ( h->max_elev - h->min_elev < 0.0 ) { 
+	snprintf(err, errlen, "Negative elevation range.");
+	return(kDEM_ERR_FORMAT);
+  }
+  if ( h->profile_dim != 1 ) { 
+	snprintf(err, errlen, "Can't handle %d dimensional DEM files.", h->profile_dim);
+	return(kDEM_ERR_FORMAT);
+  }
+  height = fabs(h->poly_verts[1] - h->poly_verts[3]);
+  if ( h->profile_num != (int)(height/h->x_res+1) ) { 
+	snprintf(err, errlen, "Unexpected number of profiles.");
+	return(kDEM_ERR_FORMAT);
+  }
+  return(0);
+}
+
+struct gridworker { 
+  const struct demmap *dem;
+  struct demgrid *grid;
+  int profile_dim, first, step;
+  int min_elev, max_elev;
+  double prof_min_elev, prof_max_elev;
+  uint32_t *hist;       // kLUT_SIZE bins, or NULL
+  int bad_profile, status;
+  char err[128];
+  pthread_t tid;
+};
+
+static void *decodegridrows(void *arg) { 
+  struct gridworker *w = arg;
+  struct demgrid *g = w->grid;
+  struct profileinfo info;
+  int *elevs, k, i;
+
+  w->bad_profile = -1;
+  w->min_elev = INT_MAX;
+  w->max_elev = INT_MIN;
+  w->prof_min_elev = HUGE_VAL;
+  w->prof_max_elev = -HUGE_VAL;
+  if ((elevs = malloc(g->cols * sizeof(int))) == NULL) { 
+	w->bad_profile = w->first;
+	w->status = kDEM_ERR_NOMEM;
+	snprintf(w->err, sizeof(w->err), "Out of memory.");
+	return(NULL);
+  }
+  for(k = w->first; k < g->rows; k += w->step) { 
+	int16_t *row = &g->elev[(size_t)k * g->cols];
+	if ((w->status = readprofile(w->dem, k + 1, w->profile_dim, g->cols, &info, elevs, w->err, sizeof(w->err))) != 0) { 
+	  w->bad_profile = k;
+	  break;
+	}
+	for(i=0; i < g->cols; i++) { 
+	  if ( elevs[i] < INT16_MIN || elevs[i] > INT16_MAX ) { 
+		snprintf(w->err, sizeof(w->err), "Elevation %d in profile %d doesn't fit in 16 bits.", elevs[i], k + 1);
+		w->bad_profile = k;
+		w->status = kDEM_ERR_FORMAT;
+		break;
+	  }
+	  if ( elevs[i] < w->min_elev ) { w->min_elev = elevs[i]; }
+	  if ( elevs[i] > w->max_elev ) { w->max_elev = elevs[i]; }
+	  row[i] = (int16_t)elevs[i];
+	}
+	if ( w->bad_profile >= 0 ) { 
+	  break;
+	}
+	if ( w->hist != NULL ) { 
+	  for(i=0; i < g->cols; i++) { 
+		w->hist[row[i] + kLUT_OFFSET]++;
+	  }
+	}
+	if ( info.min_elev < w->prof_min_elev ) { w->prof_min_elev = info.min_elev; }
+	if ( info.max_elev > w->prof_max_elev ) { w->prof_max_elev = info.max_elev; }
+  }
+  free(elevs);
+  return(NULL);
+}
+
+/* Decode every profile of dem into g, tracking the extremes of the
+   data and of the per profile min/max fields as we go, and if hist
+   isn't NULL adding each sample to it (kLUT_SIZE bins).  Profiles are
+   split round robin over nthreads workers.  Returns 0, or an error
+   code with a message in err; g->elev is allocated here and belongs to the
+   caller either way.
+*/
+int decodegrid(const struct demmap *dem, int profile_num, int profile_dim, int profile_elevs,
+			   int nthreads, struct demgrid *g, uint32_t *hist, char *err, size_t errlen) { 
+  struct gridworker *w;
+  int t, started, bad, i;
+
+  g->rows = profile_num;
+  g->cols = profile_elevs;
+  g->min_elev = INT_MAX;
+  g->max_elev = INT_MIN;
+  g->prof_min_elev = HUGE_VAL;
+  g->prof_max_elev = -HUGE_VAL;
+  g->elev = malloc((size_t)profile_num * profile_elevs * sizeof(int16_t));
+  w = calloc(nthreads, sizeof(struct gridworker));
+  if ( g->elev == NULL || w == NULL ) { 
+	snprintf(err, errlen, "Out of memory.");
+	free(w);
+	return(kDEM_ERR_NOMEM);
+  }
+  for(t=0; t < nthreads; t++) { 
+	w[t].dem = dem;
+	w[t].grid = g;
+	w[t].profile_dim = profile_dim;
+	w[t].first = t;
+	w[t].step = nthreads;
+	// each worker counts into its own bins, added up below
+	if ( hist != NULL && (w[t].hist = t == 0 ? hist : calloc(kLUT_SIZE, sizeof(uint32_t))) == NULL ) { 
+	  snprintf(err, errlen, "Out of memory.");
+	  while ( --t > 0 ) { free(w[t].hist); }
+	  free(w);
+	  return(kDEM_ERR_NOMEM);
+	}
+  }
+  for(started=1; started < nthreads; started++) { 
+	if ( pthread_create(&w[started].tid, NULL, decodegridrows, &w[started]) != 0 ) { 
+	  break;
+	}
+  }
+  // any worker that didn't start runs here after our own share
+  decodegridrows(&w[0]);
+  for(t=started; t < nthreads; t++) { 
+	decodegridrows(&w[t]);
+  }
+  for(t=1; t < started; t++) { 
+	pthread_join(w[t].tid, NULL);
+  }
+
+  // report the first bad profile in file order, as a serial pass would
+  bad = -1;
+  for(t=0; t < nthreads; t++) { 
+	if ( w[t].bad_profile >= 0 && (bad < 0 || w[t].bad_profile < w[bad].bad_profile) ) { 
+	  bad = t;
+	}
+	if ( w[t].min_elev < g->min_elev ) { g->min_elev = w[t].min_elev; }
+	if ( w[t].max_elev > g->max_elev ) { g->max_elev = w[t].max_elev; }
+	if ( w[t].prof_min_elev < g->prof_min_elev ) { g->prof_min_elev = w[t].prof_min_elev; }
+	if ( w[t].prof_max_elev > g->prof_max_elev ) { g->prof_max_elev = w[t].prof_max_elev; }
+	if ( t > 0 && w[t].hist != NULL ) { 
+	  for(i=0; i < kLUT_SIZE; i++) { hist[i] += w[t].hist[i]; }
+	  free(w[t].hist);
+	}
+  }
+  if ( bad >= 0 ) { 
+	snprintf(err, errlen, "%s", w[bad].err);
+	t = w[bad].status;
+	free(w);
+	return(t);
+  }
+  free(w);
+  return(0);
+}
+
+/* Decode the 1024 byte Type A record into h.  No checking is done
+   here; that is up to the caller.
+*/
+void parsetypea(const char *type_a_record, struct demheader *h) { 
+  int i;
+
+  /*
+	All fields are represented in ASCII
+	chars are the literal ascii string
+	flags are 2 bytes 
+	shorts are 4 bytes 
+	ints are 6 bytes 
+	floats are 12 bytes
+	doubles are 24 bytes
+  */
+
+  /* Field 1 - char string DEM name field.  bytes 0 to 143 */
+  memcpy(h->name, type_a_record, 144);
+  h->name[144] = '\0';
+
+  /* Field 2 - int DEM level code bytes 144 to 149 */
+  h->dem_level_code = getnextint(&type_a_record[144]);
+
+  /* Field 3 - int pattern code bytes 150 to 155 */
+  h->pattern_code = getnextint(&type_a_record[150]);
+
+  /* Field 4 - int planimetric reference system code bytes 156 to 161 */
+  h->plan_ref_sys_code = getnextint(&type_a_record[156]);
+
+  /* Field 5 - int zone code bytes 162 to 167 */
+  h->zone_code = getnextint(&type_a_record[162]);
+
+  /* Field 6 - double x 15 map projection parameters bytes 168 to 527 */
+  for(i=0; i < 15; i++) { 
+	h->map_proj_param[i] = getnextdouble(&type_a_record[168+i*kDOUBLE_LENGTH]);
+  }
+
+  /* Field 7 - int ground units code bytes 528 to 533 */
+  h->ground_units_code = getnextint(&type_a_record[528]);
+
+  /* Field 8 - int elevation units code bytes 534 to 539 */
+  h->elev_units_code = getnextint(&type_a_record[534]);
+
+  /* Field 9 - int dem polygon sides bytes 540 545 */
+  h->poly_sides = getnextint(&type_a_record[540]);
+
+  /* Field 10 - (double,double) x 4 polygon vertex coords bytes 546 to 737 */
+  for(i=0; i < 8; i++) {
+	h->poly_verts[i] = getnextdouble(&type_a_record[546 + i * kDOUBLE_LENGTH]);
+  }
+
+  /* Field 11 double,double min and max elevations in DEM bytes 738 to
+	 761 and 762 to 785
+  */
+  h->min_elev = getnextdouble(&type_a_record[738]);
+  h->max_elev = getnextdouble(&type_a_record[762]);
+
+  /* Field 12 double ccw angle from primary axis bytes 786 to 809 */
+  h->angle_from_axis = getnextdouble(&type_a_record[786]);
+
+  /* Field 13 int accuracy code bytes 810 to 815 */
+  h->accuracy_code = getnextint(&type_a_record[810]);
+
+  /* Field 14 float x 3 DEM spatial resolution bytes 816 to 851 */
+  h->x_res = getnextfloat(&type_a_record[816]);
+  h->y_res = getnextfloat(&type_a_record[828]);
+  h->z_res = getnextfloat(&type_a_record[840]);
+
+  /* Field 15 int x 2 profile array rows and columns bytes 852 to 857
+	 and 858 to 863
+  */
+  h->profile_dim = getnextint(&type_a_record[852]);
+  h->profile_num = getnextint(&type_a_record[858]);
+}
+
+/* Work out the window of a DEM covering box, given as west, south,
+   east and north in arc-seconds.  Profiles step east from the west
+   edge of the DEM polygon by x_res and samples north from its south
+   edge by y_res; the window holds those on or inside the box.  Returns
+   0, or with a message in err kDEM_ERR_FORMAT if the DEM isn't in
+   arc-seconds or kDEM_ERR_WINDOW if the box misses it.
+*/
+int windowdem(const struct demheader *h, int profile_elevs, const double *box, struct demwindow *w,
+			  char *err, size_t errlen) { 
+  double x0, y0;
+  int k0, k1, j0, j1;
+
+  if ( h->ground_units_code != 3 ) { 
+	snprintf(err, errlen, "A window needs a DEM in arc-seconds, not %s.", groundunits(h->ground_units_code));
+	return(kDEM_ERR_FORMAT);
+  }
+  if ( h->x_res <= 0.0 || h->y_res <= 0.0 ) { 
+	snprintf(err, errlen, "Bad resolution %g, %g.", h->x_res, h->y_res);
+	return(kDEM_ERR_FORMAT);
+  }
+  x0 = fmin(fmin(h->poly_verts[0], h->poly_verts[2]), fmin(h->poly_verts[4], h->poly_verts[6]));
+  y0 = fmin(fmin(h->poly_verts[1], h->poly_verts[3]), fmin(h->poly_verts[5], h->poly_verts[7]));
+  // a little slack so a box edge on a sample includes it
+  k0 = (int)ceil((box[0] - x0) / h->x_res - 1e-6);
+  k1 = (int)floor((box[2] - x0) / h->x_res + 1e-6);
+  j0 = (int)ceil((box[1] - y0) / h->y_res - 1e-6);
+  j1 = (int)floor((box[3] - y0) / h->y_res + 1e-6);
+  if ( k0 < 0 ) { k0 = 0; }
+  if ( j0 < 0 ) { j0 = 0; }
+  if ( k1 > h->profile_num - 1 ) { k1 = h->profile_num - 1; }
+  if ( j1 > profile_elevs - 1 ) { j1 = profile_elevs - 1; }
+  if ( k0 > k1 || j0 > j1 ) { 
+	snprintf(err, errlen, "The window is outside the DEM.");
+	return(kDEM_ERR_WINDOW);
+  }
+  w->first_profile = k0;
+  w->profiles = k1 - k0 + 1;
+  w->first_sample = j0;
+  w->samples = j1 - j0 + 1;
+  return(0);
+}
+
+/* The header of a window of h, with its corners moved in to the
+   window's outermost profiles and samples
+*/
+void windowheader(struct demheader *wh, const struct demheader *h, const struct demwindow *w) { 
+  double x0, y0, x1, y1;
+  *wh = *h;
+  x0 = fmin(fmin(h->poly_verts[0], h->poly_verts[2]), fmin(h->poly_verts[4], h->poly_verts[6]));
+  y0 = fmin(fmin(h->poly_verts[1], h->poly_verts[3]), fmin(h->poly_verts[5], h->poly_verts[7]));
+  x0 += w->first_profile * h->x_res;
+  y0 += w->first_sample * h->y_res;
+  x1 = x0 + (w->profiles - 1) * h->x_res;
+  y1 = y0 + (w->samples - 1) * h->y_res;
+  // SW, NW, NE, SE
+  wh->poly_verts[0] = x0; wh->poly_verts[1] = y0;
+  wh->poly_verts[2] = x0; wh->poly_verts[3] = y1;
+  wh->poly_verts[4] = x1; wh->poly_verts[5] = y1;
+  wh->poly_verts[6] = x1; wh->poly_verts[7] = y0;
+}
+
+/* The profile reader.
+
+   opendem() maps a DEM, parses and checks its Type A record, takes
+   the samples per profile from the first Type B record and indexes
+   the rest.  nextprofile() then decodes one profile per call, west to
+   east, into the caller's buffer; setwindow() narrows that to a box
+   as --window does.  Nothing is allocated per profile.
+*/
+
+/* Returns 0, or an error code with a message in err, in which case
+   nothing is left open.
+*/
+int opendem(struct demreader *r, const char *path, char *err, size_t errlen) { 
+  int status;
+
+  memset(r, 0, sizeof(*r));
+  if ( mapdem(&r->map, path) != 0 ) { 
+	snprintf(err, errlen, "%s: %s.", path, strerror(errno));
+	return(kDEM_ERR_IO);
+  }
+  if ( r->map.size < kTYPE_A_SIZE + 24 ) { 
+	snprintf(err, errlen, "%s: truncated DEM file.", path);
+	unmapdem(&r->map);
+	return(kDEM_ERR_TRUNCATED);
+  }
+  parsetypea(r->map.data, &r->h);
+  r->profile_elevs = getnextint(&r->map.data[kTYPE_A_SIZE + 12]);
+  if ((status = checkheader(&r->h, err, errlen)) == 0 && r->profile_elevs < 1 ) { 
+	snprintf(err, errlen, "Expecting elevations, got %d.", r->profile_elevs);
+	status = kDEM_ERR_FORMAT;
+  }
+  if ( status == 0 && (status = indexdem(&r->map, r->h.profile_num)) != 0 ) { 
+	snprintf(err, errlen, "Out of memory.");
+  }
+  if ( status != 0 ) { 
+	unmapdem(&r->map);
+	return(status);
+  }
+  r->window.first_profile = 0;
+  r->window.profiles = r->h.profile_num;
+  r->window.first_sample = 0;
+  r->window.samples = r->profile_elevs;
+  r->next = 0;
+  return(0);
+}
+
+/* Read only the profiles and samples inside box (west, south, east
+   and north in arc-seconds), starting again from the first of them.
+   Returns 0, or an error code from windowdem() with the window left
+   as it was.
+*/
+int setwindow(struct demreader *r, const double *box, char *err, size_t errlen) { 
+  struct demwindow w;
+  int status;
+  if ((status = windowdem(&r->h, r->profile_elevs, box, &w, err, errlen)) != 0) { 
+	return(status);
+  }
+  r->window = w;
+  r->next = 0;
+  return(0);
+}
+
+/* Decode the window's samples of the next profile into elevs, which
+   holds r->window.samples ints, and its Type B header into info if it
+   isn't NULL.  Returns 1, 0 once every profile has been read, or an
+   error code with a message in err.
+*/
+int nextprofile(struct demreader *r, int *elevs, struct profileinfo *info, char *err, size_t errlen) { 
+  int status;
+  if ( r->next >= r->window.profiles ) { 
+	return(0);
+  }
+  if ((status = readslice(&r->map, r->window.first_profile + r->next + 1, r->h.profile_dim, r->profile_elevs,
+						  r->window.first_sample, r->window.samples, info, elevs, err, errlen)) != 0) { 
+	return(status);
+  }
+  r->next++;
+  return(1);
+}
+
+void closedem(struct demreader *r) { 
+  unmapdem(&r->map);
+}
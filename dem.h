@@ -0,0 +1,186 @@
+/* dem.h
+ *
+ *  libdem, the USGS DEM decoding behind dem2tga: Type A header
+ *  parsing, Type B profile decoding and 8 bit TGA writing, for
+ *  programs that want the elevations in-process rather than a TGA file
+ *  on disk.
+ *
+ *  Nothing here exits or keeps global state.  Functions that can fail
+ *  return 0 or one of the kDEM_ERR codes below, with a message in the
+ *  caller's err buffer where they take one.  Everything works on
+ *  caller owned structs, so any number of DEMs can be open at once
+ *  and read from as many threads as they like.
+ *
+ *  The quickest way in is the profile reader:
+ *
+ *    struct demreader r;
+ *    opendem(&r, "file.dem", err, sizeof(err));
+ *    while ((status = nextprofile(&r, elevs, NULL, err, sizeof(err))) > 0) { ... }
+ *    closedem(&r);
+ *
+ *  where elevs holds r.window.samples ints.
+ */
+
+#ifndef DEM_H
+#define DEM_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define kTYPE_A_SIZE 1024
+#define kTYPE_B_SIZE 8192
+
+#define kINT_LENGTH 6
+#define kFLOAT_LENGTH 12
+#define kDOUBLE_LENGTH 24
+
+#define kPROFILE_HEADER_SIZE 144
+#define kBLOCK_SIZE 1024
+#define kFIRST_BLOCK_ELEVS 146
+#define kBLOCK_ELEVS 170
+
+#define kTGA_HEADER_SIZE (18 + 256 * 3)
+
+/* TGA image types written: color mapped, plain or run length encoded */
+#define kTGA_MAPPED 1
+#define kTGA_MAPPED_RLE 9
+
+/* Image descriptor origin bits: where the first row written goes */
+#define kTGA_BOTTOM_LEFT 0x00
+#define kTGA_TOP_LEFT 0x20
+
+/* Error codes.  kDEM_ERR_IO leaves the reason in errno. */
+#define kDEM_OK 0
+#define kDEM_ERR_IO -1
+#define kDEM_ERR_NOMEM -2
+#define kDEM_ERR_TRUNCATED -3
+#define kDEM_ERR_FORMAT -4
+#define kDEM_ERR_WINDOW -5
+
+/* An input DEM held in memory.  Normally a read-only mapping of the
+   whole file; if the file can't be mapped (a pipe, say) it is read
+   into a malloc'd buffer instead and `mapped' is 0.  Once indexdem()
+   has run, record[] holds the offset of each Type B record.
+*/
+struct demmap {
+  char *data;
+  size_t size;
+  int mapped;
+  size_t *record;
+  int records;
+};
+
+/* The Type A record fields */
+struct demheader { 
+  char name[145];
+  int dem_level_code, pattern_code, plan_ref_sys_code, zone_code;
+  double map_proj_param[15];
+  int ground_units_code, elev_units_code, poly_sides;
+  double poly_verts[8];
+  double min_elev, max_elev, angle_from_axis;
+  int accuracy_code;
+  float x_res, y_res, z_res;
+  int profile_dim, profile_num;
+};
+
+/* Per profile fields from the header of a Type B record */
+struct profileinfo { 
+  int dim, id, elevs, columns;
+  double x, y, local_elev, min_elev, max_elev;
+};
+
+/* The part of a DEM being converted: profiles first_profile to
+   first_profile+profiles-1 and the same samples of each, counting
+   from 0.  Normally the whole DEM; see windowdem().
+*/
+struct demwindow { 
+  int first_profile, profiles;
+  int first_sample, samples;
+};
+
+/* A whole DEM decoded into memory, one row per profile */
+struct demgrid { 
+  int rows, cols;
+  int16_t *elev;
+  int min_elev, max_elev;              // of the decoded samples
+  double prof_min_elev, prof_max_elev; // from the Type B headers
+};
+
+/* Quantization.
+
+   Elevations are small integers, so the mapping to 8 bit pixels is a
+   table over every int16 value, built once per conversion.  Values
+   off either end of the range saturate at 0 and 255 rather than
+   wrapping.  The table is either linear in min_elev and
+   scaling_factor, or histogram equalized for -H.
+*/
+#define kLUT_SIZE 65536
+#define kLUT_OFFSET 32768
+
+struct quantizer { 
+  double min_elev, scaling_factor;
+  int equalized;
+  unsigned char lut[kLUT_SIZE];
+};
+
+/* A DEM opened for reading profile by profile */
+struct demreader { 
+  struct demmap map;
+  struct demheader h;
+  int profile_elevs;
+  struct demwindow window;
+  int next;               // next profile of the window, from 0
+};
+
+const char *demerror(int code);
+
+/* fields */
+int getnextint(const char *s);
+double getnextdouble(const char *s);
+float getnextfloat(const char *s);
+void decodefields(const char *s, int n, int *out);
+size_t sampleoffset(int s);
+void decoderange(const char *rec, int first, int n, int *out);
+
+/* files and records */
+int mapdem(struct demmap *m, const char *path);
+void unmapdem(struct demmap *m);
+size_t profilebytes(int elevs);
+size_t recordbytes(int elevs);
+int indexdem(struct demmap *m, int profile_num);
+void parsetypea(const char *type_a_record, struct demheader *h);
+int checkheader(const struct demheader *h, char *err, size_t errlen);
+const char *groundunits(int code);
+const char *elevunits(int code);
+
+/* profiles */
+int readslice(const struct demmap *dem, int profile, int profile_dim, int profile_elevs, int first, int n,
+			  struct profileinfo *info, int *elevs, char *err, size_t errlen);
+int readprofile(const struct demmap *dem, int profile, int profile_dim, int profile_elevs,
+				struct profileinfo *info, int *elevs, char *err, size_t errlen);
+int decodegrid(const struct demmap *dem, int profile_num, int profile_dim, int profile_elevs,
+			   int nthreads, struct demgrid *g, uint32_t *hist, char *err, size_t errlen);
+
+/* windows */
+int windowdem(const struct demheader *h, int profile_elevs, const double *box, struct demwindow *w,
+			  char *err, size_t errlen);
+void windowheader(struct demheader *wh, const struct demheader *h, const struct demwindow *w);
+
+/* the profile reader */
+int opendem(struct demreader *r, const char *path, char *err, size_t errlen);
+int setwindow(struct demreader *r, const double *box, char *err, size_t errlen);
+int nextprofile(struct demreader *r, int *elevs, struct profileinfo *info, char *err, size_t errlen);
+void closedem(struct demreader *r);
+
+/* pixels */
+void linearlut(struct quantizer *q, double min_elev, double scaling_factor);
+void equalizedlut(struct quantizer *q, const uint32_t *hist);
+void quantizerow(const int *elevs, int n, const struct quantizer *q, unsigned char *row);
+void tgaheader(unsigned char *hdr, int r, int c, int type, int origin);
+int writetgaheader(FILE *fptr, int r, int c, int type, int origin);
+size_t tgarowbound(int c);
+size_t encodetgarow(const unsigned char *row, int c, unsigned char *out);
+int writetgarow(FILE *fptr, const unsigned char *row, int c, int type);
+
+#endif
@@ -13,6 +13,9 @@
  *  and DOS versions of gcc and many other C compilers.  If you have any
  *  questions or comments email jonl@alltel.net.
  *
+ *  The DEM decoding and TGA writing live in libdem (dem.h, dem.c);
+ *  this file is the command line program built on them.
+ *
  */
 
 #include <stdlib.h>
@@ -22,146 +25,4920 @@
 #include <ctype.h>
 #include <math.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
 
-#define kTYPE_A_SIZE 1024
-#define kTYPE_B_SIZE 8192
-
-#define kINT_LENGTH 6
-#define kFLOAT_LENGTH 12
-#define kDOUBLE_LENGTH 24
+#include "dem.h"
 
 void usage() { 
-  fprintf(stderr,"usage: dem2tga [-v] [-n] -m min_elev -s scale_factor dem_file tga_file\n");
-  fprintf(stderr,"       dem2tga [-v] [-n] -e dem_file1 [dem_file2 ...]\n");
+  fprintf(stderr,"usage: dem2tga [-v] [-n] [-c] [-j threads] [-a | -H | -m min_elev -s scale_factor] [-p levels | -r WxH] [-F filter] [-f format] [--hillshade[=az,alt]] [--slope] [--aspect] [--rle | --north-up] [--window=w,s,e,n] [--stats=json [--stats-out=f]] dem_file tga_file\n");
+  fprintf(stderr,"       dem2tga [-v] [-n] [-C catalog [-j threads]] -e dem_file1 [dem_file2 ...]\n");
+  fprintf(stderr,"       dem2tga [-v] [-c] [-j threads] --percentile[=lo,hi] -e dem_file1 [dem_file2 ...]\n");
+  fprintf(stderr,"       dem2tga [-v] [-j threads] [-m min_elev -s scale_factor] [--stats=json [--stats-out=f]] -b [-B manifest] [--rebuild=f] [dem_file tga_file ...]\n");
+  fprintf(stderr,"       dem2tga [-v] [-m min_elev -s scale_factor] [--rle] -M tga_file dem_file1 [dem_file2 ...]\n");
+  fprintf(stderr,"       dem2tga [-v] [-j threads] [--stats=json [--stats-out=f]] [--cache-mb=n] --serve=socket\n");
   fprintf(stderr,"                -v : verbose\n");
   fprintf(stderr,"                -n : print DEM name(s) to stdout\n");
   fprintf(stderr,"                -e : extract global elevation scale\n");
+  fprintf(stderr,"                --percentile[=lo,hi] : with -e, scale from the lo to hi percentile of the\n");
+  fprintf(stderr,"                                       decoded elevations (0.1,99.9) rather than the headers\n");
   fprintf(stderr,"                -m n -s n : force min_elev to n and scale to n\n");
+  fprintf(stderr,"                -a : scale from the decoded elevations, not the header\n");
+  fprintf(stderr,"                -H : histogram equalize rather than scale linearly\n");
+  fprintf(stderr,"                -j n : decode profiles (or batch files) with n threads\n");
+  fprintf(stderr,"                -b : batch convert dem_file tga_file pairs in one process\n");
+  fprintf(stderr,"                -B f : batch convert the pairs listed in manifest f (- for stdin)\n");
+  fprintf(stderr,"                --rebuild=f : with -b, skip pairs whose TGA build record f says is current\n");
+  fprintf(stderr,"                -M : mosaic the DEM tiles into one image\n");
+  fprintf(stderr,"                -p n : also write n-1 reduced levels, tga_file_2.tga, _4.tga ...\n");
+  fprintf(stderr,"                -r WxH : write the TGA W pixels wide and H high, resampling as it goes\n");
+  fprintf(stderr,"                -F f : pyramid filter, box (default), min or max; for -r box or bilinear\n");
+  fprintf(stderr,"                -f f : also write full precision elevations, f is raw, pgm or f32\n");
+  fprintf(stderr,"                -C f : keep -e/-n header fields in catalog f, reading only new or changed files\n");
+  fprintf(stderr,"                --hillshade[=az,alt] : also write tga_file_hillshade.tga, sun at az,alt degrees (315,45)\n");
+  fprintf(stderr,"                --slope, --aspect : also write tga_file_slope.tga, tga_file_aspect.tga\n");
+  fprintf(stderr,"                --rle : write run length encoded (type 9) TGAs\n");
+  fprintf(stderr,"                --north-up : write the TGA north up, a column per profile, not a row\n");
+  fprintf(stderr,"                --window=w,s,e,n : convert only the part inside the box, in degrees\n");
+  fprintf(stderr,"                                   or arc-seconds with an s suffix (e.g. -432000s)\n");
+  fprintf(stderr,"                --serve=socket : take conversion requests on a Unix socket, see demclient\n");
+  fprintf(stderr,"                --cache-mb=n : keep up to n MB of decoded DEMs between requests (256)\n");
+  fprintf(stderr,"                --stats=json : write per phase timings and counts for each file converted\n");
+  fprintf(stderr,"                --stats-out=f : write the stats to f rather than stderr\n");
+  fprintf(stderr,"                -c : write a dem_file.demc cache of the decoded DEM, used by later runs\n");
+  fprintf(stderr,"                     (with --percentile, a dem_file.demh cache of its histogram)\n");
   exit(1);
 }
 
-int writetgaheader(FILE *fptr, int r, int c) {
-  int i;
-  fputc(0, fptr); fputc(1, fptr); fputc(1, fptr);
-  fputc(0, fptr); fputc(0, fptr); fputc(0, fptr);
-  fputc(1, fptr); fputc(24, fptr); fputc(0, fptr);
-  fputc(0, fptr); fputc(0, fptr); fputc(0, fptr);
-  fputc((char)(c & 0x00ff), fptr); 
-  fputc((char)((c & 0xff00) >> 8), fptr);
-  fputc((char)(r & 0x00ff), fptr);
-  fputc((char)((r & 0xff00) >> 8), fptr);
-  fputc(8, fptr); fputc(0, fptr);
-
-  for(i=0; i<=255; i++) { 
-	fputc(i, fptr); 
-	fputc(i, fptr);
-	fputc(i, fptr); 
-  }
-  fflush(fptr);
-  return 0;
-}
-
-int getnextint(char *s) { 
-  char buf[kINT_LENGTH+1];
+/* Row sinks.
+
+   Extra outputs fed the decoded elevations of each profile, in
+   profile order, alongside the main TGA.  finish() is always called
+   once, with the status of the conversion so far, and releases the
+   sink.
+*/
+struct rowsink { 
+  int (*row)(struct rowsink *s, const int *elevs, char *err, size_t errlen);
+  int (*finish)(struct rowsink *s, int status, char *err, size_t errlen);
+  struct rowsink *next;
+};
+
+void addsink(struct rowsink **chain, struct rowsink *s) { 
+  while ( *chain != NULL ) { 
+	chain = &(*chain)->next;
+  }
+  *chain = s;
+}
+
+int sinkrow(struct rowsink *s, const int *elevs, char *err, size_t errlen) { 
+  for(; s != NULL; s = s->next) { 
+	if ( s->row(s, elevs, err, errlen) != 0 ) { 
+	  return(-1);
+	}
+  }
+  return(0);
+}
+
+int sinkfinish(struct rowsink *s, int status, char *err, size_t errlen) { 
+  struct rowsink *next;
+  for(; s != NULL; s = next) { 
+	next = s->next;
+	if ( s->finish(s, status, err, errlen) != 0 ) { 
+	  status = -1;
+	}
+  }
+  return(status);
+}
+
+/* Reduced resolution pyramid.
+
+   Level k is 1:2^k, each level built from the one above by combining
+   2x2 blocks (box average, min or max), with the odd row or column at
+   the far edge combined on its own.  Every level holds just the one
+   pending row it is accumulating, so memory is O(columns) per level.
+*/
+#define kFILTER_BOX 0
+#define kFILTER_MIN 1
+#define kFILTER_MAX 2
+
+struct pyramidlevel { 
+  FILE *fp;
+  char *name;
+  int rows, cols;
+  int pending;            // input rows accumulated so far, 0 or 1
+  long *acc;
+  int *cnt;
+  int *out;
+  unsigned char *tga_row;
+};
+
+struct pyramidsink { 
+  struct rowsink sink;
+  int nlevels, filter, top_cols, tga_type;
+  const struct quantizer *q;
+  struct pyramidlevel *lv;   // lv[0] is 1:2
+};
+
+static int pyramidemit(struct pyramidsink *p, int k, char *err, size_t errlen);
+
+/* Fold one row of level k-1 (top_cols wide for k == 0) into level k */
+static int pyramidfeed(struct pyramidsink *p, int k, const int *elevs, char *err, size_t errlen) { 
+  struct pyramidlevel *l = &p->lv[k];
+  int in_cols = k == 0 ? p->top_cols : p->lv[k-1].cols;
+  int i, c;
+
+  if ( l->pending == 0 ) { 
+	for(c=0; c < l->cols; c++) { 
+	  l->acc[c] = p->filter == kFILTER_MIN ? LONG_MAX : (p->filter == kFILTER_MAX ? LONG_MIN : 0);
+	  l->cnt[c] = 0;
+	}
+  }
+  for(i=0; i < in_cols; i++) { 
+	c = i >> 1;
+	switch(p->filter) { 
+	case kFILTER_MIN: if ( elevs[i] < l->acc[c] ) { l->acc[c] = elevs[i]; } break;
+	case kFILTER_MAX: if ( elevs[i] > l->acc[c] ) { l->acc[c] = elevs[i]; } break;
+	default: l->acc[c] += elevs[i]; break;
+	}
+	l->cnt[c]++;
+  }
+  if ( ++l->pending == 2 ) { 
+	return(pyramidemit(p, k, err, errlen));
+  }
+  return(0);
+}
+
+/* Write out the accumulated row of level k and pass it down */
+static int pyramidemit(struct pyramidsink *p, int k, char *err, size_t errlen) { 
+  struct pyramidlevel *l = &p->lv[k];
+  int c;
+  for(c=0; c < l->cols; c++) { 
+	if ( p->filter == kFILTER_BOX ) { 
+	  l->out[c] = (int)floor((double)l->acc[c] / l->cnt[c] + 0.5);
+	} else { 
+	  l->out[c] = (int)l->acc[c];
+	}
+  }
+  l->pending = 0;
+  quantizerow(l->out, l->cols, p->q, l->tga_row);
+  if ( writetgarow(l->fp, l->tga_row, l->cols, p->tga_type) != 0 ) { 
+	snprintf(err, errlen, "%s: write: %s.", l->name, strerror(errno));
+	return(-1);
+  }
+  if ( k + 1 < p->nlevels ) { 
+	return(pyramidfeed(p, k + 1, l->out, err, errlen));
+  }
+  return(0);
+}
+
+static int pyramidrow(struct rowsink *s, const int *elevs, char *err, size_t errlen) { 
+  return(pyramidfeed((struct pyramidsink *)s, 0, elevs, err, errlen));
+}
+
+static int pyramidfinish(struct rowsink *s, int status, char *err, size_t errlen) { 
+  struct pyramidsink *p = (struct pyramidsink *)s;
+  int k;
+  // flush the odd last rows, top level first so they trickle down
+  for(k=0; status == 0 && k < p->nlevels; k++) { 
+	if ( p->lv[k].pending != 0 && pyramidemit(p, k, err, errlen) != 0 ) { 
+	  status = -1;
+	}
+  }
+  for(k=0; k < p->nlevels; k++) { 
+	struct pyramidlevel *l = &p->lv[k];
+	if ( l->fp != NULL && fclose(l->fp) != 0 && status == 0 ) { 
+	  snprintf(err, errlen, "%s: close: %s.", l->name, strerror(errno));
+	  status = -1;
+	}
+	free(l->name);
+	free(l->acc);
+	free(l->cnt);
+	free(l->out);
+	free(l->tga_row);
+  }
+  free(p->lv);
+  free(p);
+  return(status);
+}
+
+/* Name of a derived output: tga_name with suffix inserted before the
+   extension, or appended if it has none.
+*/
+char *derivedname(const char *tga_name, const char *suffix) { 
+  const char *dot;
+  char *name;
+  size_t len;
+  dot = strrchr(tga_name, '.');
+  if ( dot == NULL || strchr(dot, '/') != NULL ) { 
+	dot = tga_name + strlen(tga_name);
+  }
+  len = strlen(tga_name) + strlen(suffix) + 5;
+  if ((name = malloc(len)) != NULL) { 
+	snprintf(name, len, "%.*s%s%s", (int)(dot - tga_name), tga_name, suffix, *dot ? dot : ".tga");
+  }
+  return(name);
+}
+
+/* Start a pyramid of levels-1 reduced images of a rows x cols image,
+   written next to tga_name as name_2.tga, name_4.tga ...  Returns NULL
+   with a message in err on failure.
+*/
+struct rowsink *newpyramid(const char *tga_name, int rows, int cols, int levels, int filter,
+						   const struct quantizer *q, int tga_type, char *err, size_t errlen) { 
+  struct pyramidsink *p;
+  char suffix[32];
+  int k;
+
+  if ((p = calloc(1, sizeof(*p))) == NULL ||
+	  (p->lv = calloc(levels, sizeof(struct pyramidlevel))) == NULL) { 
+	snprintf(err, errlen, "Out of memory.");
+	free(p);
+	return(NULL);
+  }
+  p->sink.row = pyramidrow;
+  p->sink.finish = pyramidfinish;
+  p->nlevels = levels - 1;
+  p->filter = filter;
+  p->top_cols = cols;
+  p->tga_type = tga_type;
+  p->q = q;
+  for(k=0; k < p->nlevels; k++) { 
+	struct pyramidlevel *l = &p->lv[k];
+	rows = (rows + 1) / 2;
+	cols = (cols + 1) / 2;
+	l->rows = rows;
+	l->cols = cols;
+	snprintf(suffix, sizeof(suffix), "_%d", 2 << k);
+	l->name = derivedname(tga_name, suffix);
+	l->acc = malloc(cols * sizeof(long));
+	l->cnt = malloc(cols * sizeof(int));
+	l->out = malloc(cols * sizeof(int));
+	l->tga_row = malloc(cols);
+	if ( l->name == NULL || l->acc == NULL || l->cnt == NULL || l->out == NULL || l->tga_row == NULL ) { 
+	  snprintf(err, errlen, "Out of memory.");
+	  pyramidfinish(&p->sink, -1, err, errlen);
+	  return(NULL);
+	}
+	if ((l->fp = fopen(l->name, "wb+")) == NULL || writetgaheader(l->fp, rows, cols, tga_type, kTGA_BOTTOM_LEFT) != 0 ) { 
+	  snprintf(err, errlen, "%s: %s.", l->name, strerror(errno));
+	  pyramidfinish(&p->sink, -1, err, errlen);
+	  return(NULL);
+	}
+  }
+  return(&p->sink);
+}
+
+/* Resampling to a given size for -r.
+
+   The main TGA written at out_cols x out_rows rather than the DEM's
+   own size, as the profiles stream in.  Both filters are separable:
+   each input row is first resampled across to out_cols, then each
+   output row is a weighted sum of those rows.  Bilinear maps corner
+   samples to corner pixels, since DEM samples are points; box
+   averages the inputs each output pixel covers, counting the ones on
+   its edges by how much of them it covers.
+
+   Input rows are taken in batches.  After each batch the cross pass
+   runs over the batch and the down pass over every output row whose
+   inputs are all in, both split over nthreads.  Only the resampled
+   rows an unfinished output row may still need are kept, in a ring.
+*/
+#define kFILTER_BILINEAR 3
+
+#define kPASS_COLS 0
+#define kPASS_ROWS 1
+
+/* Filter taps along one axis: output i is the sum over k < n[i] of
+   w[i * maxn + k] times input first[i] + k
+*/
+struct resampletaps { 
+  int *first, *n;
+  float *w;
+  int maxn;
+};
+
+struct resamplework { 
+  struct resamplesink *r;
+  int pass, first, n, t;
+  pthread_t tid;
+};
+
+struct resamplesink { 
+  struct rowsink sink;
+  FILE *fp;
+  const char *name;
+  int in_cols, out_rows, out_cols, nthreads, tga_type;
+  const struct quantizer *q;
+  struct resampletaps cols, rows;
+  int *batch;             // input rows waiting for the cross pass
+  int batch_rows, nbatch;
+  int rows_in;            // input rows received so far
+  float *ring;            // input row r resampled across, in slot r % ring_rows
+  int ring_rows;
+  int next_out;           // next output row to write
+  int chunk;              // output rows made at a time
+  float *acc;
+  int *out;
+  unsigned char *tga_rows;
+  struct resamplework *work;
+};
+
+static int maketaps(struct resampletaps *t, int in, int out, int filter) { 
+  double src, lo, hi;
+  float *w;
+  int i, j, k;
+
+  t->maxn = filter == kFILTER_BILINEAR ? 2 : (in + out - 1) / out + 2;
+  t->first = malloc(out * sizeof(int));
+  t->n = malloc(out * sizeof(int));
+  t->w = malloc((size_t)out * t->maxn * sizeof(float));
+  if ( t->first == NULL || t->n == NULL || t->w == NULL ) { 
+	return(-1);
+  }
+  for(i=0; i < out; i++) { 
+	w = &t->w[(size_t)i * t->maxn];
+	if ( filter == kFILTER_BILINEAR ) { 
+	  src = out > 1 ? (double)i * (in - 1) / (out - 1) : (in - 1) / 2.0;
+	  k = (int)floor(src);
+	  if ( k >= in - 1 ) { 
+		t->first[i] = in - 1;
+		t->n[i] = 1;
+		w[0] = 1.0f;
+	  } else { 
+		t->first[i] = k;
+		t->n[i] = 2;
+		w[0] = (float)(1.0 - (src - k));
+		w[1] = (float)(src - k);
+	  }
+	} else { 
+	  lo = (double)i * in / out;
+	  hi = (double)(i + 1) * in / out;
+	  t->first[i] = (int)floor(lo);
+	  for(k=0, j = t->first[i]; j < hi && j < in; j++, k++) { 
+		w[k] = (float)((fmin(hi, j + 1.0) - fmax(lo, j)) / (hi - lo));
+	  }
+	  t->n[i] = k;
+	}
+  }
+  return(0);
+}
+
+static void freetaps(struct resampletaps *t) { 
+  free(t->first);
+  free(t->n);
+  free(t->w);
+}
+
+static void *resampleworker(void *arg) { 
+  struct resamplework *w = arg;
+  struct resamplesink *r = w->r;
+  const struct resampletaps *t;
+  const float *tw;
+  float *acc, v;
+  int i, c, k, y;
+
+  for(i = w->t; i < w->n; i += r->nthreads) { 
+	if ( w->pass == kPASS_COLS ) { 
+	  // input row w->first + i, from the batch into the ring
+	  const int *in = &r->batch[(size_t)i * r->in_cols];
+	  float *row = &r->ring[(size_t)((w->first + i) % r->ring_rows) * r->out_cols];
+	  t = &r->cols;
+	  for(c=0; c < r->out_cols; c++) { 
+		tw = &t->w[(size_t)c * t->maxn];
+		for(v=0.0f, k=0; k < t->n[c]; k++) { 
+		  v += tw[k] * in[t->first[c] + k];
+		}
+		row[c] = v;
+	  }
+	} else { 
+	  // output row w->first + i, into chunk slot i
+	  y = w->first + i;
+	  t = &r->rows;
+	  tw = &t->w[(size_t)y * t->maxn];
+	  acc = &r->acc[(size_t)i * r->out_cols];
+	  for(c=0; c < r->out_cols; c++) { acc[c] = 0.0f; }
+	  for(k=0; k < t->n[y]; k++) { 
+		const float *row = &r->ring[(size_t)((t->first[y] + k) % r->ring_rows) * r->out_cols];
+		for(c=0; c < r->out_cols; c++) { 
+		  acc[c] += tw[k] * row[c];
+		}
+	  }
+	  for(c=0; c < r->out_cols; c++) { 
+		r->out[(size_t)i * r->out_cols + c] = (int)floorf(acc[c] + 0.5f);
+	  }
+	  quantizerow(&r->out[(size_t)i * r->out_cols], r->out_cols, r->q,
+				  &r->tga_rows[(size_t)i * r->out_cols]);
+	}
+  }
+  return(NULL);
+}
+
+/* Run one pass over rows first to first+n-1, round robin over the
+   threads; any that don't start run here after our own share
+*/
+static void resamplerun(struct resamplesink *r, int pass, int first, int n) { 
+  struct resamplework *w = r->work;
+  int t, started;
+  for(t=0; t < r->nthreads; t++) { 
+	w[t].r = r;
+	w[t].pass = pass;
+	w[t].first = first;
+	w[t].n = n;
+	w[t].t = t;
+  }
+  for(started=1; started < r->nthreads && started < n; started++) { 
+	if ( pthread_create(&w[started].tid, NULL, resampleworker, &w[started]) != 0 ) { 
+	  break;
+	}
+  }
+  resampleworker(&w[0]);
+  for(t=started; t < r->nthreads; t++) { 
+	resampleworker(&w[t]);
+  }
+  for(t=1; t < started; t++) { 
+	pthread_join(w[t].tid, NULL);
+  }
+}
+
+/* Resample the batch across, then make and write every output row
+   whose inputs are all in
+*/
+static int resampleflush(struct resamplesink *r, char *err, size_t errlen) { 
+  int ready, n, i;
+  if ( r->nbatch > 0 ) { 
+	resamplerun(r, kPASS_COLS, r->rows_in - r->nbatch, r->nbatch);
+	r->nbatch = 0;
+  }
+  for(ready = r->next_out; ready < r->out_rows && r->rows.first[ready] + r->rows.n[ready] <= r->rows_in; ready++) { 
+	;
+  }
+  while ( r->next_out < ready ) { 
+	n = ready - r->next_out < r->chunk ? ready - r->next_out : r->chunk;
+	resamplerun(r, kPASS_ROWS, r->next_out, n);
+	for(i=0; i < n; i++) { 
+	  if ( writetgarow(r->fp, &r->tga_rows[(size_t)i * r->out_cols], r->out_cols, r->tga_type) != 0 ) { 
+		snprintf(err, errlen, "%s: write: %s.", r->name, strerror(errno));
+		return(-1);
+	  }
+	}
+	r->next_out += n;
+  }
+  return(0);
+}
+
+static int resamplerow(struct rowsink *s, const int *elevs, char *err, size_t errlen) { 
+  struct resamplesink *r = (struct resamplesink *)s;
+  memcpy(&r->batch[(size_t)r->nbatch * r->in_cols], elevs, r->in_cols * sizeof(int));
+  r->nbatch++;
+  r->rows_in++;
+  if ( r->nbatch == r->batch_rows ) { 
+	return(resampleflush(r, err, errlen));
+  }
+  return(0);
+}
+
+static int resamplefinish(struct rowsink *s, int status, char *err, size_t errlen) { 
+  struct resamplesink *r = (struct resamplesink *)s;
+  if ( status == 0 && resampleflush(r, err, errlen) != 0 ) { 
+	status = -1;
+  }
+  if ( r->fp != NULL && fclose(r->fp) != 0 && status == 0 ) { 
+	snprintf(err, errlen, "%s: close: %s.", r->name, strerror(errno));
+	status = -1;
+  }
+  freetaps(&r->cols);
+  freetaps(&r->rows);
+  free(r->batch);
+  free(r->ring);
+  free(r->acc);
+  free(r->out);
+  free(r->tga_rows);
+  free(r->work);
+  free(r);
+  return(status);
+}
+
+/* Write tga_name as an out_cols x out_rows TGA resampled from the
+   rows x cols elevations fed to the sink, with filter kFILTER_BOX or
+   kFILTER_BILINEAR.  Returns NULL with a message in err on failure.
+*/
+struct rowsink *newresample(const char *tga_name, int rows, int cols, int out_rows, int out_cols, int filter,
+							int nthreads, const struct quantizer *q, int tga_type, char *err, size_t errlen) { 
+  struct resamplesink *r;
+
+  if ((r = calloc(1, sizeof(*r))) == NULL) { 
+	snprintf(err, errlen, "Out of memory.");
+	return(NULL);
+  }
+  r->sink.row = resamplerow;
+  r->sink.finish = resamplefinish;
+  r->name = tga_name;
+  r->in_cols = cols;
+  r->out_rows = out_rows;
+  r->out_cols = out_cols;
+  r->nthreads = nthreads;
+  r->tga_type = tga_type;
+  r->q = q;
+  r->batch_rows = 16 * nthreads;
+  r->chunk = 16 * nthreads;
+  if ( maketaps(&r->cols, cols, out_cols, filter) != 0 || maketaps(&r->rows, rows, out_rows, filter) != 0 ) { 
+	snprintf(err, errlen, "Out of memory.");
+	resamplefinish(&r->sink, -1, err, errlen);
+	return(NULL);
+  }
+  // an unfinished output row needs at most rows.maxn - 1 rows from before the batch
+  r->ring_rows = r->batch_rows + r->rows.maxn;
+  r->batch = malloc((size_t)r->batch_rows * cols * sizeof(int));
+  r->ring = malloc((size_t)r->ring_rows * out_cols * sizeof(float));
+  r->acc = malloc((size_t)r->chunk * out_cols * sizeof(float));
+  r->out = malloc((size_t)r->chunk * out_cols * sizeof(int));
+  r->tga_rows = malloc((size_t)r->chunk * out_cols);
+  r->work = calloc(nthreads, sizeof(struct resamplework));
+  if ( r->batch == NULL || r->ring == NULL || r->acc == NULL || r->out == NULL ||
+	   r->tga_rows == NULL || r->work == NULL ) { 
+	snprintf(err, errlen, "Out of memory.");
+	resamplefinish(&r->sink, -1, err, errlen);
+	return(NULL);
+  }
+  if ((r->fp = fopen(tga_name, "wb+")) == NULL || writetgaheader(r->fp, out_rows, out_cols, tga_type, kTGA_BOTTOM_LEFT) != 0 ) { 
+	snprintf(err, errlen, "%s: %s.", tga_name, strerror(errno));
+	resamplefinish(&r->sink, -1, err, errlen);
+	return(NULL);
+  }
+  return(&r->sink);
+}
+
+/* North-up output for --north-up.
+
+   Profiles run south to north, so written one per scanline as usual
+   the image comes out transposed, west at the bottom and north on the
+   right.  This sink turns it around as the profiles stream in, so the
+   TGA has one column per profile and one row per sample, north at the
+   top.  Every scanline needs a pixel from every profile, so rather
+   than hold the whole grid it quantizes a band of profiles at a time,
+   transposes the band tile by tile and writes each scanline's piece
+   of it straight into place in the file.  Only the band is kept: at
+   most kNORTH_BAND_BYTES, or kNORTH_TILE profiles if the DEM has too
+   many samples for that.
+
+   The scanlines go into the file north first with the origin bits set
+   to top left, so viewers that ignore the origin bits show it the
+   right way up too.
+*/
+#define kNORTH_TILE 64
+#define kNORTH_BAND_BYTES (4 << 20)
+
+struct northsink { 
+  struct rowsink sink;
+  FILE *fp;
+  const char *name;
+  int rows, cols;         // of the input: profiles x samples
+  const struct quantizer *q;
+  int band_rows, nband;   // profiles in a full band, and in this one
+  int band_first;         // first profile of this band
+  unsigned char *band;    // nband quantized profiles
+  unsigned char *strip;   // the band transposed, cols scanlines of nband
+};
+
+/* Transpose the band a tile at a time, flipping it so the northmost
+   sample comes first, then write each scanline's piece of it
+*/
+static int northflush(struct northsink *n, char *err, size_t errlen) { 
+  int r0, c0, r, c, r1, c1, cols = n->cols;
+  off_t off;
+  if ( n->nband == 0 ) { 
+	return(0);
+  }
+  for(c0=0; c0 < cols; c0 += kNORTH_TILE) { 
+	c1 = c0 + kNORTH_TILE < cols ? c0 + kNORTH_TILE : cols;
+	for(r0=0; r0 < n->nband; r0 += kNORTH_TILE) { 
+	  r1 = r0 + kNORTH_TILE < n->nband ? r0 + kNORTH_TILE : n->nband;
+	  for(c=c0; c < c1; c++) { 
+		unsigned char *out = &n->strip[(size_t)(cols - 1 - c) * n->nband];
+		for(r=r0; r < r1; r++) { 
+		  out[r] = n->band[(size_t)r * cols + c];
+		}
+	  }
+	}
+  }
+  for(c=0; c < cols; c++) { 
+	off = kTGA_HEADER_SIZE + (off_t)c * n->rows + n->band_first;
+	if ( pwrite(fileno(n->fp), &n->strip[(size_t)c * n->nband], n->nband, off) != (ssize_t)n->nband ) { 
+	  snprintf(err, errlen, "%s: write: %s.", n->name, strerror(errno));
+	  return(-1);
+	}
+  }
+  n->band_first += n->nband;
+  n->nband = 0;
+  return(0);
+}
+
+static int northrow(struct rowsink *s, const int *elevs, char *err, size_t errlen) { 
+  struct northsink *n = (struct northsink *)s;
+  quantizerow(elevs, n->cols, n->q, &n->band[(size_t)n->nband * n->cols]);
+  n->nband++;
+  if ( n->nband == n->band_rows ) { 
+	return(northflush(n, err, errlen));
+  }
+  return(0);
+}
+
+static int northfinish(struct rowsink *s, int status, char *err, size_t errlen) { 
+  struct northsink *n = (struct northsink *)s;
+  if ( status == 0 && northflush(n, err, errlen) != 0 ) { 
+	status = -1;
+  }
+  if ( n->fp != NULL && fclose(n->fp) != 0 && status == 0 ) { 
+	snprintf(err, errlen, "%s: close: %s.", n->name, strerror(errno));
+	status = -1;
+  }
+  free(n->band);
+  free(n->strip);
+  free(n);
+  return(status);
+}
+
+/* Write tga_name as a cols x rows TGA, north up, from the rows
+   profiles of cols samples fed to the sink.  Returns NULL with a
+   message in err on failure.
+*/
+struct rowsink *newnorthsink(const char *tga_name, int rows, int cols, const struct quantizer *q,
+							 char *err, size_t errlen) { 
+  struct northsink *n;
+
+  if ((n = calloc(1, sizeof(*n))) == NULL) { 
+	snprintf(err, errlen, "Out of memory.");
+	return(NULL);
+  }
+  n->sink.row = northrow;
+  n->sink.finish = northfinish;
+  n->name = tga_name;
+  n->rows = rows;
+  n->cols = cols;
+  n->q = q;
+  n->band_rows = kNORTH_BAND_BYTES / cols / kNORTH_TILE * kNORTH_TILE;
+  if ( n->band_rows < kNORTH_TILE ) { 
+	n->band_rows = kNORTH_TILE;
+  }
+  if ( n->band_rows > rows ) { 
+	n->band_rows = rows;
+  }
+  if ((n->band = malloc((size_t)n->band_rows * cols)) == NULL ||
+	  (n->strip = malloc((size_t)n->band_rows * cols)) == NULL) { 
+	snprintf(err, errlen, "Out of memory.");
+	northfinish(&n->sink, -1, err, errlen);
+	return(NULL);
+  }
+  if ((n->fp = fopen(tga_name, "wb+")) == NULL ||
+	  writetgaheader(n->fp, cols, rows, kTGA_MAPPED, kTGA_TOP_LEFT) != 0 || fflush(n->fp) != 0 ) { 
+	snprintf(err, errlen, "%s: %s.", tga_name, strerror(errno));
+	northfinish(&n->sink, -1, err, errlen);
+	return(NULL);
+  }
+  return(&n->sink);
+}
+
+/* Conversion statistics for --stats.
+
+   Wall and CPU time for each phase of a conversion, with byte and
+   sample counts.  Phases that run on several threads add up each
+   thread's busy time, so their times can exceed the elapsed time.
+   All of this is skipped when stats is NULL.
+*/
+#define kPHASE_HEADER 0
+#define kPHASE_READ 1
+#define kPHASE_DECODE 2
+#define kPHASE_QUANTIZE 3
+#define kPHASE_WRITE 4
+#define kPHASES 5
+
+static const char *phase_names[kPHASES] = { "header", "read", "decode", "quantize", "write" };
+
+struct demstats { 
+  double wall[kPHASES], cpu[kPHASES];
+  long long bytes_read, bytes_written;
+  long long profiles, samples, clipped;
+};
+
+struct phasetimer { 
+  double wall, cpu;
+};
+
+static double clockseconds(clockid_t id) { 
+  struct timespec ts;
+  clock_gettime(id, &ts);
+  return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+void phasestart(struct demstats *stats, struct phasetimer *t) { 
+  if ( stats != NULL ) { 
+	t->wall = clockseconds(CLOCK_MONOTONIC);
+	t->cpu = clockseconds(CLOCK_THREAD_CPUTIME_ID);
+  }
+}
+
+void phasestop(struct demstats *stats, int phase, struct phasetimer *t) { 
+  if ( stats != NULL ) { 
+	stats->wall[phase] += clockseconds(CLOCK_MONOTONIC) - t->wall;
+	stats->cpu[phase] += clockseconds(CLOCK_THREAD_CPUTIME_ID) - t->cpu;
+  }
+}
+
+void addstats(struct demstats *to, const struct demstats *from) { 
   int i;
-  for(i=0;i<kINT_LENGTH;i++) { buf[i] = s[i]; }
-  buf[kINT_LENGTH] = '\0';
-  return(atoi(buf));
+  for(i=0; i < kPHASES; i++) { 
+	to->wall[i] += from->wall[i];
+	to->cpu[i] += from->cpu[i];
+  }
+  to->bytes_read += from->bytes_read;
+  to->bytes_written += from->bytes_written;
+  to->profiles += from->profiles;
+  to->samples += from->samples;
+  to->clipped += from->clipped;
+}
+
+/* Fault in the pages of a profile record's header and of samples
+   first to first+n-1, which is the read proper when the DEM is mapped.
+   Returns the bytes touched.
+*/
+size_t touchprofile(const struct demmap *dem, int profile, int first, int n) { 
+  size_t rec, off, end, page, bytes;
+  volatile char sink;
+
+  if ( profile > dem->records ) { 
+	return(0);
+  }
+  rec = dem->record[profile - 1];
+  bytes = 0;
+  if ( rec + kPROFILE_HEADER_SIZE <= dem->size ) { 
+	sink = dem->data[rec];
+	bytes += kPROFILE_HEADER_SIZE;
+  }
+  off = rec + sampleoffset(first);
+  end = rec + profilebytes(first + n);
+  if ( end > dem->size ) { 
+	end = dem->size;
+  }
+  if ( off >= end ) { 
+	return(bytes);
+  }
+  bytes += end - off;
+  page = (size_t)sysconf(_SC_PAGESIZE);
+  for(; off < end; off += page) { 
+	sink = dem->data[off];
+  }
+  sink = dem->data[end - 1];
+  (void)sink;
+  return(bytes);
+}
+
+/* Samples a linear quantizer saturates, below 0 or above 255 */
+int clippedsamples(const int *elevs, int n, const struct quantizer *q) { 
+  int i, clipped = 0;
+  if ( q->equalized ) { 
+	return(0);
+  }
+  for(i=0; i < n; i++) { 
+	int v = (int)((elevs[i] - q->min_elev) * q->scaling_factor);
+	clipped += (v < 0 || v > 255);
+  }
+  return(clipped);
+}
+
+static void jsonstring(FILE *fp, const char *s) { 
+  fputc('"', fp);
+  for(; *s != '\0'; s++) { 
+	unsigned char c = *s;
+	if ( c == '"' || c == '\\' ) { 
+	  fprintf(fp, "\\%c", c);
+	} else if ( c < 0x20 ) { 
+	  fprintf(fp, "\\u%04x", c);
+	} else { 
+	  fputc(c, fp);
+	}
+  }
+  fputc('"', fp);
 }
 
-double getnextdouble(char *s) { 
-  char buf[kDOUBLE_LENGTH+1];
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Write the stats for one conversion as a single line JSON object.
+   Batch workers share fp, so whole lines go out under a lock.
+*/
+void writestats(FILE *fp, const char *dem_name, const char *tga_name, int status, const char *err,
+				const struct demstats *stats) { 
+  struct rusage ru;
+  long long peak_rss;
   int i;
-  for(i=0;i<kDOUBLE_LENGTH;i++) { 
-	buf[i] = s[i]; 
-	if( buf[i] == 'D' ) { 
-	  buf[i] = 'E';
+
+  // ru_maxrss is in kilobytes, except on the BSDs it is bytes
+  getrusage(RUSAGE_SELF, &ru);
+  peak_rss = ru.ru_maxrss;
+#if defined(__APPLE__)
+  peak_rss /= 1024;
+#endif
+  pthread_mutex_lock(&stats_lock);
+  fprintf(fp, "{\"file\":");
+  jsonstring(fp, dem_name);
+  fprintf(fp, ",\"output\":");
+  jsonstring(fp, tga_name);
+  fprintf(fp, ",\"status\":\"%s\"", status == 0 ? "ok" : "failed");
+  if ( status != 0 ) { 
+	fprintf(fp, ",\"error\":");
+	jsonstring(fp, err);
+  }
+  fprintf(fp, ",\"profiles\":%lld,\"samples\":%lld,\"clipped\":%lld",
+		  stats->profiles, stats->samples, stats->clipped);
+  fprintf(fp, ",\"bytes_read\":%lld,\"bytes_written\":%lld,\"peak_rss_kb\":%lld,\"phases\":{",
+		  stats->bytes_read, stats->bytes_written, peak_rss);
+  for(i=0; i < kPHASES; i++) { 
+	fprintf(fp, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}", i ? "," : "", phase_names[i],
+			stats->wall[i], stats->cpu[i]);
+  }
+  fprintf(fp, "}}\n");
+  fflush(fp);
+  pthread_mutex_unlock(&stats_lock);
+}
+
+/* Overlapped I/O.
+
+   A conversion otherwise takes turns: fault in a profile, decode it,
+   write its row, fault in the next.  An iopipe gives it a thread of
+   its own that keeps the mapped records up to kIO_AHEAD bytes past
+   the one being decoded resident, advising the kernel of each chunk
+   before touching it so the reads go out together, and writes the
+   TGA rows behind the decoder from two buffers of about kIO_BUFFER
+   bytes, one filling while the other drains.  Writes go before
+   read-ahead, so a slow disk holds up the decoder only when both
+   buffers are full.
+
+   Either side can be left out: no read-ahead without a mapped DEM,
+   no write-behind without a TGA file.
+*/
+#define kIO_AHEAD (8 << 20)
+#define kIO_CHUNK (1 << 20)
+#define kIO_BUFFER (1 << 20)
+
+struct iopipe { 
+  const struct demmap *dem;
+  const struct demwindow *w;
+  FILE *fp;
+  int tga_type;
+  int parsed;             // window profile being decoded
+  int fetched;            // window profiles resident so far
+  unsigned char *buf[2];
+  size_t len[2], cap;
+  int cur;                // buffer being filled
+  int pending;            // buffer being written, or -1
+  int done, error;        // error is the errno of a failed write
+  int started;
+  pthread_t tid;
+  pthread_mutex_t lock;
+  pthread_cond_t work, drained;
+};
+
+/* byte offset of the record of window profile k */
+static size_t iorecord(const struct iopipe *io, int k) { 
+  return(io->dem->record[io->w->first_profile + k]);
+}
+
+static int ioahead(const struct iopipe *io) { 
+  return(io->dem != NULL && io->fetched < io->w->profiles &&
+		 iorecord(io, io->fetched) < iorecord(io, io->parsed) + kIO_AHEAD);
+}
+
+static void *ioworker(void *arg) { 
+  struct iopipe *io = arg;
+  size_t first, last, page;
+  int b, k, end, error;
+
+  page = (size_t)sysconf(_SC_PAGESIZE);
+  pthread_mutex_lock(&io->lock);
+  for(;;) { 
+	if ( io->pending >= 0 ) { 
+	  b = io->pending;
+	  pthread_mutex_unlock(&io->lock);
+	  error = 0;
+	  if ( io->error == 0 && (fwrite(io->buf[b], 1, io->len[b], io->fp) != io->len[b] || fflush(io->fp) != 0) ) { 
+		error = errno != 0 ? errno : EIO;
+	  }
+	  pthread_mutex_lock(&io->lock);
+	  if ( error != 0 ) { 
+		io->error = error;
+	  }
+	  io->pending = -1;
+	  pthread_cond_signal(&io->drained);
+	} else if ( !io->done && ioahead(io) ) { 
+	  k = io->fetched;
+	  pthread_mutex_unlock(&io->lock);
+	  first = iorecord(io, k);
+	  for(end = k + 1; end < io->w->profiles && iorecord(io, end) < first + kIO_CHUNK; end++) { 
+		;
+	  }
+	  last = end < io->w->profiles ? iorecord(io, end) : io->dem->size;
+	  first -= first % page;
+	  madvise(io->dem->data + first, last - first, MADV_WILLNEED);
+	  for(; k < end; k++) { 
+		touchprofile(io->dem, io->w->first_profile + k + 1, io->w->first_sample, io->w->samples);
+	  }
+	  pthread_mutex_lock(&io->lock);
+	  io->fetched = end;
+	} else if ( io->done ) { 
+	  break;
+	} else { 
+	  pthread_cond_wait(&io->work, &io->lock);
+	}
+  }
+  pthread_mutex_unlock(&io->lock);
+  return(NULL);
+}
+
+/* Start overlapped I/O for the profiles of window w of dem (NULL for
+   none) and rows of a tga_type TGA written to fp (NULL for none),
+   which is already past its header.  Returns 0, or -1 with a message
+   in err.
+*/
+int startio(struct iopipe *io, const struct demmap *dem, const struct demwindow *w, FILE *fp, int tga_type,
+			char *err, size_t errlen) { 
+  memset(io, 0, sizeof(*io));
+  io->dem = dem != NULL && dem->mapped == 1 && dem->records >= w->first_profile + w->profiles ? dem : NULL;
+  io->w = w;
+  io->fp = fp;
+  io->tga_type = tga_type;
+  io->pending = -1;
+  if ( fp != NULL ) { 
+	io->cap = kIO_BUFFER + tgarowbound(w->samples);
+	if ((io->buf[0] = malloc(io->cap)) == NULL || (io->buf[1] = malloc(io->cap)) == NULL) { 
+	  snprintf(err, errlen, "Out of memory.");
+	  free(io->buf[0]);
+	  return(-1);
+	}
+  }
+  pthread_mutex_init(&io->lock, NULL);
+  pthread_cond_init(&io->work, NULL);
+  pthread_cond_init(&io->drained, NULL);
+  if ( (io->dem != NULL || fp != NULL) && pthread_create(&io->tid, NULL, ioworker, io) != 0 ) { 
+	snprintf(err, errlen, "Can't start the I/O thread.");
+	pthread_cond_destroy(&io->drained);
+	pthread_cond_destroy(&io->work);
+	pthread_mutex_destroy(&io->lock);
+	free(io->buf[0]);
+	free(io->buf[1]);
+	return(-1);
+  }
+  io->started = io->dem != NULL || fp != NULL;
+  return(0);
+}
+
+/* The decoder is starting on window profile k */
+void ioread(struct iopipe *io, int k) { 
+  if ( io->dem == NULL ) { 
+	return;
+  }
+  pthread_mutex_lock(&io->lock);
+  io->parsed = k;
+  if ( ioahead(io) ) { 
+	pthread_cond_signal(&io->work);
+  }
+  pthread_mutex_unlock(&io->lock);
+}
+
+/* Hand the filling buffer to the I/O thread once the other is empty */
+static int ioswap(struct iopipe *io) { 
+  int error;
+  pthread_mutex_lock(&io->lock);
+  while ( io->pending >= 0 ) { 
+	pthread_cond_wait(&io->drained, &io->lock);
+  }
+  error = io->error;
+  if ( error == 0 && io->len[io->cur] > 0 ) { 
+	io->pending = io->cur;
+	io->cur ^= 1;
+	io->len[io->cur] = 0;
+	pthread_cond_signal(&io->work);
+  }
+  pthread_mutex_unlock(&io->lock);
+  errno = error;
+  return(error == 0 ? 0 : -1);
+}
+
+/* Queue len bytes already in TGA form.  Returns 0, or -1 with errno
+   set if an earlier write failed.
+*/
+int ioqueue(struct iopipe *io, const unsigned char *bytes, size_t len) { 
+  if ( io->len[io->cur] + len > io->cap && ioswap(io) != 0 ) { 
+	return(-1);
+  }
+  memcpy(io->buf[io->cur] + io->len[io->cur], bytes, len);
+  io->len[io->cur] += len;
+  return(0);
+}
+
+/* Queue a row of c pixels, encoding it first for RLE output */
+int iorow(struct iopipe *io, const unsigned char *row, int c) { 
+  size_t need = io->tga_type == kTGA_MAPPED_RLE ? tgarowbound(c) : (size_t)c;
+  if ( io->len[io->cur] + need > io->cap && ioswap(io) != 0 ) { 
+	return(-1);
+  }
+  if ( io->tga_type == kTGA_MAPPED_RLE ) { 
+	io->len[io->cur] += encodetgarow(row, c, io->buf[io->cur] + io->len[io->cur]);
+  } else { 
+	memcpy(io->buf[io->cur] + io->len[io->cur], row, c);
+	io->len[io->cur] += c;
+  }
+  return(0);
+}
+
+/* Write whatever is queued and stop the I/O thread.  Returns status,
+   or -1 with a message in err if a write failed and status was 0.
+*/
+int finishio(struct iopipe *io, int status, const char *name, char *err, size_t errlen) { 
+  if ( io->fp != NULL && status == 0 && ioswap(io) != 0 ) { 
+	snprintf(err, errlen, "%s: write: %s.", name, strerror(errno));
+	status = -1;
+  }
+  if ( io->started ) { 
+	pthread_mutex_lock(&io->lock);
+	io->done = 1;
+	pthread_cond_signal(&io->work);
+	pthread_mutex_unlock(&io->lock);
+	pthread_join(io->tid, NULL);
+  }
+  if ( io->fp != NULL && status == 0 && io->error != 0 ) { 
+	snprintf(err, errlen, "%s: write: %s.", name, strerror(io->error));
+	status = -1;
+  }
+  pthread_cond_destroy(&io->drained);
+  pthread_cond_destroy(&io->work);
+  pthread_mutex_destroy(&io->lock);
+  free(io->buf[0]);
+  free(io->buf[1]);
+  return(status);
+}
+
+/* Multi-threaded profile decoding.
+
+   Workers claim profiles in order, decode and quantize each into one
+   of nslots row slots, and the writer (the calling thread) drains the
+   slots strictly in profile order, so the output is the same as the
+   single threaded loop.  A worker may run at most nslots profiles
+   ahead of the writer.  For RLE output the workers encode the rows
+   too, leaving the writer only the writes.
+*/
+struct decodepool { 
+  const struct demmap *dem;
+  int profile_num, profile_dim, profile_elevs;
+  int first_profile, first_sample, width;   // the window written
+  const struct quantizer *q;
+  int tga_type;
+  int nslots;
+  int next;             // next profile to hand out, from 0
+  int written;          // profiles written so far
+  int stop;
+  int *slot_profile;    // profile held by each slot, -1 while busy
+  int *slot_status;
+  char (*slot_err)[128];
+  int *elevs;
+  unsigned char *rows;
+  unsigned char *packed;  // each slot's row RLE encoded, tgarowbound(width) apiece
+  size_t *packed_len;
+  struct demstats *stats; // NULL unless --stats
+  pthread_mutex_t lock;
+  pthread_cond_t filled, drained;
+};
+
+static void *decodeworker(void *arg) { 
+  struct decodepool *p = arg;
+  struct demstats local, *stats;
+  struct phasetimer t;
+  int k, slot;
+
+  memset(&local, 0, sizeof(local));
+  stats = p->stats != NULL ? &local : NULL;
+  for(;;) { 
+	pthread_mutex_lock(&p->lock);
+	while ( !p->stop && p->next < p->profile_num && p->next >= p->written + p->nslots ) { 
+	  pthread_cond_wait(&p->drained, &p->lock);
+	}
+	if ( p->stop || p->next >= p->profile_num ) { 
+	  if ( stats != NULL ) { 
+		addstats(p->stats, stats);
+	  }
+	  pthread_mutex_unlock(&p->lock);
+	  return(NULL);
+	}
+	k = p->next++;
+	pthread_mutex_unlock(&p->lock);
+
+	slot = k % p->nslots;
+	if ( stats != NULL ) { 
+	  phasestart(stats, &t);
+	  stats->bytes_read += touchprofile(p->dem, p->first_profile + k + 1, p->first_sample, p->width);
+	  phasestop(stats, kPHASE_READ, &t);
+	}
+	phasestart(stats, &t);
+	p->slot_status[slot] = readslice(p->dem, p->first_profile + k + 1, p->profile_dim, p->profile_elevs,
+									 p->first_sample, p->width, NULL, &p->elevs[(size_t)slot * p->width],
+									 p->slot_err[slot], sizeof(p->slot_err[slot]));
+	phasestop(stats, kPHASE_DECODE, &t);
+	if ( p->slot_status[slot] == 0 ) { 
+	  phasestart(stats, &t);
+	  quantizerow(&p->elevs[(size_t)slot * p->width], p->width,
+				  p->q, &p->rows[(size_t)slot * p->width]);
+	  if ( stats != NULL ) { 
+		stats->clipped += clippedsamples(&p->elevs[(size_t)slot * p->width], p->width, p->q);
+		stats->profiles++;
+		stats->samples += p->width;
+	  }
+	  phasestop(stats, kPHASE_QUANTIZE, &t);
+	  if ( p->packed != NULL ) { 
+		phasestart(stats, &t);
+		p->packed_len[slot] = encodetgarow(&p->rows[(size_t)slot * p->width], p->width,
+										   &p->packed[(size_t)slot * tgarowbound(p->width)]);
+		phasestop(stats, kPHASE_WRITE, &t);
+	  }
 	}
+
+	pthread_mutex_lock(&p->lock);
+	p->slot_profile[slot] = k;
+	pthread_cond_broadcast(&p->filled);
+	pthread_mutex_unlock(&p->lock);
+  }
+}
+
+/* Decode, quantize and write the window w of dem to tgafile, a TGA of
+   tga_type, using nthreads workers, passing the elevations on to
+   sinks.  tgafile is NULL when a sink writes the main image.  Returns 0, or -1 with a message in err.
+   The workers add their timings to stats if it isn't NULL.
+*/
+int writeprofiles_mt(const struct demmap *dem, int profile_dim, int profile_elevs, const struct demwindow *w,
+					 const struct quantizer *q, int nthreads, int verbose,
+					 struct iopipe *io, struct rowsink *sinks, struct demstats *stats, char *err, size_t errlen) { 
+  struct decodepool p;
+  struct demstats own, *own_stats;
+  struct phasetimer t;
+  pthread_t *tids;
+  int i, k, slot, started, status;
+
+  // the workers add theirs to stats as they finish, so time the writes
+  // apart and add them after the join
+  memset(&own, 0, sizeof(own));
+  own_stats = stats != NULL ? &own : NULL;
+  memset(&p, 0, sizeof(p));
+  p.dem = dem;
+  p.profile_num = w->profiles;
+  p.profile_dim = profile_dim;
+  p.profile_elevs = profile_elevs;
+  p.first_profile = w->first_profile;
+  p.first_sample = w->first_sample;
+  p.width = w->samples;
+  p.q = q;
+  p.stats = stats;
+  p.nslots = nthreads * 4;
+  p.slot_profile = malloc(p.nslots * sizeof(int));
+  p.slot_status = malloc(p.nslots * sizeof(int));
+  p.slot_err = malloc(p.nslots * sizeof(*p.slot_err));
+  p.elevs = malloc((size_t)p.nslots * p.width * sizeof(int));
+  p.rows = malloc((size_t)p.nslots * p.width);
+  if ( io->fp != NULL && io->tga_type == kTGA_MAPPED_RLE ) { 
+	p.packed = malloc((size_t)p.nslots * tgarowbound(p.width));
+	p.packed_len = malloc(p.nslots * sizeof(size_t));
+  }
+  tids = malloc(nthreads * sizeof(pthread_t));
+  if ( p.slot_profile == NULL || p.slot_status == NULL || p.slot_err == NULL ||
+	   p.elevs == NULL || p.rows == NULL || tids == NULL ||
+	   (io->fp != NULL && io->tga_type == kTGA_MAPPED_RLE && (p.packed == NULL || p.packed_len == NULL)) ) { 
+	snprintf(err, errlen, "Out of memory.");
+	status = -1;
+	goto done;
+  }
+  for(i=0; i < p.nslots; i++) { p.slot_profile[i] = -1; }
+  pthread_mutex_init(&p.lock, NULL);
+  pthread_cond_init(&p.filled, NULL);
+  pthread_cond_init(&p.drained, NULL);
+
+  for(started=0; started < nthreads; started++) { 
+	if ( pthread_create(&tids[started], NULL, decodeworker, &p) != 0 ) { 
+	  break;
+	}
+  }
+  status = 0;
+  if ( started == 0 ) { 
+	snprintf(err, errlen, "Can't start decoding threads.");
+	status = -1;
+  }
+
+  for(k=0; status == 0 && k < p.profile_num; k++) { 
+	if ( verbose == 1 && k > 0 && (k % 100) == 0 ) { 
+	  fprintf(stderr,".");
+	}
+	ioread(io, k);
+	slot = k % p.nslots;
+	pthread_mutex_lock(&p.lock);
+	while ( p.slot_profile[slot] != k ) { 
+	  pthread_cond_wait(&p.filled, &p.lock);
+	}
+	pthread_mutex_unlock(&p.lock);
+
+	phasestart(own_stats, &t);
+	if ( p.slot_status[slot] != 0 ) { 
+	  snprintf(err, errlen, "%s", p.slot_err[slot]);
+	  status = -1;
+	} else if ( p.packed != NULL &&
+				ioqueue(io, &p.packed[(size_t)slot * tgarowbound(p.width)], p.packed_len[slot]) != 0 ) { 
+	  snprintf(err, errlen, "write: %s.", strerror(errno));
+	  status = -1;
+	} else if ( p.packed == NULL && io->fp != NULL && ioqueue(io, &p.rows[(size_t)slot * p.width], p.width) != 0 ) { 
+	  snprintf(err, errlen, "write: %s.", strerror(errno));
+	  status = -1;
+	} else if ( sinkrow(sinks, &p.elevs[(size_t)slot * p.width], err, errlen) != 0 ) { 
+	  status = -1;
+	}
+	phasestop(own_stats, kPHASE_WRITE, &t);
+
+	pthread_mutex_lock(&p.lock);
+	p.slot_profile[slot] = -1;
+	p.written = k + 1;
+	if ( status != 0 ) { 
+	  p.stop = 1;
+	}
+	pthread_cond_broadcast(&p.drained);
+	pthread_mutex_unlock(&p.lock);
+  }
+
+  for(i=0; i < started; i++) { 
+	pthread_join(tids[i], NULL);
+  }
+  if ( stats != NULL ) { 
+	addstats(stats, &own);
+  }
+  pthread_cond_destroy(&p.drained);
+  pthread_cond_destroy(&p.filled);
+  pthread_mutex_destroy(&p.lock);
+ done:
+  free(tids);
+  free(p.packed_len);
+  free(p.packed);
+  free(p.rows);
+  free(p.elevs);
+  free(p.slot_err);
+  free(p.slot_status);
+  free(p.slot_profile);
+  return(status);
+}
+
+/* Binary cache of decoded DEMs.
+
+   name.dem.demc holds the decoded Type A fields and the elevation grid
+   as little endian int16, so later runs skip the ASCII entirely.  It
+   is only trusted when it is at least as new as the DEM, records the
+   DEM's current size and mtime, and its checksums match.
+
+   Layout, all little endian:
+	 0  "DEMCACHE", u32 version, u32 grid offset
+	16  u64 header checksum, u64 grid checksum (over the rest of the
+		header with both checksums zeroed, and over the grid)
+	32  u64 DEM size, i64 DEM mtime in nanoseconds
+	48  i32 rows, cols, data min, data max; f64 profile min, max
+	80  name[144]
+   224  i32 level, pattern, planimetric, zone, ground units,
+		elevation units, polygon sides, accuracy, profile dim, profiles
+   264  f64 projection parameters[15], polygon vertices[8], min, max, angle
+   472  f32 x, y, z resolution
+   512  grid, rows x cols int16
+*/
+#define kCACHE_MAGIC "DEMCACHE"
+#define kCACHE_VERSION 3
+#define kCACHE_HEADER_SIZE 512
+#define kCACHE_SUFFIX ".demc"
+
+static void put32(unsigned char *p, uint32_t v) { 
+  p[0] = v & 0xff; p[1] = (v >> 8) & 0xff; p[2] = (v >> 16) & 0xff; p[3] = (v >> 24) & 0xff;
+}
+
+static void put64(unsigned char *p, uint64_t v) { 
+  put32(p, (uint32_t)v);
+  put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint32_t get32(const unsigned char *p) { 
+  return((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+static uint64_t get64(const unsigned char *p) { 
+  return((uint64_t)get32(p) | ((uint64_t)get32(p + 4) << 32));
+}
+
+static void putdouble(unsigned char *p, double d) { 
+  uint64_t v;
+  memcpy(&v, &d, sizeof(v));
+  put64(p, v);
+}
+
+static double getdouble(const unsigned char *p) { 
+  uint64_t v = get64(p);
+  double d;
+  memcpy(&d, &v, sizeof(d));
+  return(d);
+}
+
+static void putfloat(unsigned char *p, float f) { 
+  uint32_t v;
+  memcpy(&v, &f, sizeof(v));
+  put32(p, v);
+}
+
+static float getfloat(const unsigned char *p) { 
+  uint32_t v = get32(p);
+  float f;
+  memcpy(&f, &v, sizeof(f));
+  return(f);
+}
+
+/* 64 bit FNV-1a, a byte at a time.  Folding in whole words is faster
+   but the multiply only carries differences upwards, so edits to the
+   top byte of two words can cancel out.
+*/
+uint64_t checksum(const void *data, size_t len, uint64_t sum) { 
+  const unsigned char *p = data;
+  for(; len > 0; p++, len--) { 
+	sum = (sum ^ *p) * 0x100000001b3ULL;
+  }
+  return(sum);
+}
+#define kCHECKSUM_SEED 0xcbf29ce484222325ULL
+
+/* Checksum of a whole file, 0 if it can't be read */
+uint64_t hashfile(const char *path) { 
+  struct demmap m;
+  uint64_t sum;
+  if ( mapdem(&m, path) != 0 ) { 
+	return(0);
+  }
+  sum = checksum(m.data, m.size, kCHECKSUM_SEED);
+  unmapdem(&m);
+  return(sum);
+}
+
+/* Modification time in nanoseconds, so a file rewritten within the
+   second it was last seen still looks changed
+*/
+long long mtimens(const struct stat *st) { 
+  return((long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec);
+}
+
+static int littleendian(void) { 
+  uint16_t one = 1;
+  return(*(unsigned char *)&one == 1);
+}
+
+char *cachename(const char *dem_name) { 
+  char *name;
+  if ((name = malloc(strlen(dem_name) + sizeof(kCACHE_SUFFIX))) != NULL) { 
+	sprintf(name, "%s%s", dem_name, kCACHE_SUFFIX);
+  }
+  return(name);
+}
+
+/* Open the cache for dem_name if there is a current one.  On success
+   returns 0 with the cache mapped in m, the header decoded into h and,
+   if g isn't NULL, g pointing at the grid inside the mapping (checked
+   against its checksum first).  Returns -1 if there's no usable cache.
+*/
+int opencache(const char *dem_name, struct demmap *m, struct demheader *h, struct demgrid *g) { 
+  struct stat dst, cst;
+  const unsigned char *p;
+  unsigned char hdr[kCACHE_HEADER_SIZE];
+  char *name;
+  size_t grid_bytes;
+  uint32_t grid_offset;
+  int i, rows, cols;
+
+  m->data = NULL;
+  m->size = 0;
+  if ( !littleendian() || stat(dem_name, &dst) != 0 || (name = cachename(dem_name)) == NULL ) { 
+	return(-1);
+  }
+  if ( stat(name, &cst) != 0 || mtimens(&cst) < mtimens(&dst) || mapdem(m, name) != 0 ) { 
+	free(name);
+	return(-1);
+  }
+  free(name);
+  p = (const unsigned char *)m->data;
+  if ( m->size < kCACHE_HEADER_SIZE || memcmp(p, kCACHE_MAGIC, 8) != 0 || get32(p + 8) != kCACHE_VERSION ) { 
+	goto stale;
+  }
+  memcpy(hdr, p, kCACHE_HEADER_SIZE);
+  memset(hdr + 16, 0, 16);
+  if ( checksum(hdr, kCACHE_HEADER_SIZE, kCHECKSUM_SEED) != get64(p + 16) ||
+	   get64(p + 32) != (uint64_t)dst.st_size || (long long)get64(p + 40) != mtimens(&dst) ) { 
+	goto stale;
+  }
+  grid_offset = get32(p + 12);
+  rows = (int)get32(p + 48);
+  cols = (int)get32(p + 52);
+  grid_bytes = (size_t)rows * cols * sizeof(int16_t);
+  if ( rows < 1 || cols < 1 || grid_offset < kCACHE_HEADER_SIZE || (grid_offset % 8) != 0 ||
+	   grid_offset + grid_bytes > m->size ) { 
+	goto stale;
+  }
+
+  memcpy(h->name, p + 80, 144);
+  h->name[144] = '\0';
+  h->dem_level_code = (int32_t)get32(p + 224);
+  h->pattern_code = (int32_t)get32(p + 228);
+  h->plan_ref_sys_code = (int32_t)get32(p + 232);
+  h->zone_code = (int32_t)get32(p + 236);
+  h->ground_units_code = (int32_t)get32(p + 240);
+  h->elev_units_code = (int32_t)get32(p + 244);
+  h->poly_sides = (int32_t)get32(p + 248);
+  h->accuracy_code = (int32_t)get32(p + 252);
+  h->profile_dim = (int32_t)get32(p + 256);
+  h->profile_num = (int32_t)get32(p + 260);
+  for(i=0; i < 15; i++) { h->map_proj_param[i] = getdouble(p + 264 + 8 * i); }
+  for(i=0; i < 8; i++) { h->poly_verts[i] = getdouble(p + 384 + 8 * i); }
+  h->min_elev = getdouble(p + 448);
+  h->max_elev = getdouble(p + 456);
+  h->angle_from_axis = getdouble(p + 464);
+  h->x_res = getfloat(p + 472);
+  h->y_res = getfloat(p + 476);
+  h->z_res = getfloat(p + 480);
+
+  if ( g != NULL ) { 
+	if ( checksum(p + grid_offset, grid_bytes, kCHECKSUM_SEED) != get64(p + 24) ) { 
+	  goto stale;
+	}
+	g->rows = rows;
+	g->cols = cols;
+	g->elev = (int16_t *)(m->data + grid_offset);
+	g->min_elev = (int32_t)get32(p + 56);
+	g->max_elev = (int32_t)get32(p + 60);
+	g->prof_min_elev = getdouble(p + 64);
+	g->prof_max_elev = getdouble(p + 72);
+  }
+  return(0);
+
+ stale:
+  unmapdem(m);
+  return(-1);
+}
+
+/* Write (or replace) the cache for dem_name.  Returns 0, or -1 with a
+   message in err.
+*/
+int writecache(const char *dem_name, const struct demheader *h, const struct demgrid *g, char *err, size_t errlen) { 
+  unsigned char hdr[kCACHE_HEADER_SIZE];
+  struct stat st;
+  char *name, *tmp_name;
+  size_t grid_bytes;
+  FILE *fp;
+  int i, status;
+
+  if ( !littleendian() ) { 
+	snprintf(err, errlen, "Caches are only supported on little endian hosts.");
+	return(-1);
+  }
+  if ( stat(dem_name, &st) != 0 ) { 
+	snprintf(err, errlen, "%s: %s.", dem_name, strerror(errno));
+	return(-1);
+  }
+  grid_bytes = (size_t)g->rows * g->cols * sizeof(int16_t);
+  memset(hdr, 0, sizeof(hdr));
+  memcpy(hdr, kCACHE_MAGIC, 8);
+  put32(hdr + 8, kCACHE_VERSION);
+  put32(hdr + 12, kCACHE_HEADER_SIZE);
+  put64(hdr + 32, (uint64_t)st.st_size);
+  put64(hdr + 40, (uint64_t)mtimens(&st));
+  put32(hdr + 48, (uint32_t)g->rows);
+  put32(hdr + 52, (uint32_t)g->cols);
+  put32(hdr + 56, (uint32_t)g->min_elev);
+  put32(hdr + 60, (uint32_t)g->max_elev);
+  putdouble(hdr + 64, g->prof_min_elev);
+  putdouble(hdr + 72, g->prof_max_elev);
+  memcpy(hdr + 80, h->name, 144);
+  put32(hdr + 224, (uint32_t)h->dem_level_code);
+  put32(hdr + 228, (uint32_t)h->pattern_code);
+  put32(hdr + 232, (uint32_t)h->plan_ref_sys_code);
+  put32(hdr + 236, (uint32_t)h->zone_code);
+  put32(hdr + 240, (uint32_t)h->ground_units_code);
+  put32(hdr + 244, (uint32_t)h->elev_units_code);
+  put32(hdr + 248, (uint32_t)h->poly_sides);
+  put32(hdr + 252, (uint32_t)h->accuracy_code);
+  put32(hdr + 256, (uint32_t)h->profile_dim);
+  put32(hdr + 260, (uint32_t)h->profile_num);
+  for(i=0; i < 15; i++) { putdouble(hdr + 264 + 8 * i, h->map_proj_param[i]); }
+  for(i=0; i < 8; i++) { putdouble(hdr + 384 + 8 * i, h->poly_verts[i]); }
+  putdouble(hdr + 448, h->min_elev);
+  putdouble(hdr + 456, h->max_elev);
+  putdouble(hdr + 464, h->angle_from_axis);
+  putfloat(hdr + 472, h->x_res);
+  putfloat(hdr + 476, h->y_res);
+  putfloat(hdr + 480, h->z_res);
+  put64(hdr + 16, checksum(hdr, kCACHE_HEADER_SIZE, kCHECKSUM_SEED));
+  put64(hdr + 24, checksum(g->elev, grid_bytes, kCHECKSUM_SEED));
+
+  // write under a temporary name and rename, so a reader never sees
+  // a partial cache
+  name = cachename(dem_name);
+  tmp_name = name != NULL ? malloc(strlen(name) + 8) : NULL;
+  if ( tmp_name == NULL ) { 
+	snprintf(err, errlen, "Out of memory.");
+	free(name);
+	return(-1);
+  }
+  sprintf(tmp_name, "%s.%d", name, (int)getpid());
+  status = 0;
+  if ((fp = fopen(tmp_name, "wb")) == NULL) { 
+	snprintf(err, errlen, "%s: %s.", tmp_name, strerror(errno));
+	status = -1;
+  } else { 
+	if ( fwrite(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) ||
+		 fwrite(g->elev, 1, grid_bytes, fp) != grid_bytes ) { 
+	  snprintf(err, errlen, "%s: write: %s.", tmp_name, strerror(errno));
+	  status = -1;
+	}
+	if ( fclose(fp) != 0 && status == 0 ) { 
+	  snprintf(err, errlen, "%s: close: %s.", tmp_name, strerror(errno));
+	  status = -1;
+	}
+	if ( status == 0 && rename(tmp_name, name) != 0 ) { 
+	  snprintf(err, errlen, "%s: rename: %s.", name, strerror(errno));
+	  status = -1;
+	}
+	if ( status != 0 ) { 
+	  unlink(tmp_name);
+	}
+  }
+  free(tmp_name);
+  free(name);
+  return(status);
+}
+
+/* Read just the Type A record of a DEM file, from its cache if it
+   has a current one.  Returns 0, or -1 with a message in err.
+*/
+int readheader(const char *path, struct demheader *h, char *err, size_t errlen) { 
+  char type_a_record[kTYPE_A_SIZE];
+  struct demmap cache;
+  FILE *demfile;
+  size_t n;
+  if ( opencache(path, &cache, h, NULL) == 0 ) { 
+	unmapdem(&cache);
+	return(0);
+  }
+  if((demfile = fopen(path, "r")) == NULL) {
+	snprintf(err, errlen, "Error : %s.", strerror(errno));
+	return(-1);
+  }
+  n = fread(type_a_record,sizeof(char),kTYPE_A_SIZE,demfile);
+  fclose(demfile);
+  if ( n != kTYPE_A_SIZE ) { 
+	snprintf(err, errlen, "%s: truncated DEM file.", path);
+	return(-1);
+  }
+  parsetypea(type_a_record, h);
+  return(0);
+}
+
+/* Conversion settings shared by every file converted */
+struct convopts { 
+  int verbose, dump_header, output_location, nthreads;
+  int min_elev_provided, scale_provided;
+  double provided_elev, scale;
+  int data_scale;
+  int pyramid_levels, filter;
+  int resample_cols, resample_rows; // -r, or 0
+  int formats;
+  int rle;                          // --rle, type 9 TGAs
+  int north_up;                     // --north-up
+  int terrain;                      // kTERRAIN_ bits
+  double sun_azimuth, sun_altitude; // degrees
+  int write_cache;
+  int equalize;
+  int window;
+  double window_box[4]; // west, south, east, north in arc-seconds
+  FILE *stats;          // --stats output, or NULL
+  const struct demheader *grid_h; // --serve: the DEM decoded already, or NULL
+  const struct demgrid *grid;
+};
+
+/* Full precision elevation outputs.
+
+   Written next to the TGA as name.raw (int16 little endian), name.pgm
+   (16 bit binary PGM, big endian per the format, offset so the lowest
+   header elevation is 0) or name.f32 (float32 little endian, in
+   elevation units after applying z_res), each with a name.ext.hdr text
+   sidecar describing the grid.  Rows are profiles and columns samples,
+   the same as the TGA.
+*/
+#define kFORMAT_RAW 0x01
+#define kFORMAT_PGM 0x02
+#define kFORMAT_F32 0x04
+
+struct elevsink { 
+  struct rowsink sink;
+  int format, cols;
+  int offset;
+  float z_res;
+  FILE *fp;
+  char *name;
+  unsigned char *buf;
+};
+
+static int elevrow(struct rowsink *s, const int *elevs, char *err, size_t errlen) { 
+  struct elevsink *e = (struct elevsink *)s;
+  unsigned char *b = e->buf;
+  size_t len;
+  int i, v;
+  union { float f; uint32_t u; } fu;
+
+  for(i=0; i < e->cols; i++) { 
+	switch(e->format) { 
+	case kFORMAT_RAW:
+	  v = elevs[i] < INT16_MIN ? INT16_MIN : (elevs[i] > INT16_MAX ? INT16_MAX : elevs[i]);
+	  *b++ = (unsigned char)(v & 0xff);
+	  *b++ = (unsigned char)((v >> 8) & 0xff);
+	  break;
+	case kFORMAT_PGM:
+	  v = elevs[i] - e->offset;
+	  v = v < 0 ? 0 : (v > 65535 ? 65535 : v);
+	  *b++ = (unsigned char)((v >> 8) & 0xff);
+	  *b++ = (unsigned char)(v & 0xff);
+	  break;
+	default:
+	  fu.f = (float)(elevs[i] * (double)e->z_res);
+	  *b++ = (unsigned char)(fu.u & 0xff);
+	  *b++ = (unsigned char)((fu.u >> 8) & 0xff);
+	  *b++ = (unsigned char)((fu.u >> 16) & 0xff);
+	  *b++ = (unsigned char)((fu.u >> 24) & 0xff);
+	  break;
+	}
+  }
+  len = (size_t)(b - e->buf);
+  if ( fwrite(e->buf, 1, len, e->fp) != len ) { 
+	snprintf(err, errlen, "%s: write: %s.", e->name, strerror(errno));
+	return(-1);
+  }
+  return(0);
+}
+
+static int elevfinish(struct rowsink *s, int status, char *err, size_t errlen) { 
+  struct elevsink *e = (struct elevsink *)s;
+  if ( e->fp != NULL && fclose(e->fp) != 0 && status == 0 ) { 
+	snprintf(err, errlen, "%s: close: %s.", e->name, strerror(errno));
+	status = -1;
+  }
+  free(e->name);
+  free(e->buf);
+  free(e);
+  return(status);
+}
+
+/* tga_name with its extension replaced by ext */
+char *replaceext(const char *tga_name, const char *ext) { 
+  const char *dot;
+  char *name;
+  size_t len;
+  dot = strrchr(tga_name, '.');
+  if ( dot == NULL || strchr(dot, '/') != NULL ) { 
+	dot = tga_name + strlen(tga_name);
+  }
+  len = (size_t)(dot - tga_name) + strlen(ext) + 1;
+  if ((name = malloc(len)) != NULL) { 
+	snprintf(name, len, "%.*s%s", (int)(dot - tga_name), tga_name, ext);
+  }
+  return(name);
+}
+
+/* Open a full precision output of one format for a rows x cols grid
+   and write its sidecar.  Returns NULL with a message in err on
+   failure.
+*/
+struct rowsink *newelevsink(const char *tga_name, int format, const struct demheader *h,
+							int rows, int cols, char *err, size_t errlen) { 
+  struct elevsink *e;
+  const char *ext, *type;
+  char *hdr_name;
+  FILE *hf;
+  int i;
+
+  switch(format) { 
+  case kFORMAT_RAW: ext = ".raw"; type = "int16le"; break;
+  case kFORMAT_PGM: ext = ".pgm"; type = "pgm16"; break;
+  default: ext = ".f32"; type = "float32le"; break;
+  }
+  if ((e = calloc(1, sizeof(*e))) == NULL ||
+	  (e->buf = malloc((size_t)cols * 4)) == NULL ||
+	  (e->name = replaceext(tga_name, ext)) == NULL) { 
+	snprintf(err, errlen, "Out of memory.");
+	if ( e != NULL ) { elevfinish(&e->sink, -1, err, errlen); }
+	return(NULL);
+  }
+  e->sink.row = elevrow;
+  e->sink.finish = elevfinish;
+  e->format = format;
+  e->cols = cols;
+  e->offset = (int)floor(h->min_elev);
+  e->z_res = h->z_res;
+
+  if ((e->fp = fopen(e->name, "wb+")) == NULL ||
+	  (format == kFORMAT_PGM && fprintf(e->fp, "P5\n%d %d\n65535\n", cols, rows) < 0)) { 
+	snprintf(err, errlen, "%s: %s.", e->name, strerror(errno));
+	elevfinish(&e->sink, -1, err, errlen);
+	return(NULL);
+  }
+
+  if ((hdr_name = malloc(strlen(e->name) + 5)) == NULL) { 
+	snprintf(err, errlen, "Out of memory.");
+	elevfinish(&e->sink, -1, err, errlen);
+	return(NULL);
+  }
+  sprintf(hdr_name, "%s.hdr", e->name);
+  if ((hf = fopen(hdr_name, "w")) == NULL) { 
+	snprintf(err, errlen, "%s: %s.", hdr_name, strerror(errno));
+	free(hdr_name);
+	elevfinish(&e->sink, -1, err, errlen);
+	return(NULL);
+  }
+  fprintf(hf, "type = %s\n", type);
+  fprintf(hf, "width = %d\n", cols);
+  fprintf(hf, "height = %d\n", rows);
+  fprintf(hf, "data_offset = %ld\n", format == kFORMAT_PGM ? ftell(e->fp) : 0L);
+  fprintf(hf, "layout = row per profile west to east, column per sample south to north\n");
+  if ( format == kFORMAT_PGM ) { 
+	fprintf(hf, "elevation = (value + %d) * %g\n", e->offset, h->z_res);
+  } else if ( format == kFORMAT_RAW ) { 
+	fprintf(hf, "elevation = value * %g\n", h->z_res);
+  } else { 
+	fprintf(hf, "elevation = value\n");
+  }
+  fprintf(hf, "elevation_units = %s\n", elevunits(h->elev_units_code));
+  fprintf(hf, "ground_units = %s\n", groundunits(h->ground_units_code));
+  fprintf(hf, "resolution = %g %g %g\n", h->x_res, h->y_res, h->z_res);
+  for(i=0; i < 4; i++) { 
+	static const char *corner[4] = { "sw", "nw", "ne", "se" };
+	fprintf(hf, "corner_%s = %.6f %.6f\n", corner[i], h->poly_verts[2*i], h->poly_verts[2*i+1]);
+  }
+  fprintf(hf, "min_elevation = %g\n", h->min_elev);
+  fprintf(hf, "max_elevation = %g\n", h->max_elev);
+  if ( fclose(hf) != 0 ) { 
+	snprintf(err, errlen, "%s: close: %s.", hdr_name, strerror(errno));
+	free(hdr_name);
+	elevfinish(&e->sink, -1, err, errlen);
+	return(NULL);
+  }
+  free(hdr_name);
+  return(&e->sink);
+}
+
+/* Terrain products for --hillshade, --slope and --aspect.
+
+   Each is an 8 bit TGA next to the main one (name_hillshade.tga and
+   so on) at the DEM's own resolution, computed from the decoded
+   elevations rather than the quantized pixels.  Gradients are Horn's
+   3x3 weighting, so the sink holds just three profiles: row r is
+   written once row r+1 arrives, and the edges reuse their outermost
+   row or column.
+
+   Spacing is in meters: arc-second DEMs get the east-west spacing of
+   each sample's own latitude, and elevations are scaled by z_res and
+   converted from feet where need be.  Slope is 0 to 90 degrees over
+   0 to 255, aspect the downhill compass bearing over 1 to 255 with 0
+   for flat, and hillshade the usual Lambertian shading for a sun at
+   the given azimuth and altitude.
+*/
+#define kTERRAIN_HILLSHADE 0x01
+#define kTERRAIN_SLOPE 0x02
+#define kTERRAIN_ASPECT 0x04
+#define kTERRAIN_PRODUCTS 3
+
+#define kEARTH_RADIUS 6371008.8   // meters, mean
+#define kFEET 0.3048
+
+static const char *terrain_names[kTERRAIN_PRODUCTS] = { "_hillshade", "_slope", "_aspect" };
+
+struct terrainsink { 
+  struct rowsink sink;
+  int products, rows, cols, tga_type;
+  int seen;               // rows received so far
+  int *win[3];            // rows seen-2, seen-1 and seen, oldest first
+  double *dx;             // meters between profiles at each sample
+  double dy, zscale;
+  double sun_cos, sun_east, sun_north;  // cos(zenith), sin(zenith) along each axis
+  FILE *fp[kTERRAIN_PRODUCTS];
+  char *name[kTERRAIN_PRODUCTS];
+  unsigned char *out[kTERRAIN_PRODUCTS];
+};
+
+/* Meters in one unit of ground distance, ground_units_code c, along a
+   meridian; 0 if unknown
+*/
+static double groundmeters(int c) { 
+  switch(c) { 
+  case 0: return(kEARTH_RADIUS);
+  case 1: return(kFEET);
+  case 2: return(1.0);
+  case 3: return(kEARTH_RADIUS * M_PI / (180.0 * 3600.0));
+  }
+  return(0.0);
+}
+
+/* Write the products for the row between west and east */
+static int terrainemit(struct terrainsink *t, const int *west, const int *mid, const int *east,
+					   char *err, size_t errlen) { 
+  double dzdx, dzdy, slope, aspect, shade;
+  int c, l, r, k, span;
+
+  // at the first and last profile mid is its own west or east, and
+  // the differences span one profile rather than two
+  span = (west != mid) + (east != mid);
+  for(c=0; c < t->cols; c++) { 
+	l = c > 0 ? c - 1 : c;             // south
+	r = c < t->cols - 1 ? c + 1 : c;   // north
+	dzdx = span == 0 ? 0.0 : ((east[l] + 2.0 * east[c] + east[r]) - (west[l] + 2.0 * west[c] + west[r])) *
+	  t->zscale / (span * 4.0 * t->dx[c]);
+	dzdy = r == l ? 0.0 : ((west[r] + 2.0 * mid[r] + east[r]) - (west[l] + 2.0 * mid[l] + east[l])) *
+	  t->zscale / ((r - l) * 4.0 * t->dy);
+	if ( t->products & kTERRAIN_HILLSHADE ) { 
+	  // cos(zenith) cos(slope) + sin(zenith) sin(slope) cos(azimuth - aspect), without the trig
+	  shade = (t->sun_cos - t->sun_east * dzdx - t->sun_north * dzdy) / sqrt(1.0 + dzdx * dzdx + dzdy * dzdy);
+	  t->out[0][c] = shade <= 0.0 ? 0 : (unsigned char)(shade * 255.0 + 0.5);
+	}
+	if ( t->products & kTERRAIN_SLOPE ) { 
+	  slope = atan(sqrt(dzdx * dzdx + dzdy * dzdy));
+	  t->out[1][c] = (unsigned char)(slope * 180.0 / M_PI * 255.0 / 90.0 + 0.5);
+	}
+	if ( t->products & kTERRAIN_ASPECT ) { 
+	  aspect = atan2(-dzdx, -dzdy);    // downhill, clockwise from north
+	  if ( aspect < 0.0 ) { aspect += 2.0 * M_PI; }
+	  t->out[2][c] = dzdx == 0.0 && dzdy == 0.0 ? 0 : (unsigned char)(1 + (int)(aspect * 180.0 / M_PI * 254.0 / 360.0 + 0.5));
+	}
+  }
+  for(k=0; k < kTERRAIN_PRODUCTS; k++) { 
+	if ( t->fp[k] != NULL && writetgarow(t->fp[k], t->out[k], t->cols, t->tga_type) != 0 ) { 
+	  snprintf(err, errlen, "%s: write: %s.", t->name[k], strerror(errno));
+	  return(-1);
+	}
+  }
+  return(0);
+}
+
+static int terrainrow(struct rowsink *s, const int *elevs, char *err, size_t errlen) { 
+  struct terrainsink *t = (struct terrainsink *)s;
+  int *oldest;
+
+  oldest = t->win[0];
+  t->win[0] = t->win[1];
+  t->win[1] = t->win[2];
+  t->win[2] = oldest;
+  memcpy(t->win[2], elevs, t->cols * sizeof(int));
+  t->seen++;
+  // row seen-2 now has both neighbours; the first row is its own west
+  if ( t->seen >= 2 ) { 
+	return(terrainemit(t, t->seen == 2 ? t->win[1] : t->win[0], t->win[1], t->win[2], err, errlen));
+  }
+  return(0);
+}
+
+static int terrainfinish(struct rowsink *s, int status, char *err, size_t errlen) { 
+  struct terrainsink *t = (struct terrainsink *)s;
+  int k;
+  // the last row is its own east
+  if ( status == 0 && t->seen == t->rows && t->seen > 0 &&
+	   terrainemit(t, t->seen == 1 ? t->win[2] : t->win[1], t->win[2], t->win[2], err, errlen) != 0 ) { 
+	status = -1;
+  }
+  for(k=0; k < kTERRAIN_PRODUCTS; k++) { 
+	if ( t->fp[k] != NULL && fclose(t->fp[k]) != 0 && status == 0 ) { 
+	  snprintf(err, errlen, "%s: close: %s.", t->name[k], strerror(errno));
+	  status = -1;
+	}
+	free(t->name[k]);
+	free(t->out[k]);
+  }
+  for(k=0; k < 3; k++) { 
+	free(t->win[k]);
+  }
+  free(t->dx);
+  free(t);
+  return(status);
+}
+
+/* Start the terrain products (kTERRAIN_ bits) of a rows x cols window
+   whose header is h, with the sun at azimuth and altitude degrees for
+   the hillshade.  Returns NULL with a message in err on failure.
+*/
+struct rowsink *newterrainsink(const char *tga_name, int products, const struct demheader *h,
+							   int rows, int cols, double azimuth, double altitude, int tga_type,
+							   char *err, size_t errlen) { 
+  struct terrainsink *t;
+  double unit, y0;
+  int k, c;
+
+  if ((unit = groundmeters(h->ground_units_code)) == 0.0 || h->x_res <= 0.0 || h->y_res <= 0.0 ) { 
+	snprintf(err, errlen, "Can't work out the sample spacing of a DEM in %s at %g, %g.",
+			 groundunits(h->ground_units_code), h->x_res, h->y_res);
+	return(NULL);
+  }
+  if ((t = calloc(1, sizeof(*t))) == NULL || (t->dx = malloc(cols * sizeof(double))) == NULL) { 
+	snprintf(err, errlen, "Out of memory.");
+	free(t);
+	return(NULL);
+  }
+  t->sink.row = terrainrow;
+  t->sink.finish = terrainfinish;
+  t->products = products;
+  t->tga_type = tga_type;
+  t->rows = rows;
+  t->cols = cols;
+  t->sun_cos = sin(altitude * M_PI / 180.0);
+  t->sun_east = cos(altitude * M_PI / 180.0) * sin(azimuth * M_PI / 180.0);
+  t->sun_north = cos(altitude * M_PI / 180.0) * cos(azimuth * M_PI / 180.0);
+  t->zscale = h->z_res * (h->elev_units_code == 1 ? kFEET : 1.0);
+  t->dy = h->y_res * unit;
+  y0 = fmin(fmin(h->poly_verts[1], h->poly_verts[3]), fmin(h->poly_verts[5], h->poly_verts[7]));
+  for(c=0; c < cols; c++) { 
+	t->dx[c] = h->x_res * unit;
+	if ( h->ground_units_code == 3 ) { 
+	  t->dx[c] *= cos((y0 + c * h->y_res) / 3600.0 * M_PI / 180.0);
+	}
+	if ( t->dx[c] < 1e-3 ) { t->dx[c] = 1e-3; }  // at the poles
+  }
+  for(k=0; k < 3; k++) { 
+	if ((t->win[k] = malloc(cols * sizeof(int))) == NULL) { 
+	  snprintf(err, errlen, "Out of memory.");
+	  terrainfinish(&t->sink, -1, err, errlen);
+	  return(NULL);
+	}
+  }
+  for(k=0; k < kTERRAIN_PRODUCTS; k++) { 
+	if ( (products & (1 << k)) == 0 ) { 
+	  continue;
+	}
+	if ((t->name[k] = derivedname(tga_name, terrain_names[k])) == NULL ||
+		(t->out[k] = malloc(cols)) == NULL) { 
+	  snprintf(err, errlen, "Out of memory.");
+	  terrainfinish(&t->sink, -1, err, errlen);
+	  return(NULL);
+	}
+	if ((t->fp[k] = fopen(t->name[k], "wb+")) == NULL || writetgaheader(t->fp[k], rows, cols, tga_type, kTGA_BOTTOM_LEFT) != 0 ) { 
+	  snprintf(err, errlen, "%s: %s.", t->name[k], strerror(errno));
+	  terrainfinish(&t->sink, -1, err, errlen);
+	  return(NULL);
+	}
+  }
+  return(&t->sink);
+}
+
+/* Convert one DEM file to a TGA file, timing the phases into stats
+   unless it is NULL.  Returns 0, or -1 with a message in err.
+*/
+static int convertone(const char *dem_name, const char *tga_name, const struct convopts *o,
+					  struct demstats *stats, char *err, size_t errlen) { 
+  FILE *tgafile;
+  struct iopipe io;
+  int io_started;
+  struct phasetimer t;
+  struct demmap dem;
+  struct demheader h;
+  char name[145];
+  int profile_elevs, tga_dim_x, tga_dim_y, current_profile, i, *elevs, status;
+  int tga_type = o->rle == 1 ? kTGA_MAPPED_RLE : kTGA_MAPPED;
+  unsigned char *tga_row;
+  double width, height, min_elev, elev_range, scaling_factor;
+  struct demgrid grid;
+  struct demwindow win;
+  struct demheader wh;
+  struct rowsink *sinks;
+  struct quantizer *q;
+  uint32_t *hist;
+  int from_cache;
+  int verbose = o->verbose;
+
+  // a current cache has everything, otherwise go to the DEM itself.
+  // Either way the file stays mapped in dem until we're done.
+  grid.elev = NULL;
+  phasestart(stats, &t);
+  from_cache = 1;
+  if ( o->grid != NULL ) { 
+	// the server has it decoded already
+	memset(&dem, 0, sizeof(dem));
+	h = *o->grid_h;
+	grid = *o->grid;
+  } else if ( opencache(dem_name, &dem, &h, &grid) == 0 ) { 
+	if ( verbose == 1 ) { fprintf(stderr,"Using cache for %s\n",dem_name); }
+	if ( stats != NULL ) { stats->bytes_read += dem.size; }
+  } else { 
+	from_cache = 0;
+	grid.elev = NULL;
+	if ( mapdem(&dem, dem_name) != 0 ) {
+	  snprintf(err, errlen, "Error : %s.", strerror(errno));
+	  return(-1);
+	}
+  
+	/* DEM Type A Records */
+  
+	// The Type A Record header consists of the first 1024 bytes of
+	// the DEM file, plus the first 24 of the first Type B record which
+	// we peek at below.  All fields are decoded straight out of the
+	// mapping.
+	if ( dem.size < kTYPE_A_SIZE + 24 ) { 
+	  snprintf(err, errlen, "%s: truncated DEM file.", dem_name);
+	  unmapdem(&dem);
+	  return(-1);
+	}
+	parsetypea(dem.data, &h);
+	if ( stats != NULL ) { stats->bytes_read += kTYPE_A_SIZE; }
+  }
+  phasestop(stats, kPHASE_HEADER, &t);
+  
+  /* Field 1 - char string DEM name field.  bytes 0 to 143 
+	 used only if outputting name
+  */
+  if ( o->dump_header == 1 ) { 
+	char cur_c, prev_c;
+	for(i=0; i <= 39; i++) { name[i] = h.name[i]; }
+	name[40] = '\0';
+	for(i=39; i > 0; i--) {
+	  if(!isspace(name[i])) { i=0; } else { name[i] = '\0'; }
+	}
+	
+	// REMOVE all ocurrences of 2 spaces in a row
+	cur_c = '.'; 
+	prev_c = '.';
+	i = 0;
+	while ( cur_c != '\0' && i <= 39 ) { 
+	  cur_c = name[i];
+	  if ( cur_c == ' ' && prev_c == ' ' ) { 
+		bcopy(&name[i],&name[i-1],strlen(&name[i]));
+		name[strlen(name)-1] = '\0';
+		i=0;
+		prev_c = '.';
+	  } else { 
+		prev_c = cur_c;
+		i++;
+	  }
+	}
+	// REPLACE ' - ' with '-'
+	i = 0;
+	while ( name[i] != '\0' && i < (strlen(name) - 2) ) { 
+	  if ( name[i] == ' ' && name[i+1] == '-' && name[i+2] == ' ' ) {
+		// replace name[i] with '-'
+		name[i] = '-';
+		// move name[i+3] to name[i+1]
+		// add nulls to end
+		bcopy(&name[i+3],&name[i+1],strlen(&name[i+3]));
+		name[strlen(name)-2] = '\0';
+		//reset i
+		i = 0;
+	  } else { 
+		i++;
+	  }
+	}
+	// REPLAE ' ' with '_'
+	i = 0;
+	while ( name[i] != '\0' && i < (strlen(name)) ) { 
+	  if ( name[i] == ' ' ) { 
+		name[i] = '_';
+	  }
+	  i++;
+	}
+	fprintf(stdout, "DEM Name:\"%s\"\n", name);
+  }
+  
+  /* Field 2 - DEM level code, unused */
+  if ( verbose == 1 ) { 
+	fprintf(stderr, "DEM Level Code %d ",h.dem_level_code);
+	if ( h.dem_level_code == 3 ) { 
+	  fprintf(stderr,"(processed by DMA)\n");
+	} else { 
+	  fprintf(stderr,"(unknown)\n");
+	}
+  }
+
+  /* Field 3 - pattern code, unused */
+  if ( verbose == 1 ) { 
+	fprintf(stderr, "Pattern Code %d ",h.pattern_code);
+	if ( h.pattern_code == 1 ) { 
+	  fprintf(stderr,"(regular elevation pattern)\n");
+	} else { 
+	  fprintf(stderr,"(unknown)\n");
+	}
+  }
+
+  /* Field 4 - planimetric reference system code, unused */
+  if ( verbose == 1 ) {   
+	fprintf(stderr, "Planimetric Reference System Code %d ",h.plan_ref_sys_code);
+	if ( h.plan_ref_sys_code == 0 ) { 
+	  fprintf(stderr,"(geographic coordinate system)\n");
+	} else { 
+	  fprintf(stderr,"(unknown)\n");
+	}
+  }
+
+  /* Field 5 - zone code, unused */
+  if ( verbose == 1 ) { 
+	fprintf(stderr, "Zone Code %d ",h.zone_code);
+	if ( h.zone_code != 0 ) { 
+	  fprintf(stderr,"- Unexpected Value");
+	}
+	fprintf(stderr,"\n");
+  }
+
+  /* Field 6 - map projection parameters, unused */
+  if ( verbose == 1 ) { 
+	fprintf(stderr, "Map projection parameters ");
+	for(i=0; i < 15; i++) { 
+	  fprintf(stderr,".");
+	}
+	fprintf(stderr,"\n");
+  }
+  
+  /* Field 7 - ground units code */
+  if ( verbose == 1 ) { 
+	fprintf(stderr, "Ground Units Code %d ",h.ground_units_code);
+	if ( h.ground_units_code == 3 ) { 
+	  fprintf(stderr, "(arc-seconds)\n");
+	} else { 
+	  fprintf(stderr, "(unknown)\n");
+	}
+  }
+
+  /* Field 8 - elevation units code */
+  if ( verbose == 1 ) { 
+	fprintf(stderr, "Elevation Units %i ", h.elev_units_code);
+	if ( h.elev_units_code == 2 ) {
+	  fprintf(stderr, "(meters)\n");
+	} else { 
+	  fprintf(stderr, "(unknown)\n");
+	}
+  }
+
+  /* Field 9 - dem polygon sides */
+  if ( verbose == 1 ) { 
+	fprintf(stderr,"Number of sides of the DEM polygon: %d\n",h.poly_sides);
+  }
+  if ( checkheader(&h, err, errlen) != 0 ) {
+	unmapdem(&dem);
+	return(-1);
+  } 
+  
+  /* Field 10 - polygon vertex coords */
+  if ( verbose == 1 ) {
+	fprintf(stderr,"Ground coordinates of 4 corners of DEM: ");
+	for(i=0; i < 8; i++) {
+	  if ( (i%2) == 0 ) {
+		fprintf(stderr,"(%.0f,",h.poly_verts[i]/3600.0);
+	  } else { 
+		fprintf(stderr,"%.0f) ",h.poly_verts[i]/3600.0);
+	  }
+	}
+  }
+  width = fabs(h.poly_verts[0] - h.poly_verts[4]);
+  height = fabs(h.poly_verts[1] - h.poly_verts[3]);
+
+  if ( verbose == 1 ) { 
+	fprintf(stderr,"\nDEM ground coordinate width,height : %.2f,%.2f\n",width,height);
+  }
+  
+  if ( o->output_location == 1 ) { 
+	fprintf(stdout,"DEM Location:(%.4f,%.4f)-",h.poly_verts[0]/3600,h.poly_verts[1]/3600);
+	fprintf(stdout,"(%.4f,%.4f)\n",h.poly_verts[4]/3600,h.poly_verts[5]/3600);
+  }
+
+  /* Field 11 - min and max elevations */
+  min_elev = h.min_elev;
+  elev_range = h.max_elev - h.min_elev;
+  if ( verbose == 1 ) { 
+	fprintf(stderr, "DEM min,max elevation: %.2f to %.2f, range %.2f\n", h.min_elev,h.max_elev,elev_range);
+  }
+  if ( o->min_elev_provided == 1 ) {
+	min_elev = o->provided_elev;
+	if ( verbose == 1 ) { 
+	  fprintf(stderr, "Using Provided min elev : %.8f\n", min_elev);
+	}
+  }
+
+  /* this is the value to multiply elevations by to get a number
+	 between 0 and 255 to determine the color of the pixel */
+  if ( elev_range == 0.0 ) { 
+	scaling_factor = 0.0;
+  } else { 
+	scaling_factor = 255.0 / elev_range;
+  }
+  if ( verbose == 1 ) { 
+	fprintf(stderr, "Calculated Scaling factor : %.5f\n", scaling_factor);
+  }
+  if ( o->scale_provided == 1 ) { 
+	scaling_factor = o->scale; 
+	if ( verbose == 1 ) { 
+	  fprintf(stderr, "Using Provided Scaling factor : %.5f\n", scaling_factor);
+	}
+  } 
+  
+  /* Field 12 - ccw angle from primary axis, unused */
+  if ( verbose == 1 ) { 
+	fprintf(stderr, "CCW Angle from primary axis: %.2f\n",h.angle_from_axis);
+  }
+
+  /* Field 13 - accuracy code, unused */
+  if ( verbose == 1 ) { 
+	fprintf(stderr, "Accuracy code %d, ",h.accuracy_code);
+	if ( h.accuracy_code == 0 ) { 
+	  fprintf(stderr,"no class C records follow.\n");
+	} else {
+	  fprintf(stderr,"class C records follow.\n");
+	}
+  }
+
+  /* Field 14 - DEM spatial resolution */
+  if ( verbose == 1 ) { 
+	fprintf(stderr,"X, Y, Z Spatial Resolution : %.2f, %.2f, %.2f ",h.x_res,h.y_res,h.z_res);
+	if ( h.ground_units_code == 3 ) { 
+	  fprintf(stderr,"arcseconds");
+	} 
+	fprintf(stderr,"\nExpecting %d profiles ",(int)(height/h.x_res+1));
+	fprintf(stderr,"of %d elevations each.\n",(int)(width/h.y_res+1));
+  }
+  
+  /* Field 15 - profile array rows and columns */
+  if ( verbose == 1 ) { 
+	fprintf(stderr,"There are %d %d dimensional profiles in this DEM.\n",h.profile_num,h.profile_dim);
+  }
+  if ( !from_cache && indexdem(&dem, h.profile_num) != 0 ) { 
+	snprintf(err, errlen, "Out of memory.");
+	unmapdem(&dem);
+	return(-1);
+  }
+  
+  if ( verbose == 1 ) { 
+	fprintf(stderr,"Discarding remaining Type A Record fields.\n");
+  }
+  
+  // dive into first Type B Record to retrieve
+  // the rows(elevations) per profile
+  if ( verbose == 1 ) { 
+	fprintf(stderr,"Entering First Type B Record to get elevations per profile: ");
+  }
+  profile_elevs = from_cache ? grid.cols : getnextint(&dem.data[kTYPE_A_SIZE + 12]);
+  if ( verbose == 1 ) { fprintf(stderr," %d\n",profile_elevs); }
+
+  // all of it, or just the profiles and samples inside --window
+  win.first_profile = 0;
+  win.profiles = h.profile_num;
+  win.first_sample = 0;
+  win.samples = profile_elevs;
+  if ( o->window == 1 ) { 
+	if ( windowdem(&h, profile_elevs, o->window_box, &win, err, errlen) != 0 ) { 
+	  unmapdem(&dem);
+	  return(-1);
+	}
+	if ( verbose == 1 ) { 
+	  fprintf(stderr,"Window is profiles %d to %d, samples %d to %d\n",win.first_profile + 1,
+			  win.first_profile + win.profiles, win.first_sample + 1, win.first_sample + win.samples);
+	}
+  }
+  windowheader(&wh, &h, &win);
+  
+  tga_dim_x = win.samples;
+  tga_dim_y = win.profiles;
+
+  // single pass mode: decode everything up front (or take it from the
+  // cache), optionally taking the scale from the data itself rather
+  // than the header, or counting a histogram to equalize
+  hist = NULL;
+  if ( o->equalize == 1 && (hist = calloc(kLUT_SIZE, sizeof(uint32_t))) == NULL ) { 
+	snprintf(err, errlen, "Out of memory.");
+	unmapdem(&dem);
+	return(-1);
+  }
+  if ( !from_cache && (o->data_scale == 1 || o->write_cache == 1 || o->equalize == 1) ) { 
+	if ( verbose == 1 ) { 
+	  fprintf(stderr,"Decoding %d profiles into memory\n",h.profile_num);
+	}
+	// the reads happen inside the decode here, so it's all "decode"
+	phasestart(stats, &t);
+	if ( decodegrid(&dem, h.profile_num, h.profile_dim, profile_elevs, o->nthreads, &grid, hist, err, errlen) != 0 ) { 
+	  free(grid.elev);
+	  free(hist);
+	  unmapdem(&dem);
+	  return(-1);
+	}
+	phasestop(stats, kPHASE_DECODE, &t);
+	if ( stats != NULL ) { stats->bytes_read += (long long)h.profile_num * profilebytes(profile_elevs); }
+	if ( o->write_cache == 1 ) { 
+	  if ( writecache(dem_name, &h, &grid, err, errlen) != 0 ) { 
+		free(grid.elev);
+		free(hist);
+		unmapdem(&dem);
+		return(-1);
+	  }
+	  if ( verbose == 1 ) { fprintf(stderr,"Wrote cache for %s\n",dem_name); }
+	}
+  }
+  if ( o->data_scale == 1 ) { 
+	if ( verbose == 1 ) { 
+	  fprintf(stderr,"Data min,max elevation: %d to %d\n",grid.min_elev,grid.max_elev);
+	  fprintf(stderr,"Profile min,max elevation: %.2f to %.2f\n",grid.prof_min_elev,grid.prof_max_elev);
+	}
+	if ( grid.min_elev != h.min_elev || grid.max_elev != h.max_elev ) { 
+	  fprintf(stderr,"%s: header min,max elevation %.2f to %.2f, data has %d to %d\n",
+			  dem_name,h.min_elev,h.max_elev,grid.min_elev,grid.max_elev);
+	}
+	min_elev = grid.min_elev;
+	elev_range = grid.max_elev - grid.min_elev;
+	scaling_factor = elev_range == 0.0 ? 0.0 : 255.0 / elev_range;
+	if ( verbose == 1 ) { 
+	  fprintf(stderr, "Data Scaling factor : %.5f\n", scaling_factor);
+	}
+  }
+  
+  if ( verbose == 1 ) { 
+	if ( o->resample_cols > 0 ) { 
+	  fprintf(stderr,"TGA Image is %d x %d, resampled from %d x %d\n",o->resample_cols,o->resample_rows,
+			  tga_dim_x,tga_dim_y);
+	} else if ( o->north_up == 1 ) { 
+	  fprintf(stderr,"TGA Image is %d x %d, north up\n",tga_dim_y,tga_dim_x);
+	} else { 
+	  fprintf(stderr,"TGA Image is %d x %d \n",tga_dim_x,tga_dim_y);
+	}
+	fprintf(stderr,"Writing TGA header\n");
+  }
+  // with -r or --north-up a sink below writes the TGA instead
+  tgafile = NULL;
+  if ( o->resample_cols == 0 && o->north_up == 0 && (tgafile = fopen(tga_name, "wb+")) == NULL ) { 
+	snprintf(err, errlen, "%s: fopen: %s", dem_name, strerror(errno));
+	if ( !from_cache ) { free(grid.elev); }
+	free(hist);
+	unmapdem(&dem);
+	return(-1);
+  }
+  if ( tgafile != NULL && writetgaheader(tgafile, tga_dim_y, tga_dim_x, tga_type, kTGA_BOTTOM_LEFT) != 0 ) { 
+	snprintf(err, errlen, "%s: write: %s.", tga_name, strerror(errno));
+	fclose(tgafile);
+	if ( !from_cache ) { free(grid.elev); }
+	free(hist);
+	unmapdem(&dem);
+	return(-1);
+  }
+  
+  fflush(stderr);
+
+  elevs = malloc(profile_elevs * sizeof(int));
+  tga_row = malloc(profile_elevs);
+  q = malloc(sizeof(struct quantizer));
+  status = 0;
+  if ( elevs == NULL || tga_row == NULL || q == NULL ) { 
+	snprintf(err, errlen, "Out of memory.");
+	status = -1;
+  } else if ( hist != NULL ) { 
+	// a cached grid wasn't decoded here, so count it now
+	if ( from_cache ) { 
+	  size_t k, n = (size_t)grid.rows * grid.cols;
+	  for(k=0; k < n; k++) { hist[grid.elev[k] + kLUT_OFFSET]++; }
+	}
+	equalizedlut(q, hist);
+	if ( verbose == 1 ) { fprintf(stderr,"Equalizing from the histogram of %d samples\n",grid.rows * grid.cols); }
+  } else { 
+	linearlut(q, min_elev, scaling_factor);
+  }
+  free(hist);
+
+  sinks = NULL;
+  if ( status == 0 && o->resample_cols > 0 ) { 
+	struct rowsink *s;
+	if ((s = newresample(tga_name, tga_dim_y, tga_dim_x, o->resample_rows, o->resample_cols, o->filter,
+						 o->nthreads, q, tga_type, err, errlen)) == NULL) { 
+	  status = -1;
+	} else { 
+	  addsink(&sinks, s);
+	}
+  }
+  if ( status == 0 && o->north_up == 1 ) { 
+	struct rowsink *s;
+	if ((s = newnorthsink(tga_name, tga_dim_y, tga_dim_x, q, err, errlen)) == NULL) { 
+	  status = -1;
+	} else { 
+	  addsink(&sinks, s);
+	}
+  }
+  for(i = kFORMAT_RAW; status == 0 && i <= kFORMAT_F32; i <<= 1) { 
+	struct rowsink *s;
+	if ( (o->formats & i) == 0 ) { 
+	  continue;
+	}
+	if ((s = newelevsink(tga_name, i, &wh, tga_dim_y, tga_dim_x, err, errlen)) == NULL) { 
+	  status = -1;
+	} else { 
+	  addsink(&sinks, s);
+	}
+  }
+  if ( status == 0 && o->terrain != 0 ) { 
+	struct rowsink *s;
+	if ((s = newterrainsink(tga_name, o->terrain, &wh, tga_dim_y, tga_dim_x, o->sun_azimuth, o->sun_altitude,
+							tga_type, err, errlen)) == NULL) { 
+	  status = -1;
+	} else { 
+	  addsink(&sinks, s);
+	}
+  }
+  if ( status == 0 && o->pyramid_levels > 1 ) { 
+	struct rowsink *s;
+	if ( verbose == 1 ) { 
+	  fprintf(stderr,"Writing %d pyramid levels\n",o->pyramid_levels - 1);
+	}
+	if ((s = newpyramid(tga_name, tga_dim_y, tga_dim_x, o->pyramid_levels, o->filter,
+						q, tga_type, err, errlen)) == NULL) { 
+	  status = -1;
+	} else { 
+	  addsink(&sinks, s);
+	}
+  }
+
+  // reads ahead of the decoding (unless it's all in memory already) and writes behind it
+  io_started = 0;
+  if ( status == 0 && startio(&io, grid.elev == NULL ? &dem : NULL, &win, tgafile, tga_type, err, errlen) == 0 ) { 
+	io_started = 1;
+  } else { 
+	status = -1;
+  }
+
+  /***************************************************************************** 
+   * DEM Type B Records  
+   *****************************************************************************/
+  if ( verbose == 1 ) { 
+	fprintf(stderr,"Parsing DEM Type B Records (dot every 100 profiles): ");
+  }
+  if ( status != 0 ) { 
+	// out of memory above
+  } else if ( grid.elev != NULL ) { 
+	// already decoded, quantize from memory
+	for(current_profile=0; current_profile < win.profiles; current_profile++) { 
+	  const int16_t *row = &grid.elev[(size_t)(win.first_profile + current_profile) * grid.cols + win.first_sample];
+	  phasestart(stats, &t);
+	  for(i=0; i < win.samples; i++) { elevs[i] = row[i]; }
+	  quantizerow(elevs, win.samples, q, tga_row);
+	  if ( stats != NULL ) { 
+		stats->clipped += clippedsamples(elevs, win.samples, q);
+		stats->profiles++;
+		stats->samples += win.samples;
+	  }
+	  phasestop(stats, kPHASE_QUANTIZE, &t);
+	  phasestart(stats, &t);
+	  if ( tgafile != NULL && iorow(&io, tga_row, win.samples) != 0 ) { 
+		snprintf(err, errlen, "%s: write: %s.", tga_name, strerror(errno));
+		status = -1;
+		break;
+	  }
+	  if ( sinkrow(sinks, elevs, err, errlen) != 0 ) { 
+		status = -1;
+		break;
+	  }
+	  phasestop(stats, kPHASE_WRITE, &t);
+	}
+  } else if ( o->nthreads > 1 ) { 
+	status = writeprofiles_mt(&dem, h.profile_dim, profile_elevs, &win, q,
+							  o->nthreads, verbose, &io, sinks, stats, err, errlen);
+  } else { 
+	current_profile = 1;
+	while( status == 0 && current_profile <= win.profiles ) {
+	  int profile = win.first_profile + current_profile;
+	  i = current_profile -1;
+	  if ( verbose == 1 ) { 
+		if ( (i > 0) && ((i%100) == 0) ) { 
+		  fprintf(stderr,".");
+		}
+	  }
+
+	  ioread(&io, i);
+	  if ( stats != NULL ) { 
+		phasestart(stats, &t);
+		stats->bytes_read += touchprofile(&dem, profile, win.first_sample, win.samples);
+		phasestop(stats, kPHASE_READ, &t);
+	  }
+	  phasestart(stats, &t);
+	  if ( readslice(&dem, profile, h.profile_dim, profile_elevs, win.first_sample, win.samples,
+					 NULL, elevs, err, errlen) != 0 ) { 
+		status = -1;
+		break;
+	  }
+	  phasestop(stats, kPHASE_DECODE, &t);
+	  phasestart(stats, &t);
+	  quantizerow(elevs, win.samples, q, tga_row);
+	  if ( stats != NULL ) { 
+		stats->clipped += clippedsamples(elevs, win.samples, q);
+		stats->profiles++;
+		stats->samples += win.samples;
+	  }
+	  phasestop(stats, kPHASE_QUANTIZE, &t);
+	  phasestart(stats, &t);
+	  if ( tgafile != NULL && iorow(&io, tga_row, win.samples) != 0 ) { 
+		snprintf(err, errlen, "%s: write: %s.", tga_name, strerror(errno));
+		status = -1;
+		break;
+	  }
+	  if ( sinkrow(sinks, elevs, err, errlen) != 0 ) { 
+		status = -1;
+		break;
+	  }
+	  phasestop(stats, kPHASE_WRITE, &t);
+	  current_profile++;
+	}
+  }
+  phasestart(stats, &t);
+  if ( io_started ) { 
+	status = finishio(&io, status, tga_name, err, errlen);
+  }
+  status = sinkfinish(sinks, status, err, errlen);
+  if ( verbose == 1 && status == 0 ) { fprintf(stderr, " done.\n"); }
+  if ( stats != NULL ) { 
+	struct stat st;
+	if ( tgafile != NULL ) { 
+	  fflush(tgafile);
+	  stats->bytes_written += ftell(tgafile);
+	} else if ( stat(tga_name, &st) == 0 ) { 
+	  stats->bytes_written += st.st_size;
+	}
+  }
+  if ( tgafile != NULL && fclose(tgafile) != 0 && status == 0 ) { 
+	snprintf(err, errlen, "%s: close: %s.", tga_name, strerror(errno));
+	status = -1;
+  }
+  if ( !from_cache ) { 
+	free(grid.elev);
+  }
+  free(q);
+  free(tga_row);
+  free(elevs);
+  unmapdem(&dem);
+  phasestop(stats, kPHASE_WRITE, &t);
+  return(status);
+}
+
+/* Convert one DEM file to a TGA file, reporting stats if asked to.
+   Returns 0, or -1 with a message in err.
+*/
+int convertdem(const char *dem_name, const char *tga_name, const struct convopts *o, char *err, size_t errlen) { 
+  struct demstats stats;
+  int status;
+
+  if ( o->stats == NULL ) { 
+	return(convertone(dem_name, tga_name, o, NULL, err, errlen));
+  }
+  memset(&stats, 0, sizeof(stats));
+  status = convertone(dem_name, tga_name, o, &stats, err, errlen);
+  writestats(o->stats, dem_name, tga_name, status, err, &stats);
+  return(status);
+}
+
+/* The -n output for one file: its name and the last lat,long pair */
+void printlocation(const struct demheader *h) { 
+  char name[41];
+  int j;
+  for(j=0; j <= 39; j++) { name[j] = h->name[j]; }
+  name[40] = '\0';
+  for(j=39; j > 0; j--) {
+	if(!isspace(name[j])) { j=0; } else { name[j] = '\0'; }
+  }
+  fprintf(stdout,"NAME=\"%s\";\n",name);
+  if ( h->poly_verts[7] < 0.0 ) { 
+	fprintf(stdout,"LOC=\"%.2fS,",fabs(h->poly_verts[7]/3600));
+  } else { 
+	fprintf(stdout,"LOC=\"%.2fN,",fabs(h->poly_verts[7]/3600));
+  }
+  if ( h->poly_verts[6] < 0.0 ) { 
+	fprintf(stdout,"%.2fW\";\n",fabs(h->poly_verts[6]/3600));
+  } else { 
+	fprintf(stdout,"%.2fE\";\n",fabs(h->poly_verts[6]/3600));		
+  }
+}
+
+/* Fold the header elevation range of one file into a running global
+   min and max, for -e.  Returns 0, or -1 with a message in err.
+*/
+int foldrange(const struct demheader *h, int verbose, int *first_min_elev,
+			  double *global_min_elev, double *global_max_elev, char *err, size_t errlen) { 
+  double elev_range;
+  elev_range = h->max_elev - h->min_elev;
+  if ( verbose == 1 ) { 
+	fprintf(stderr, " min,max elev: %.2f to %.2f, range %.2f\n", h->min_elev,h->max_elev,elev_range);
+  }
+  if ( elev_range < 0.0 ) { 
+	snprintf(err, errlen, "Negative elevation range.");
+	return(-1);
+  }
+  if ( *first_min_elev == 0 ) { 
+	*global_min_elev = h->min_elev;
+	*first_min_elev = 1;
+  } else {
+	if ( h->min_elev < *global_min_elev ) { 
+	  *global_min_elev = h->min_elev;
+	}
+  }
+  if ( h->max_elev > *global_max_elev ) { 
+	*global_max_elev = h->max_elev;
+  }
+  return(0);
+}
+
+/* The scaling factor mapping a global elevation range onto 0..255 */
+void rangescale(double global_min_elev, double global_max_elev, int verbose, double *min, double *scale) { 
+  double elev_range;
+  elev_range = global_max_elev - global_min_elev;
+  if ( verbose == 1 ) { 
+	fprintf(stderr, "Global min,max elev: %.2f to %.2f, range %.2f\n", global_min_elev,global_max_elev,elev_range);
+  }
+  *min = global_min_elev;
+  if ( elev_range == 0.0 ) { 
+	*scale = 0.0;
+  }
+  else { 
+	*scale = 255.0 / elev_range;
+  }
+}
+
+/* Fold the header elevation range of each file into a global min and
+   a scaling factor mapping the global range onto 0..255, as for -e.
+   Returns 0, or -1 with a message in err.
+*/
+int extractscale(char **files, int nfiles, int verbose, double *min, double *scale, char *err, size_t errlen) { 
+  struct demheader h;
+  double global_min_elev, global_max_elev;
+  int i, first_min_elev;
+
+  global_min_elev = 0.0;
+  global_max_elev = 0.0;
+  first_min_elev = 0;
+  for(i=0; i < nfiles; i++) { 
+	if ( verbose == 1 ) { fprintf(stderr,"DEM File %s: ",files[i]); }
+	if ( readheader(files[i], &h, err, errlen) != 0 ) { 
+	  return(-1);
+	}
+	if ( foldrange(&h, verbose, &first_min_elev, &global_min_elev, &global_max_elev, err, errlen) != 0 ) { 
+	  return(-1);
+	}
+  }
+  rangescale(global_min_elev, global_max_elev, verbose, min, scale);
+  return(0);
+}
+
+/* Percentile scaling, for -e --percentile.
+
+   The header min and max of every file let one bad header or a lone
+   peak set the scale for the whole set.  Instead this decodes the
+   Type B samples of each file into a histogram (kLUT_SIZE bins, one
+   file per thread), merges them, and maps the elevations at the lower
+   and upper percentiles onto 0..255.
+
+   With -c each file's histogram is kept next to it as name.dem.demh,
+   and a current one (same DEM size and mtime, checksum matching) is
+   used rather than decoding again, so adding a tile to a set only
+   decodes the new tile.  Only the span of bins in use is stored.
+
+   Layout, all little endian:
+	 0  "DEMHISTG", u32 version, u32 bins
+	16  u64 checksum (over the whole file with it zeroed)
+	24  u64 DEM size, i64 DEM mtime in nanoseconds
+	40  i32 elevation of the first bin, u32 0, u64 samples
+	56  bins x u32 counts
+*/
+#define kHIST_MAGIC "DEMHISTG"
+#define kHIST_VERSION 2
+#define kHIST_HEADER_SIZE 56
+#define kHIST_SUFFIX ".demh"
+#define kHIST_LOW 0.1
+#define kHIST_HIGH 99.9
+
+char *histname(const char *dem_name) { 
+  char *name;
+  if ((name = malloc(strlen(dem_name) + sizeof(kHIST_SUFFIX))) != NULL) { 
+	sprintf(name, "%s%s", dem_name, kHIST_SUFFIX);
+  }
+  return(name);
+}
+
+/* Fill hist from the histogram cache of dem_name if it has a current
+   one.  Returns 0, or -1 if there isn't one.
+*/
+static int readhist(const char *dem_name, const struct stat *st, uint32_t *hist) { 
+  struct demmap m;
+  const unsigned char *p;
+  unsigned char hdr[kHIST_HEADER_SIZE];
+  char *name;
+  uint32_t bins, i;
+  int32_t first;
+
+  if ((name = histname(dem_name)) == NULL) { 
+	return(-1);
+  }
+  if ( mapdem(&m, name) != 0 ) { 
+	free(name);
+	return(-1);
+  }
+  free(name);
+  p = (const unsigned char *)m.data;
+  if ( m.size < kHIST_HEADER_SIZE || memcmp(p, kHIST_MAGIC, 8) != 0 || get32(p + 8) != kHIST_VERSION ) { 
+	goto stale;
+  }
+  bins = get32(p + 12);
+  first = (int32_t)get32(p + 40);
+  if ( bins > kLUT_SIZE || first < INT16_MIN || (int64_t)first + bins > INT16_MAX + 1 ||
+	   m.size != kHIST_HEADER_SIZE + (size_t)bins * 4 ||
+	   get64(p + 24) != (uint64_t)st->st_size || (long long)get64(p + 32) != mtimens(st) ) { 
+	goto stale;
+  }
+  memcpy(hdr, p, kHIST_HEADER_SIZE);
+  memset(hdr + 16, 0, 8);
+  if ( checksum(p + kHIST_HEADER_SIZE, (size_t)bins * 4, checksum(hdr, kHIST_HEADER_SIZE, kCHECKSUM_SEED)) != get64(p + 16) ) { 
+	goto stale;
+  }
+  memset(hist, 0, kLUT_SIZE * sizeof(uint32_t));
+  for(i=0; i < bins; i++) { 
+	hist[first + kLUT_OFFSET + i] = get32(p + kHIST_HEADER_SIZE + 4 * i);
+  }
+  unmapdem(&m);
+  return(0);
+
+ stale:
+  unmapdem(&m);
+  return(-1);
+}
+
+/* Write (or replace) the histogram cache of dem_name, for the DEM as
+   it was when st was taken.  Returns 0, or -1 with a message in err.
+*/
+int writehist(const char *dem_name, const struct stat *st, const uint32_t *hist, char *err, size_t errlen) { 
+  unsigned char *buf;
+  char *name, *tmp_name;
+  uint64_t total;
+  size_t len;
+  int lo, hi, i, status;
+  FILE *fp;
+
+  for(lo=0; lo < kLUT_SIZE && hist[lo] == 0; lo++) { }
+  for(hi=kLUT_SIZE; hi > lo && hist[hi - 1] == 0; hi--) { }
+  len = kHIST_HEADER_SIZE + (size_t)(hi - lo) * 4;
+  if ((buf = calloc(1, len)) == NULL) { 
+	snprintf(err, errlen, "Out of memory.");
+	return(-1);
+  }
+  total = 0;
+  for(i=lo; i < hi; i++) { 
+	put32(buf + kHIST_HEADER_SIZE + 4 * (i - lo), hist[i]);
+	total += hist[i];
+  }
+  memcpy(buf, kHIST_MAGIC, 8);
+  put32(buf + 8, kHIST_VERSION);
+  put32(buf + 12, (uint32_t)(hi - lo));
+  put64(buf + 24, (uint64_t)st->st_size);
+  put64(buf + 32, (uint64_t)mtimens(st));
+  put32(buf + 40, (uint32_t)(lo - kLUT_OFFSET));
+  put64(buf + 48, total);
+  put64(buf + 16, checksum(buf + kHIST_HEADER_SIZE, len - kHIST_HEADER_SIZE,
+						   checksum(buf, kHIST_HEADER_SIZE, kCHECKSUM_SEED)));
+
+  // under a temporary name and renamed, as for the grid cache
+  name = histname(dem_name);
+  tmp_name = name != NULL ? malloc(strlen(name) + 8) : NULL;
+  if ( tmp_name == NULL ) { 
+	snprintf(err, errlen, "Out of memory.");
+	free(name);
+	free(buf);
+	return(-1);
+  }
+  sprintf(tmp_name, "%s.%d", name, (int)getpid());
+  status = 0;
+  if ((fp = fopen(tmp_name, "wb")) == NULL) { 
+	snprintf(err, errlen, "%s: %s.", tmp_name, strerror(errno));
+	status = -1;
+  } else { 
+	if ( fwrite(buf, 1, len, fp) != len ) { 
+	  snprintf(err, errlen, "%s: write: %s.", tmp_name, strerror(errno));
+	  status = -1;
+	}
+	if ( fclose(fp) != 0 && status == 0 ) { 
+	  snprintf(err, errlen, "%s: close: %s.", tmp_name, strerror(errno));
+	  status = -1;
+	}
+	if ( status == 0 && rename(tmp_name, name) != 0 ) { 
+	  snprintf(err, errlen, "%s: rename: %s.", name, strerror(errno));
+	  status = -1;
+	}
+	if ( status != 0 ) { 
+	  unlink(tmp_name);
+	}
+  }
+  free(tmp_name);
+  free(name);
+  free(buf);
+  return(status);
+}
+
+/* Count every sample of path into hist (kLUT_SIZE bins, cleared
+   here), from its histogram cache or grid cache if it has a current
+   one and otherwise by decoding it a profile at a time.  *cached says
+   which.  Returns 0, or -1 with a message in err.
+*/
+static int filehist(const char *path, int write_cache, uint32_t *hist, int *cached, char *err, size_t errlen) { 
+  struct demmap dem;
+  struct demheader h;
+  struct demgrid g;
+  struct profileinfo info;
+  struct stat st;
+  size_t i, n;
+  int *elevs, profile_elevs, k;
+  char msg[192];
+
+  *cached = 0;
+  if ( stat(path, &st) != 0 ) { 
+	snprintf(err, errlen, "%s: %s.", path, strerror(errno));
+	return(-1);
+  }
+  if ( readhist(path, &st, hist) == 0 ) { 
+	*cached = 1;
+	return(0);
+  }
+  memset(hist, 0, kLUT_SIZE * sizeof(uint32_t));
+  if ( opencache(path, &dem, &h, &g) == 0 ) { 
+	n = (size_t)g.rows * g.cols;
+	for(i=0; i < n; i++) { 
+	  hist[g.elev[i] + kLUT_OFFSET]++;
+	}
+	unmapdem(&dem);
+  } else { 
+	if ( mapdem(&dem, path) != 0 ) { 
+	  snprintf(err, errlen, "%s: %s.", path, strerror(errno));
+	  return(-1);
+	}
+	if ( dem.size < kTYPE_A_SIZE + 24 ) { 
+	  snprintf(err, errlen, "%s: truncated DEM file.", path);
+	  unmapdem(&dem);
+	  return(-1);
+	}
+	parsetypea(dem.data, &h);
+	profile_elevs = getnextint(&dem.data[kTYPE_A_SIZE + 12]);
+	if ( checkheader(&h, msg, sizeof(msg)) != 0 ) { 
+	  snprintf(err, errlen, "%s: %s", path, msg);
+	  unmapdem(&dem);
+	  return(-1);
+	}
+	if ( profile_elevs < 1 ) { 
+	  snprintf(err, errlen, "%s: no profiles.", path);
+	  unmapdem(&dem);
+	  return(-1);
+	}
+	if ( indexdem(&dem, h.profile_num) != 0 || (elevs = malloc(profile_elevs * sizeof(int))) == NULL ) { 
+	  snprintf(err, errlen, "Out of memory.");
+	  unmapdem(&dem);
+	  return(-1);
+	}
+	for(k=1; k <= h.profile_num; k++) { 
+	  if ( readprofile(&dem, k, h.profile_dim, profile_elevs, &info, elevs, msg, sizeof(msg)) != 0 ) { 
+		snprintf(err, errlen, "%s: %s", path, msg);
+		free(elevs);
+		unmapdem(&dem);
+		return(-1);
+	  }
+	  for(i=0; i < (size_t)profile_elevs; i++) { 
+		if ( elevs[i] < INT16_MIN || elevs[i] > INT16_MAX ) { 
+		  snprintf(err, errlen, "%s: elevation %d in profile %d doesn't fit in 16 bits.", path, elevs[i], k);
+		  free(elevs);
+		  unmapdem(&dem);
+		  return(-1);
+		}
+		hist[elevs[i] + kLUT_OFFSET]++;
+	  }
+	}
+	free(elevs);
+	unmapdem(&dem);
+  }
+  if ( write_cache == 1 ) { 
+	return(writehist(path, &st, hist, err, errlen));
+  }
+  return(0);
+}
+
+struct histscan { 
+  char **files;
+  int nfiles, next;
+  int write_cache, verbose;
+  uint64_t *hist;             // merged, kLUT_SIZE bins
+  int failed;                 // first file that failed, or -1
+  int cached;                 // files taken from a .demh
+  char err[256];
+  pthread_mutex_t lock;
+};
+
+static void *histworker(void *arg) { 
+  struct histscan *s = arg;
+  uint32_t *hist;
+  char err[256];
+  int i, j, cached, status;
+
+  if ((hist = malloc(kLUT_SIZE * sizeof(uint32_t))) == NULL) { 
+	pthread_mutex_lock(&s->lock);
+	if ( s->failed < 0 ) { 
+	  s->failed = 0;
+	  snprintf(s->err, sizeof(s->err), "Out of memory.");
+	}
+	pthread_mutex_unlock(&s->lock);
+	return(NULL);
+  }
+  for(;;) { 
+	pthread_mutex_lock(&s->lock);
+	i = s->next < s->nfiles && s->failed < 0 ? s->next++ : -1;
+	pthread_mutex_unlock(&s->lock);
+	if ( i < 0 ) { 
+	  break;
+	}
+	status = filehist(s->files[i], s->write_cache, hist, &cached, err, sizeof(err));
+	pthread_mutex_lock(&s->lock);
+	if ( status != 0 ) { 
+	  // report the first failure in file order
+	  if ( s->failed < 0 || i < s->failed ) { 
+		s->failed = i;
+		snprintf(s->err, sizeof(s->err), "%s", err);
+	  }
+	} else { 
+	  for(j=0; j < kLUT_SIZE; j++) { 
+		s->hist[j] += hist[j];
+	  }
+	  s->cached += cached;
+	  if ( s->verbose == 1 ) { 
+		fprintf(stderr,"DEM File %s: histogram %s\n", s->files[i], cached ? "cached" : "decoded");
+	  }
+	}
+	pthread_mutex_unlock(&s->lock);
+  }
+  free(hist);
+  return(NULL);
+}
+
+/* The elevation of the sample of the given rank (from 0) in hist */
+static int histrank(const uint64_t *hist, uint64_t rank) { 
+  uint64_t below = 0;
+  int i;
+  for(i=0; i < kLUT_SIZE - 1; i++) { 
+	below += hist[i];
+	if ( below > rank ) { 
+	  break;
+	}
+  }
+  return(i - kLUT_OFFSET);
+}
+
+/* Merge the sample histograms of every file, from nthreads threads,
+   and map the elevations at the lo and hi percentiles onto 0..255.
+   Returns 0, or -1 with a message in err.
+*/
+int percentilescale(char **files, int nfiles, double lo, double hi, int nthreads, int write_cache, int verbose,
+					double *min, double *scale, char *err, size_t errlen) { 
+  struct histscan s;
+  pthread_t *tids;
+  uint64_t total;
+  int i, started, low_elev, high_elev;
+
+  memset(&s, 0, sizeof(s));
+  s.files = files;
+  s.nfiles = nfiles;
+  s.write_cache = write_cache;
+  s.verbose = verbose;
+  s.failed = -1;
+  s.hist = calloc(kLUT_SIZE, sizeof(uint64_t));
+  tids = malloc(nthreads * sizeof(pthread_t));
+  if ( s.hist == NULL || tids == NULL ) { 
+	snprintf(err, errlen, "Out of memory.");
+	free(s.hist);
+	free(tids);
+	return(-1);
+  }
+  pthread_mutex_init(&s.lock, NULL);
+  for(started=1; started < nthreads && started < nfiles; started++) { 
+	if ( pthread_create(&tids[started], NULL, histworker, &s) != 0 ) { 
+	  break;
+	}
+  }
+  histworker(&s);
+  for(i=1; i < started; i++) { 
+	pthread_join(tids[i], NULL);
+  }
+  pthread_mutex_destroy(&s.lock);
+  free(tids);
+  if ( s.failed >= 0 ) { 
+	snprintf(err, errlen, "%s", s.err);
+	free(s.hist);
+	return(-1);
+  }
+
+  total = 0;
+  for(i=0; i < kLUT_SIZE; i++) { 
+	total += s.hist[i];
+  }
+  if ( total == 0 ) { 
+	snprintf(err, errlen, "No elevations.");
+	free(s.hist);
+	return(-1);
+  }
+  // nearest rank, widened outwards, so 0,100 is the exact data range
+  low_elev = histrank(s.hist, (uint64_t)floor(lo / 100.0 * (total - 1)));
+  high_elev = histrank(s.hist, (uint64_t)ceil(hi / 100.0 * (total - 1)));
+  if ( verbose == 1 ) { 
+	fprintf(stderr, "%d files, %d histograms cached, %llu samples\n", nfiles, s.cached, (unsigned long long)total);
+	fprintf(stderr, "Percentiles %g to %g: elev %d to %d of %d to %d\n", lo, hi, low_elev, high_elev,
+			histrank(s.hist, 0), histrank(s.hist, total - 1));
+  }
+  free(s.hist);
+  rangescale(low_elev, high_elev, verbose, min, scale);
+  return(0);
+}
+
+/* Header catalogs.
+
+   For -e and -n over a large archive, -C keeps a catalog of what they
+   need from each file's Type A record, keyed by path and checked
+   against the file's size and mtime.  Only new or changed files are
+   read again, and those with concurrent pread()s of just the header
+   from a pool of threads; stat()s run in the pool as well.
+
+   The catalog is a text file, one tab separated line per file:
+	 path size mtime min max profiles elevations x_res y_res z_res
+	 8 x polygon vertex coordinates, name
+   with the mtime in nanoseconds.
+*/
+#define kCATALOG_MAGIC "# dem2tga catalog 2"
+#define kCATALOG_THREADS 8
+
+struct catentry { 
+  char *path;
+  long long size, mtime;
+  int profile_elevs;
+  struct demheader h;
+};
+
+struct catalog { 
+  struct catentry *e;
+  int n, cap;
+};
+
+struct catscan { 
+  const struct catalog *c;    // sorted by path, read only while scanning
+  char **files;
+  struct catentry *found;     // one per file
+  int *fresh;                 // 1 if found[i] was read from the file
+  int *status;
+  char (*err)[160];
+  int nfiles, next;
+  pthread_mutex_t lock;
+};
+
+static int cmpcatentry(const void *a, const void *b) { 
+  return(strcmp(((const struct catentry *)a)->path, ((const struct catentry *)b)->path));
+}
+
+static const struct catentry *findentry(const struct catalog *c, const char *path) { 
+  struct catentry key;
+  key.path = (char *)path;
+  return(c->n > 0 ? bsearch(&key, c->e, c->n, sizeof(struct catentry), cmpcatentry) : NULL);
+}
+
+static int addentry(struct catalog *c, const struct catentry *e) { 
+  if ( c->n == c->cap ) { 
+	struct catentry *ne;
+	int cap = c->cap ? c->cap * 2 : 256;
+	if ((ne = realloc(c->e, cap * sizeof(struct catentry))) == NULL) { 
+	  return(-1);
+	}
+	c->e = ne;
+	c->cap = cap;
+  }
+  c->e[c->n] = *e;
+  if ((c->e[c->n].path = strdup(e->path)) == NULL) { 
+	return(-1);
+  }
+  c->n++;
+  return(0);
+}
+
+void freecatalog(struct catalog *c) { 
+  int i;
+  for(i=0; i < c->n; i++) { 
+	free(c->e[i].path);
+  }
+  free(c->e);
+  c->e = NULL;
+  c->n = c->cap = 0;
+}
+
+/* Load a catalog.  A missing file is an empty catalog, lines that
+   don't parse are dropped (those files just get read again).
+*/
+int loadcatalog(const char *path, struct catalog *c, char *err, size_t errlen) { 
+  FILE *fp;
+  char line[8192], *field[19], *p;
+  struct catentry e;
+  int n, i;
+
+  c->e = NULL;
+  c->n = c->cap = 0;
+  if ((fp = fopen(path, "r")) == NULL) { 
+	if ( errno == ENOENT ) { 
+	  return(0);
+	}
+	snprintf(err, errlen, "%s: %s.", path, strerror(errno));
+	return(-1);
+  }
+  if ( fgets(line, sizeof(line), fp) == NULL || strncmp(line, kCATALOG_MAGIC, strlen(kCATALOG_MAGIC)) != 0 ) { 
+	fclose(fp);
+	return(0);
+  }
+  while ( fgets(line, sizeof(line), fp) != NULL ) { 
+	line[strcspn(line, "\n")] = '\0';
+	for(n=0, p=line; n < 19; n++) { 
+	  field[n] = p;
+	  if ((p = strchr(p, '\t')) == NULL) { 
+		n++;
+		break;
+	  }
+	  *p++ = '\0';
+	}
+	if ( n != 19 ) { 
+	  continue;
+	}
+	memset(&e, 0, sizeof(e));
+	e.path = field[0];
+	e.size = strtoll(field[1], NULL, 10);
+	e.mtime = strtoll(field[2], NULL, 10);
+	e.h.min_elev = strtod(field[3], NULL);
+	e.h.max_elev = strtod(field[4], NULL);
+	e.h.profile_num = atoi(field[5]);
+	e.profile_elevs = atoi(field[6]);
+	e.h.x_res = strtof(field[7], NULL);
+	e.h.y_res = strtof(field[8], NULL);
+	e.h.z_res = strtof(field[9], NULL);
+	for(i=0; i < 8; i++) { 
+	  e.h.poly_verts[i] = strtod(field[10 + i], NULL);
+	}
+	snprintf(e.h.name, sizeof(e.h.name), "%s", field[18]);
+	if ( addentry(c, &e) != 0 ) { 
+	  snprintf(err, errlen, "Out of memory.");
+	  fclose(fp);
+	  return(-1);
+	}
+  }
+  fclose(fp);
+  qsort(c->e, c->n, sizeof(struct catentry), cmpcatentry);
+  return(0);
+}
+
+int savecatalog(const char *path, const struct catalog *c, char *err, size_t errlen) { 
+  char *tmp_name, name[41];
+  FILE *fp;
+  int i, j, status;
+
+  if ((tmp_name = malloc(strlen(path) + 16)) == NULL) { 
+	snprintf(err, errlen, "Out of memory.");
+	return(-1);
+  }
+  sprintf(tmp_name, "%s.%d", path, (int)getpid());
+  if ((fp = fopen(tmp_name, "w")) == NULL) { 
+	snprintf(err, errlen, "%s: %s.", tmp_name, strerror(errno));
+	free(tmp_name);
+	return(-1);
+  }
+  fprintf(fp, "%s\n", kCATALOG_MAGIC);
+  for(i=0; i < c->n; i++) { 
+	const struct catentry *e = &c->e[i];
+	if ( strpbrk(e->path, "\t\n") != NULL ) { 
+	  continue;
+	}
+	// the 40 character name -n prints, kept to one field
+	for(j=0; j < 40 && e->h.name[j] != '\0'; j++) { 
+	  name[j] = isspace((unsigned char)e->h.name[j]) ? ' ' : e->h.name[j];
+	}
+	name[j] = '\0';
+	while ( j > 0 && name[j-1] == ' ' ) { name[--j] = '\0'; }
+	fprintf(fp, "%s\t%lld\t%lld\t%.17g\t%.17g\t%d\t%d\t%.9g\t%.9g\t%.9g",
+			e->path, e->size, e->mtime, e->h.min_elev, e->h.max_elev,
+			e->h.profile_num, e->profile_elevs, e->h.x_res, e->h.y_res, e->h.z_res);
+	for(j=0; j < 8; j++) { 
+	  fprintf(fp, "\t%.17g", e->h.poly_verts[j]);
+	}
+	fprintf(fp, "\t%s\n", name);
+  }
+  status = 0;
+  if ( ferror(fp) ) { 
+	snprintf(err, errlen, "%s: write: %s.", tmp_name, strerror(errno));
+	status = -1;
+  }
+  if ( fclose(fp) != 0 && status == 0 ) { 
+	snprintf(err, errlen, "%s: close: %s.", tmp_name, strerror(errno));
+	status = -1;
+  }
+  if ( status == 0 && rename(tmp_name, path) != 0 ) { 
+	snprintf(err, errlen, "%s: rename: %s.", path, strerror(errno));
+	status = -1;
+  }
+  if ( status != 0 ) { 
+	unlink(tmp_name);
+  }
+  free(tmp_name);
+  return(status);
+}
+
+/* stat() one file and, unless the catalog already has it as it is
+   now, read its header with pread()
+*/
+static int scanentry(const struct catalog *c, const char *path, struct catentry *e, int *fresh,
+					 char *err, size_t errlen) { 
+  char type_a_record[kTYPE_A_SIZE], elevs[kINT_LENGTH];
+  const struct catentry *old;
+  struct stat st;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) { 
+	snprintf(err, errlen, "Error : %s.", strerror(errno));
+	if ( fd >= 0 ) { close(fd); }
+	return(-1);
+  }
+  if ((old = findentry(c, path)) != NULL && old->size == (long long)st.st_size && old->mtime == mtimens(&st)) { 
+	close(fd);
+	*e = *old;
+	*fresh = 0;
+	return(0);
+  }
+  if ( pread(fd, type_a_record, kTYPE_A_SIZE, 0) != kTYPE_A_SIZE ) { 
+	snprintf(err, errlen, "%s: truncated DEM file.", path);
+	close(fd);
+	return(-1);
+  }
+  memset(e, 0, sizeof(*e));
+  e->path = (char *)path;
+  e->size = (long long)st.st_size;
+  e->mtime = mtimens(&st);
+  parsetypea(type_a_record, &e->h);
+  e->profile_elevs = pread(fd, elevs, kINT_LENGTH, kTYPE_A_SIZE + 12) == kINT_LENGTH ? getnextint(elevs) : 0;
+  close(fd);
+  *fresh = 1;
+  return(0);
+}
+
+static void *catworker(void *arg) { 
+  struct catscan *s = arg;
+  int i;
+  for(;;) { 
+	pthread_mutex_lock(&s->lock);
+	i = s->next < s->nfiles ? s->next++ : -1;
+	pthread_mutex_unlock(&s->lock);
+	if ( i < 0 ) { 
+	  return(NULL);
+	}
+	s->status[i] = scanentry(s->c, s->files[i], &s->found[i], &s->fresh[i], s->err[i], sizeof(s->err[i]));
+  }
+}
+
+/* Fill hs[i] with the header fields of files[i] by way of the catalog
+   at catalog_path, reading only the files that aren't in it or have
+   changed, then save the updated catalog.  Returns 0, or -1 with a
+   message in err for the first file that couldn't be read.
+*/
+int catalogheaders(const char *catalog_path, char **files, int nfiles, int nthreads, int verbose,
+				   struct demheader *hs, char *err, size_t errlen) { 
+  struct catalog c;
+  struct catscan s;
+  pthread_t *tids;
+  int i, started, rescanned, status;
+
+  if ( loadcatalog(catalog_path, &c, err, errlen) != 0 ) { 
+	return(-1);
+  }
+  memset(&s, 0, sizeof(s));
+  s.c = &c;
+  s.files = files;
+  s.nfiles = nfiles;
+  s.found = calloc(nfiles, sizeof(struct catentry));
+  s.fresh = calloc(nfiles, sizeof(int));
+  s.status = calloc(nfiles, sizeof(int));
+  s.err = calloc(nfiles, sizeof(*s.err));
+  tids = malloc(nthreads * sizeof(pthread_t));
+  status = 0;
+  if ( s.found == NULL || s.fresh == NULL || s.status == NULL || s.err == NULL || tids == NULL ) { 
+	snprintf(err, errlen, "Out of memory.");
+	status = -1;
+	goto done;
+  }
+  pthread_mutex_init(&s.lock, NULL);
+  // this thread is the first of the nthreads
+  for(started=1; started < nthreads && started < nfiles; started++) { 
+	if ( pthread_create(&tids[started], NULL, catworker, &s) != 0 ) { 
+	  break;
+	}
+  }
+  catworker(&s);
+  for(i=1; i < started; i++) { 
+	pthread_join(tids[i], NULL);
+  }
+  pthread_mutex_destroy(&s.lock);
+
+  rescanned = 0;
+  for(i=0; i < nfiles; i++) { 
+	if ( s.status[i] != 0 ) { 
+	  snprintf(err, errlen, "%s", s.err[i]);
+	  status = -1;
+	  goto done;
+	}
+	hs[i] = s.found[i].h;
+	rescanned += s.fresh[i];
+  }
+  if ( verbose == 1 ) { 
+	fprintf(stderr, "Catalog %s: %d files, %d read\n", catalog_path, nfiles, rescanned);
+  }
+
+  // fold what was read into the catalog and write it back
+  if ( rescanned > 0 ) { 
+	struct catalog loaded = c;  // the sorted part, new files go after it
+	int j;
+	for(i=0; i < nfiles; i++) { 
+	  struct catentry *old;
+	  if ( s.fresh[i] == 0 ) { 
+		continue;
+	  }
+	  if ((old = (struct catentry *)findentry(&loaded, files[i])) != NULL) { 
+		char *path = old->path;
+		*old = s.found[i];
+		old->path = path;
+	  } else if ( addentry(&c, &s.found[i]) != 0 ) { 
+		snprintf(err, errlen, "Out of memory.");
+		status = -1;
+		goto done;
+	  }
+	  loaded.e = c.e;
+	}
+	qsort(c.e, c.n, sizeof(struct catentry), cmpcatentry);
+	// a file named twice was read twice
+	for(i=j=0; i < c.n; i++) { 
+	  if ( j > 0 && strcmp(c.e[j-1].path, c.e[i].path) == 0 ) { 
+		free(c.e[i].path);
+		continue;
+	  }
+	  c.e[j++] = c.e[i];
+	}
+	c.n = j;
+	status = savecatalog(catalog_path, &c, err, errlen);
+  }
+
+ done:
+  free(tids);
+  free(s.err);
+  free(s.status);
+  free(s.fresh);
+  free(s.found);
+  freecatalog(&c);
+  return(status);
+}
+
+/* Mosaics.
+
+   Tiles are placed on a common grid by their corner coordinates, one
+   output row per profile position and one column per sample position,
+   in the same orientation as a single converted DEM.  Output rows are
+   produced in order: a tile is mapped when the first of its profiles
+   is needed and released after its last, so only the tiles crossing
+   the current row are held, each with a single decoded profile.
+   Where tiles overlap (the shared edge profiles and samples of
+   neighbouring 1 degree tiles) the first tile named wins.  Cells no
+   tile covers are written as 0.
+
+   TGA dimensions are 16 bit, so bigger mosaics are split into a grid
+   of files named tga_file_<row>_<col>.tga.
+*/
+#define kTGA_MAX_DIM 65535
+
+struct mosaictile { 
+  const char *name;
+  struct demheader h;
+  struct demmap dem;
+  int profile_elevs;
+  int row0, row1;   // output rows covered
+  int *elevs;
+};
+
+static int cmptilerow(const void *a, const void *b) { 
+  const struct mosaictile *ta = *(struct mosaictile * const *)a;
+  const struct mosaictile *tb = *(struct mosaictile * const *)b;
+  return(ta->row0 - tb->row0);
+}
+
+/* Output file name for part (pr,pc) of a mosaic split into parts */
+static char *mosaicpartname(const char *tga_name, int pr, int pc, int nparts) { 
+  char suffix[32];
+  if ( nparts == 1 ) { 
+	return(strdup(tga_name));
+  }
+  snprintf(suffix, sizeof(suffix), "_%d_%d", pr, pc);
+  return(derivedname(tga_name, suffix));
+}
+
+/* Build one mosaic from nfiles DEM tiles.  Returns 0, or -1 with a
+   message in err.
+*/
+int mosaicdem(const char *tga_name, char **files, int nfiles, const struct convopts *o, char *err, size_t errlen) { 
+  struct mosaictile *tiles, **order, **active;
+  struct profileinfo info;
+  double gx0, gx1, gy0, gy1, x_res, y_res, min_elev, scaling_factor;
+  int rows, cols, nactive, next, r, i, k, status;
+  int nprow, npcol, pr, pc;
+  int tga_type = o->rle == 1 ? kTGA_MAPPED_RLE : kTGA_MAPPED;
+  int *elevs;
+  unsigned char *valid, *tga_row;
+  struct quantizer *q;
+  FILE **parts;
+  char *part_name, msg[256];
+
+  tiles = calloc(nfiles, sizeof(struct mosaictile));
+  order = malloc(nfiles * sizeof(struct mosaictile *));
+  active = malloc(nfiles * sizeof(struct mosaictile *));
+  if ( tiles == NULL || order == NULL || active == NULL ) { 
+	snprintf(err, errlen, "Out of memory.");
+	free(tiles); free(order); free(active);
+	return(-1);
+  }
+
+  // lay out the tiles from their headers alone
+  gx0 = gy0 = HUGE_VAL;
+  gx1 = gy1 = -HUGE_VAL;
+  x_res = y_res = 0.0;
+  for(i=0; i < nfiles; i++) { 
+	struct mosaictile *t = &tiles[i];
+	t->name = files[i];
+	if ( readheader(t->name, &t->h, err, errlen) != 0 ) { 
+	  goto fail;
+	}
+	if ( t->h.poly_sides != 4 || t->h.profile_dim != 1 ) { 
+	  snprintf(err, errlen, "%s: not a rectangular 1 dimensional DEM.", t->name);
+	  goto fail;
+	}
+	if ( i == 0 ) { 
+	  x_res = t->h.x_res;
+	  y_res = t->h.y_res;
+	  if ( x_res <= 0.0 || y_res <= 0.0 ) { 
+		snprintf(err, errlen, "%s: bad spatial resolution.", t->name);
+		goto fail;
+	  }
+	} else if ( t->h.x_res != x_res || t->h.y_res != y_res ) { 
+	  snprintf(err, errlen, "%s: resolution %g,%g doesn't match %g,%g.", t->name, t->h.x_res, t->h.y_res, x_res, y_res);
+	  goto fail;
+	}
+	if ( checkheader(&t->h, msg, sizeof(msg)) != 0 ) { 
+	  snprintf(err, errlen, "%s: %s", t->name, msg);
+	  goto fail;
+	}
+	for(k=0; k < 8; k += 2) { 
+	  if ( t->h.poly_verts[k] < gx0 ) { gx0 = t->h.poly_verts[k]; }
+	  if ( t->h.poly_verts[k] > gx1 ) { gx1 = t->h.poly_verts[k]; }
+	  if ( t->h.poly_verts[k+1] < gy0 ) { gy0 = t->h.poly_verts[k+1]; }
+	  if ( t->h.poly_verts[k+1] > gy1 ) { gy1 = t->h.poly_verts[k+1]; }
+	}
+  }
+  rows = (int)floor((gx1 - gx0) / x_res + 0.5) + 1;
+  cols = (int)floor((gy1 - gy0) / y_res + 0.5) + 1;
+  for(i=0; i < nfiles; i++) { 
+	struct mosaictile *t = &tiles[i];
+	double x = fmin(fmin(t->h.poly_verts[0], t->h.poly_verts[2]), fmin(t->h.poly_verts[4], t->h.poly_verts[6]));
+	t->row0 = (int)floor((x - gx0) / x_res + 0.5);
+	t->row1 = t->row0 + t->h.profile_num - 1;
+	order[i] = t;
+  }
+  qsort(order, nfiles, sizeof(struct mosaictile *), cmptilerow);
+
+  if ( o->min_elev_provided == 1 ) { 
+	min_elev = o->provided_elev;
+	scaling_factor = o->scale;
+  } else if ( extractscale(files, nfiles, o->verbose, &min_elev, &scaling_factor, err, errlen) != 0 ) { 
+	goto fail;
+  }
+
+  nprow = (rows + kTGA_MAX_DIM - 1) / kTGA_MAX_DIM;
+  npcol = (cols + kTGA_MAX_DIM - 1) / kTGA_MAX_DIM;
+  if ( o->verbose == 1 ) { 
+	fprintf(stderr,"Mosaic of %d tiles is %d x %d",nfiles,cols,rows);
+	if ( nprow * npcol > 1 ) { fprintf(stderr,", in %d x %d files",npcol,nprow); }
+	fprintf(stderr,"\n");
+  }
+
+  elevs = malloc(cols * sizeof(int));
+  valid = malloc(cols);
+  tga_row = malloc(cols);
+  parts = calloc(npcol, sizeof(FILE *));
+  q = malloc(sizeof(struct quantizer));
+  if ( elevs == NULL || valid == NULL || tga_row == NULL || parts == NULL || q == NULL ) { 
+	snprintf(err, errlen, "Out of memory.");
+	free(elevs); free(valid); free(tga_row); free(parts); free(q);
+	goto fail;
+  }
+  linearlut(q, min_elev, scaling_factor);
+
+  status = 0;
+  nactive = 0;
+  next = 0;
+  for(r=0; status == 0 && r < rows; r++) { 
+	// start a new band of output files
+	if ( (r % kTGA_MAX_DIM) == 0 ) { 
+	  pr = r / kTGA_MAX_DIM;
+	  for(pc=0; pc < npcol; pc++) { 
+		int prows = rows - pr * kTGA_MAX_DIM < kTGA_MAX_DIM ? rows - pr * kTGA_MAX_DIM : kTGA_MAX_DIM;
+		int pcols = cols - pc * kTGA_MAX_DIM < kTGA_MAX_DIM ? cols - pc * kTGA_MAX_DIM : kTGA_MAX_DIM;
+		if ( parts[pc] != NULL && fclose(parts[pc]) != 0 ) { 
+		  snprintf(err, errlen, "close: %s.", strerror(errno));
+		  status = -1;
+		}
+		if ((part_name = mosaicpartname(tga_name, pr, pc, nprow * npcol)) == NULL) { 
+		  snprintf(err, errlen, "Out of memory.");
+		  status = -1;
+		  break;
+		}
+		if ((parts[pc] = fopen(part_name, "wb+")) == NULL ||
+			writetgaheader(parts[pc], prows, pcols, tga_type, kTGA_BOTTOM_LEFT) != 0 ) { 
+		  snprintf(err, errlen, "%s: %s.", part_name, strerror(errno));
+		  status = -1;
+		}
+		free(part_name);
+		if ( status != 0 ) { 
+		  break;
+		}
+	  }
+	  if ( status != 0 ) { 
+		break;
+	  }
+	}
+
+	// bring in the tiles starting on this row
+	while ( next < nfiles && order[next]->row0 <= r ) { 
+	  struct mosaictile *t = order[next++];
+	  if ( mapdem(&t->dem, t->name) != 0 ) { 
+		snprintf(err, errlen, "%s: %s.", t->name, strerror(errno));
+		status = -1;
+		break;
+	  }
+	  if ( t->dem.size < kTYPE_A_SIZE + 24 ) { 
+		snprintf(err, errlen, "%s: truncated DEM file.", t->name);
+		unmapdem(&t->dem);
+		status = -1;
+		break;
+	  }
+	  if ( indexdem(&t->dem, t->h.profile_num) != 0 ) { 
+		snprintf(err, errlen, "Out of memory.");
+		unmapdem(&t->dem);
+		status = -1;
+		break;
+	  }
+	  t->profile_elevs = getnextint(&t->dem.data[kTYPE_A_SIZE + 12]);
+	  if ( t->profile_elevs < 1 || (t->elevs = malloc(t->profile_elevs * sizeof(int))) == NULL ) { 
+		snprintf(err, errlen, "%s: bad profile length %d.", t->name, t->profile_elevs);
+		unmapdem(&t->dem);
+		status = -1;
+		break;
+	  }
+	  active[nactive++] = t;
+	}
+	if ( status != 0 ) { 
+	  break;
+	}
+
+	memset(valid, 0, cols);
+	// last named tile first, so the first named one ends up on top
+	for(i=nfiles-1; i >= 0; i--) { 
+	  struct mosaictile *t = &tiles[i];
+	  int c0, n;
+	  if ( t->elevs == NULL || r < t->row0 || r > t->row1 ) { 
+		continue;
+	  }
+	  if ( readprofile(&t->dem, r - t->row0 + 1, 1, t->profile_elevs, &info, t->elevs, err, errlen) != 0 ) { 
+		snprintf(msg, sizeof(msg), "%s: %s", t->name, err);
+		snprintf(err, errlen, "%s", msg);
+		status = -1;
+		break;
+	  }
+	  c0 = (int)floor((info.y - gy0) / y_res + 0.5);
+	  for(n=0; n < t->profile_elevs; n++) { 
+		if ( c0 + n >= 0 && c0 + n < cols ) { 
+		  elevs[c0 + n] = t->elevs[n];
+		  valid[c0 + n] = 1;
+		}
+	  }
+	}
+	if ( status != 0 ) { 
+	  break;
+	}
+
+	quantizerow(elevs, cols, q, tga_row);
+	for(i=0; i < cols; i++) { 
+	  if ( !valid[i] ) { tga_row[i] = 0; }
+	}
+	for(pc=0; pc < npcol; pc++) { 
+	  int c = pc * kTGA_MAX_DIM;
+	  if ( writetgarow(parts[pc], &tga_row[c], cols - c < kTGA_MAX_DIM ? cols - c : kTGA_MAX_DIM, tga_type) != 0 ) { 
+		snprintf(err, errlen, "write: %s.", strerror(errno));
+		status = -1;
+		break;
+	  }
+	}
+
+	// release the tiles that end on this row
+	for(i=0; i < nactive; ) { 
+	  struct mosaictile *t = active[i];
+	  if ( t->row1 <= r ) { 
+		unmapdem(&t->dem);
+		free(t->elevs);
+		t->elevs = NULL;
+		active[i] = active[--nactive];
+	  } else { 
+		i++;
+	  }
+	}
+	if ( o->verbose == 1 && r > 0 && (r % 100) == 0 ) { 
+	  fprintf(stderr,".");
+	}
+  }
+  if ( o->verbose == 1 && status == 0 ) { fprintf(stderr," done.\n"); }
+
+  for(pc=0; pc < npcol; pc++) { 
+	if ( parts[pc] != NULL && fclose(parts[pc]) != 0 && status == 0 ) { 
+	  snprintf(err, errlen, "close: %s.", strerror(errno));
+	  status = -1;
+	}
+  }
+  for(i=0; i < nactive; i++) { 
+	unmapdem(&active[i]->dem);
+	free(active[i]->elevs);
+  }
+  free(q);
+  free(parts);
+  free(tga_row);
+  free(valid);
+  free(elevs);
+  free(active);
+  free(order);
+  free(tiles);
+  return(status);
+
+ fail:
+  free(active);
+  free(order);
+  free(tiles);
+  return(-1);
+}
+
+/* Batch conversion.
+
+   Every input/output pair is converted in this one process by a pool
+   of workers.  Jobs are handed out largest input first, so the small
+   files fill in behind the big ones at the end of the run instead of
+   leaving one worker grinding through a big file alone.
+*/
+struct batchjob { 
+  const char *dem_name, *tga_name;
+  off_t size;
+  long long mtime;
+  uint64_t hash;              // --rebuild: checksum of the DEM, 0 until known
+  double min_elev, max_elev;  // from its Type A record
+  int unchanged;              // --rebuild: the DEM is as the record has it
+  int current;                // --rebuild: the TGA is too, so it was skipped
+  int status;
+  char err[256];
+};
+
+struct batchqueue { 
+  struct batchjob **order;
+  int njobs, next;
+  const struct convopts *opts;
+  int hash;                   // checksum DEMs converted for the build record
+  pthread_mutex_t lock;
+};
+
+static int cmpjobsize(const void *a, const void *b) { 
+  const struct batchjob *ja = *(struct batchjob * const *)a;
+  const struct batchjob *jb = *(struct batchjob * const *)b;
+  if ( ja->size != jb->size ) { 
+	return(ja->size > jb->size ? -1 : 1);
+  }
+  return(0);
+}
+
+static void *batchworker(void *arg) { 
+  struct batchqueue *q = arg;
+  struct batchjob *job;
+  for(;;) { 
+	pthread_mutex_lock(&q->lock);
+	job = q->next < q->njobs ? q->order[q->next++] : NULL;
+	pthread_mutex_unlock(&q->lock);
+	if ( job == NULL ) { 
+	  return(NULL);
+	}
+	job->status = convertdem(job->dem_name, job->tga_name, q->opts, job->err, sizeof(job->err));
+	if ( job->status == 0 && q->hash && job->hash == 0 ) { 
+	  job->hash = hashfile(job->dem_name);
+	}
+  }
+}
+
+/* Add the input/output pairs listed in a manifest file ("-" for stdin)
+   to jobs.  Each non-blank line not starting with '#' names a DEM file
+   and a TGA file separated by white space.  Returns 0, or -1 with a
+   message in err.
+*/
+int readmanifest(const char *path, struct batchjob **jobs, int *njobs, int *cap, char *err, size_t errlen) { 
+  FILE *fp;
+  char line[4096], dem_name[4096], tga_name[4096];
+  int lineno;
+
+  if ( strcmp(path, "-") == 0 ) { 
+	fp = stdin;
+  } else if ((fp = fopen(path, "r")) == NULL) { 
+	snprintf(err, errlen, "%s: %s.", path, strerror(errno));
+	return(-1);
+  }
+  lineno = 0;
+  while ( fgets(line, sizeof(line), fp) != NULL ) { 
+	char *p = line;
+	lineno++;
+	while ( isspace((unsigned char)*p) ) { p++; }
+	if ( *p == '\0' || *p == '#' ) { 
+	  continue;
+	}
+	if ( sscanf(p, "%4095s %4095s", dem_name, tga_name) != 2 ) { 
+	  snprintf(err, errlen, "%s:%d: expecting a DEM file and a TGA file.", path, lineno);
+	  if ( fp != stdin ) { fclose(fp); }
+	  return(-1);
+	}
+	if ( *njobs == *cap ) { 
+	  struct batchjob *j;
+	  *cap = *cap ? *cap * 2 : 64;
+	  if ((j = realloc(*jobs, *cap * sizeof(struct batchjob))) == NULL) { 
+		snprintf(err, errlen, "Out of memory.");
+		if ( fp != stdin ) { fclose(fp); }
+		return(-1);
+	  }
+	  *jobs = j;
+	}
+	memset(&(*jobs)[*njobs], 0, sizeof(struct batchjob));
+	(*jobs)[*njobs].dem_name = strdup(dem_name);
+	(*jobs)[*njobs].tga_name = strdup(tga_name);
+	(*njobs)++;
+  }
+  if ( fp != stdin ) { fclose(fp); }
+  return(0);
+}
+
+/* Incremental batch rebuilds for --rebuild.
+
+   A build record lists, for each pair converted, the DEM's size,
+   modification time (to the nanosecond) and FNV-1a checksum, its Type
+   A min and max, the min elevation and scale the TGA was made with and
+   the TGA's own size and modification time, under a line describing
+   the options that shape the output.  A later batch run with the same
+   record skips each pair whose TGA is still current: the DEM unchanged
+   (same size and time, or same size and checksum if only the time
+   moved), the TGA as it was left and the scale the same.  The shared scale comes
+   from the recorded min and max of unchanged DEMs, so only new and
+   changed files are opened to work it out, and if it moves every TGA
+   made with the old one is converted again.  Changing the options
+   makes everything stale.  Only the main TGA is checked; -p levels,
+   -f sidecars and terrain products are redone along with it.
+*/
+#define kREBUILD_MAGIC "# dem2tga rebuild 2"
+#define kREBUILD_FIELDS 11
+
+struct buildentry { 
+  char *dem_name, *tga_name;
+  long long size, mtime;
+  uint64_t hash;
+  double min_elev, max_elev;    // from the Type A record
+  double used_min, used_scale;  // what the TGA was made with
+  long long tga_size, tga_mtime;
+};
+
+struct buildrecord { 
+  struct buildentry *e;
+  int n, cap;
+  char *opts;
+};
+
+static int cmpbuildentry(const void *a, const void *b) { 
+  return(strcmp(((const struct buildentry *)a)->tga_name, ((const struct buildentry *)b)->tga_name));
+}
+
+static const struct buildentry *findbuild(const struct buildrecord *r, const char *tga_name) { 
+  struct buildentry key;
+  key.tga_name = (char *)tga_name;
+  return(r->n > 0 ? bsearch(&key, r->e, r->n, sizeof(struct buildentry), cmpbuildentry) : NULL);
+}
+
+static int addbuild(struct buildrecord *r, const struct buildentry *e) { 
+  if ( r->n == r->cap ) { 
+	struct buildentry *ne;
+	int cap = r->cap ? r->cap * 2 : 256;
+	if ((ne = realloc(r->e, cap * sizeof(struct buildentry))) == NULL) { 
+	  return(-1);
+	}
+	r->e = ne;
+	r->cap = cap;
+  }
+  r->e[r->n] = *e;
+  r->e[r->n].dem_name = strdup(e->dem_name);
+  r->e[r->n].tga_name = strdup(e->tga_name);
+  if ( r->e[r->n].dem_name == NULL || r->e[r->n].tga_name == NULL ) { 
+	free(r->e[r->n].dem_name);
+	free(r->e[r->n].tga_name);
+	return(-1);
+  }
+  r->n++;
+  return(0);
+}
+
+void freebuild(struct buildrecord *r) { 
+  int i;
+  for(i=0; i < r->n; i++) { 
+	free(r->e[i].dem_name);
+	free(r->e[i].tga_name);
+  }
+  free(r->e);
+  free(r->opts);
+  memset(r, 0, sizeof(*r));
+}
+
+/* The options that change what a batch conversion writes */
+static void buildopts(const struct convopts *o, char *buf, size_t len) { 
+  snprintf(buf, len, "H=%d p=%d F=%d r=%dx%d f=%d rle=%d north=%d terrain=%d sun=%.17g,%.17g window=%d,%.17g,%.17g,%.17g,%.17g",
+		   o->equalize, o->pyramid_levels, o->filter, o->resample_cols, o->resample_rows, o->formats,
+		   o->rle, o->north_up, o->terrain, o->sun_azimuth, o->sun_altitude, o->window,
+		   o->window_box[0], o->window_box[1], o->window_box[2], o->window_box[3]);
+}
+
+/* Load a build record.  A missing file is an empty record, lines that
+   don't parse are dropped (those pairs are just converted again).
+*/
+int loadbuild(const char *path, struct buildrecord *r, char *err, size_t errlen) { 
+  FILE *fp;
+  char line[16384], *field[kREBUILD_FIELDS], *p;
+  struct buildentry e;
+  int n;
+
+  memset(r, 0, sizeof(*r));
+  if ((fp = fopen(path, "r")) == NULL) { 
+	if ( errno == ENOENT ) { 
+	  return(0);
+	}
+	snprintf(err, errlen, "%s: %s.", path, strerror(errno));
+	return(-1);
+  }
+  if ( fgets(line, sizeof(line), fp) == NULL || strncmp(line, kREBUILD_MAGIC, strlen(kREBUILD_MAGIC)) != 0 ||
+	   fgets(line, sizeof(line), fp) == NULL || strncmp(line, "# options ", 10) != 0 ) { 
+	fclose(fp);
+	return(0);
+  }
+  line[strcspn(line, "\n")] = '\0';
+  if ((r->opts = strdup(line + 10)) == NULL) { 
+	snprintf(err, errlen, "Out of memory.");
+	fclose(fp);
+	return(-1);
+  }
+  while ( fgets(line, sizeof(line), fp) != NULL ) { 
+	line[strcspn(line, "\n")] = '\0';
+	for(n=0, p=line; n < kREBUILD_FIELDS; n++) { 
+	  field[n] = p;
+	  if ((p = strchr(p, '\t')) == NULL) { 
+		n++;
+		break;
+	  }
+	  *p++ = '\0';
+	}
+	if ( n != kREBUILD_FIELDS ) { 
+	  continue;
+	}
+	e.dem_name = field[0];
+	e.tga_name = field[1];
+	e.size = strtoll(field[2], NULL, 10);
+	e.mtime = strtoll(field[3], NULL, 10);
+	e.hash = strtoull(field[4], NULL, 16);
+	e.min_elev = strtod(field[5], NULL);
+	e.max_elev = strtod(field[6], NULL);
+	e.used_min = strtod(field[7], NULL);
+	e.used_scale = strtod(field[8], NULL);
+	e.tga_size = strtoll(field[9], NULL, 10);
+	e.tga_mtime = strtoll(field[10], NULL, 10);
+	if ( addbuild(r, &e) != 0 ) { 
+	  snprintf(err, errlen, "Out of memory.");
+	  fclose(fp);
+	  return(-1);
+	}
+  }
+  fclose(fp);
+  qsort(r->e, r->n, sizeof(struct buildentry), cmpbuildentry);
+  return(0);
+}
+
+int savebuild(const char *path, const struct buildrecord *r, char *err, size_t errlen) { 
+  char *tmp_name;
+  FILE *fp;
+  int i, status;
+
+  if ((tmp_name = malloc(strlen(path) + 16)) == NULL) { 
+	snprintf(err, errlen, "Out of memory.");
+	return(-1);
+  }
+  sprintf(tmp_name, "%s.%d", path, (int)getpid());
+  if ((fp = fopen(tmp_name, "w")) == NULL) { 
+	snprintf(err, errlen, "%s: %s.", tmp_name, strerror(errno));
+	free(tmp_name);
+	return(-1);
+  }
+  fprintf(fp, "%s\n# options %s\n", kREBUILD_MAGIC, r->opts);
+  for(i=0; i < r->n; i++) { 
+	const struct buildentry *e = &r->e[i];
+	if ( strpbrk(e->dem_name, "\t\n") != NULL || strpbrk(e->tga_name, "\t\n") != NULL ) { 
+	  continue;
+	}
+	fprintf(fp, "%s\t%s\t%lld\t%lld\t%016llx\t%.17g\t%.17g\t%.17g\t%.17g\t%lld\t%lld\n",
+			e->dem_name, e->tga_name, e->size, e->mtime, (unsigned long long)e->hash,
+			e->min_elev, e->max_elev, e->used_min, e->used_scale, e->tga_size, e->tga_mtime);
+  }
+  status = 0;
+  if ( ferror(fp) ) { 
+	snprintf(err, errlen, "%s: write: %s.", tmp_name, strerror(errno));
+	status = -1;
+  }
+  if ( fclose(fp) != 0 && status == 0 ) { 
+	snprintf(err, errlen, "%s: close: %s.", tmp_name, strerror(errno));
+	status = -1;
+  }
+  if ( status == 0 && rename(tmp_name, path) != 0 ) { 
+	snprintf(err, errlen, "%s: rename: %s.", path, strerror(errno));
+	status = -1;
+  }
+  if ( status != 0 ) { 
+	unlink(tmp_name);
+  }
+  free(tmp_name);
+  return(status);
+}
+
+/* Convert every job with nthreads workers, all sharing one scale: the
+   one given with -m/-s, or else the one -e would compute over all the
+   inputs.  Prints one line per job to stdout and returns the number of
+   jobs that failed.
+*/
+int runbatch(struct batchjob *jobs, int njobs, const struct convopts *opts, int nthreads, const char *build_name) { 
+  struct convopts o;
+  struct batchqueue q;
+  struct buildrecord rec, out;
+  const struct buildentry *be;
+  struct demheader h;
+  struct stat st;
+  pthread_t *tids;
+  char err[256], build_opts[512];
+  double global_min_elev, global_max_elev;
+  int i, k, n, started, failed, current, first_min_elev;
+
+  o = *opts;
+  o.nthreads = 1;
+  o.dump_header = 0;
+  o.output_location = 0;
+
+  // a record made with other options is no use
+  memset(&rec, 0, sizeof(rec));
+  if ( build_name != NULL ) { 
+	if ( loadbuild(build_name, &rec, err, sizeof(err)) != 0 ) { 
+	  fprintf(stderr, "%s  Exiting.\n", err);
+	  exit(1);
+	}
+	buildopts(&o, build_opts, sizeof(build_opts));
+	if ( rec.opts != NULL && strcmp(rec.opts, build_opts) != 0 ) { 
+	  if ( o.verbose == 1 ) { fprintf(stderr, "Options changed since the last build, converting everything\n"); }
+	  freebuild(&rec);
+	}
+  }
+
+  // anything we can't read a sane header from fails up front, and
+  // doesn't take part in the shared scale.  DEMs the build record
+  // says are unchanged aren't opened at all.
+  q.order = malloc(njobs * sizeof(struct batchjob *));
+  tids = malloc(nthreads * sizeof(pthread_t));
+  if ( q.order == NULL || tids == NULL ) { 
+	fprintf(stderr, "Out of memory.  Exiting.\n");
+	exit(1);
+  }
+  global_min_elev = 0.0;
+  global_max_elev = 0.0;
+  first_min_elev = 0;
+  n = 0;
+  for(i=0; i < njobs; i++) { 
+	jobs[i].status = 1;
+	if ( stat(jobs[i].dem_name, &st) == 0 ) { 
+	  jobs[i].size = st.st_size;
+	  jobs[i].mtime = mtimens(&st);
+	}
+	if ((be = findbuild(&rec, jobs[i].tga_name)) != NULL &&
+		(strcmp(be->dem_name, jobs[i].dem_name) != 0 || be->size != jobs[i].size ||
+		 (be->mtime != jobs[i].mtime && (jobs[i].hash = hashfile(jobs[i].dem_name)) != be->hash)) ) { 
+	  be = NULL;
+	}
+	if ( o.verbose == 1 ) { fprintf(stderr,"DEM File %s: ",jobs[i].dem_name); }
+	if ( be != NULL ) { 
+	  jobs[i].unchanged = 1;
+	  jobs[i].hash = be->hash;
+	  h.min_elev = be->min_elev;
+	  h.max_elev = be->max_elev;
+	} else if ( readheader(jobs[i].dem_name, &h, jobs[i].err, sizeof(jobs[i].err)) != 0 ) { 
+	  if ( o.verbose == 1 ) { fprintf(stderr,"%s\n",jobs[i].err); }
+	  jobs[i].status = -1;
+	  continue;
+	}
+	jobs[i].min_elev = h.min_elev;
+	jobs[i].max_elev = h.max_elev;
+	if ( foldrange(&h, o.verbose, &first_min_elev, &global_min_elev, &global_max_elev,
+				   jobs[i].err, sizeof(jobs[i].err)) != 0 ) { 
+	  jobs[i].status = -1;
+	  continue;
+	}
+	q.order[n++] = &jobs[i];
+  }
+
+  if ( o.min_elev_provided == 0 && n > 0 ) { 
+	rangescale(global_min_elev, global_max_elev, o.verbose, &o.provided_elev, &o.scale);
+	o.min_elev_provided = 1;
+	o.scale_provided = 1;
+	if ( o.verbose == 1 ) { 
+	  fprintf(stderr, "Batch min elev %g, scaling factor %g\n", o.provided_elev, o.scale);
+	}
+  }
+
+  // skip the ones whose TGA is as the last build left it, from an
+  // unchanged DEM at the same scale
+  current = 0;
+  if ( build_name != NULL ) { 
+	for(i=0, k=0; i < n; i++) { 
+	  struct batchjob *job = q.order[i];
+	  be = findbuild(&rec, job->tga_name);
+	  if ( job->unchanged && (o.equalize == 1 || (be->used_min == o.provided_elev && be->used_scale == o.scale)) &&
+		   stat(job->tga_name, &st) == 0 && st.st_size == be->tga_size && mtimens(&st) == be->tga_mtime ) { 
+		job->current = 1;
+		job->status = 0;
+		current++;
+	  } else { 
+		q.order[k++] = job;
+	  }
+	}
+	n = k;
+	if ( o.verbose == 1 ) { fprintf(stderr, "%d of %d files current\n", current, njobs); }
+  }
+
+  qsort(q.order, n, sizeof(struct batchjob *), cmpjobsize);
+  q.njobs = n;
+  q.next = 0;
+  q.opts = &o;
+  q.hash = build_name != NULL;
+  pthread_mutex_init(&q.lock, NULL);
+  for(started=0; started < nthreads && started < n; started++) { 
+	if ( pthread_create(&tids[started], NULL, batchworker, &q) != 0 ) { 
+	  break;
+	}
+  }
+  if ( started == 0 ) { 
+	batchworker(&q);
+  }
+  for(i=0; i < started; i++) { 
+	pthread_join(tids[i], NULL);
+  }
+  pthread_mutex_destroy(&q.lock);
+
+  failed = 0;
+  for(i=0; i < njobs; i++) { 
+	if ( jobs[i].current == 1 ) { 
+	  fprintf(stdout, "current\t%s\t%s\n", jobs[i].dem_name, jobs[i].tga_name);
+	} else if ( jobs[i].status == 0 ) { 
+	  fprintf(stdout, "ok\t%s\t%s\n", jobs[i].dem_name, jobs[i].tga_name);
+	} else { 
+	  fprintf(stdout, "failed\t%s\t%s\t%s\n", jobs[i].dem_name, jobs[i].tga_name, jobs[i].err);
+	  failed++;
+	}
+  }
+  if ( o.verbose == 1 ) { 
+	fprintf(stderr, "%d of %d files converted\n", njobs - failed - current, njobs);
+  }
+
+  // record what's current now; failures are left out so they're tried again
+  if ( build_name != NULL ) { 
+	memset(&out, 0, sizeof(out));
+	if ((out.opts = strdup(build_opts)) == NULL) { 
+	  fprintf(stderr, "Out of memory.  Exiting.\n");
+	  exit(1);
+	}
+	for(i=0; i < njobs; i++) { 
+	  struct buildentry e;
+	  if ( jobs[i].status != 0 || stat(jobs[i].tga_name, &st) != 0 ) { 
+		continue;
+	  }
+	  e.dem_name = (char *)jobs[i].dem_name;
+	  e.tga_name = (char *)jobs[i].tga_name;
+	  e.size = jobs[i].size;
+	  e.mtime = jobs[i].mtime;
+	  e.hash = jobs[i].hash;
+	  e.min_elev = jobs[i].min_elev;
+	  e.max_elev = jobs[i].max_elev;
+	  e.used_min = o.provided_elev;
+	  e.used_scale = o.scale;
+	  e.tga_size = st.st_size;
+	  e.tga_mtime = mtimens(&st);
+	  if ( addbuild(&out, &e) != 0 ) { 
+		fprintf(stderr, "Out of memory.  Exiting.\n");
+		exit(1);
+	  }
+	}
+	if ( savebuild(build_name, &out, err, sizeof(err)) != 0 ) { 
+	  fprintf(stderr, "%s\n", err);
+	  failed++;
+	}
+	freebuild(&out);
+	freebuild(&rec);
+  }
+  free(tids);
+  free(q.order);
+  return(failed);
+}
+
+/* bench.c builds this file in with DEM2TGA_NO_MAIN defined */
+#ifndef DEM2TGA_NO_MAIN
+
+#define kOPT_STATS 256
+#define kOPT_STATS_OUT 257
+#define kOPT_WINDOW 258
+#define kOPT_HILLSHADE 259
+#define kOPT_SLOPE 260
+#define kOPT_ASPECT 261
+#define kOPT_RLE 262
+#define kOPT_NORTH_UP 263
+#define kOPT_SERVE 264
+#define kOPT_CACHE_MB 265
+#define kOPT_REBUILD 266
+#define kOPT_PERCENTILE 267
+
+static struct option long_options[] = { 
+  { "stats", required_argument, NULL, kOPT_STATS },
+  { "stats-out", required_argument, NULL, kOPT_STATS_OUT },
+  { "window", required_argument, NULL, kOPT_WINDOW },
+  { "hillshade", optional_argument, NULL, kOPT_HILLSHADE },
+  { "slope", no_argument, NULL, kOPT_SLOPE },
+  { "aspect", no_argument, NULL, kOPT_ASPECT },
+  { "rle", no_argument, NULL, kOPT_RLE },
+  { "north-up", no_argument, NULL, kOPT_NORTH_UP },
+  { "serve", required_argument, NULL, kOPT_SERVE },
+  { "cache-mb", required_argument, NULL, kOPT_CACHE_MB },
+  { "rebuild", required_argument, NULL, kOPT_REBUILD },
+  { "percentile", optional_argument, NULL, kOPT_PERCENTILE },
+  { NULL, 0, NULL, 0 }
+};
+
+/* Parse --window=west,south,east,north into arc-seconds.  Each value
+   is decimal degrees, or arc-seconds with an s after it.
+*/
+static int parsewindow(const char *arg, double *box) { 
+  const char *p = arg;
+  char *end;
+  int i;
+  for(i=0; i < 4; i++) { 
+	box[i] = strtod(p, &end);
+	if ( end == p ) { 
+	  return(-1);
+	}
+	if ( *end == 's' ) { 
+	  end++;
+	} else { 
+	  box[i] *= 3600.0;
+	}
+	if ( *end != (i < 3 ? ',' : '\0') ) { 
+	  return(-1);
+	}
+	p = end + 1;
+  }
+  return(box[0] < box[2] && box[1] < box[3] ? 0 : -1);
+}
+
+/* The -F names */
+static int parsefilter(const char *arg) { 
+  if ( strcmp(arg, "box") == 0 ) { 
+	return(kFILTER_BOX);
+  } else if ( strcmp(arg, "min") == 0 ) { 
+	return(kFILTER_MIN);
+  } else if ( strcmp(arg, "max") == 0 ) { 
+	return(kFILTER_MAX);
+  } else if ( strcmp(arg, "bilinear") == 0 ) { 
+	return(kFILTER_BILINEAR);
+  }
+  return(-1);
+}
+
+/* Options that don't go together, for the command line and --serve
+   requests alike.  Returns 0, or -1 with a message in err.
+*/
+static int checkopts(const struct convopts *o, int batch, int mosaic, char *err, size_t errlen) { 
+  if ( ((o->scale_provided == 1) ^ (o->min_elev_provided == 1)) ) { 
+	snprintf(err, errlen, "need both scale and min_elev.");
+  } else if ( o->data_scale == 1 && (o->scale_provided == 1 || batch == 1 || mosaic == 1) ) { 
+	snprintf(err, errlen, "-a can't be combined with -m/-s, batch or mosaic mode.");
+  } else if ( o->window == 1 && mosaic == 1 ) { 
+	snprintf(err, errlen, "--window can't be combined with mosaic mode.");
+  } else if ( o->terrain != 0 && mosaic == 1 ) { 
+	snprintf(err, errlen, "--hillshade, --slope and --aspect can't be combined with mosaic mode.");
+  } else if ( o->north_up == 1 && (o->resample_cols > 0 || o->pyramid_levels > 1 || o->terrain != 0 ||
+								   o->rle == 1 || mosaic == 1) ) { 
+	snprintf(err, errlen, "--north-up can't be combined with -r, -p, --hillshade, --slope, --aspect, --rle or mosaic mode.");
+  } else if ( o->resample_cols > 0 && (o->pyramid_levels > 1 || mosaic == 1) ) { 
+	snprintf(err, errlen, "-r can't be combined with -p or mosaic mode.");
+  } else if ( (o->filter == kFILTER_BILINEAR && o->resample_cols == 0) ||
+			  (o->resample_cols > 0 && o->filter != kFILTER_BOX && o->filter != kFILTER_BILINEAR) ) { 
+	snprintf(err, errlen, "-r takes -F box or bilinear, and only -r takes bilinear.");
+  } else if ( o->equalize == 1 && (o->scale_provided == 1 || o->data_scale == 1 || mosaic == 1) ) { 
+	snprintf(err, errlen, "-H can't be combined with -a, -m/-s or mosaic mode.");
+  } else { 
+	return(0);
+  }
+  return(-1);
+}
+
+/* Server mode for --serve.
+
+   dem2tga stays up listening on a Unix domain socket, so a caller
+   converting the same DEMs over and over with different scales and
+   windows doesn't pay for parsing them each time.  Each line a client
+   sends is one conversion, written just as it would be on the command
+   line but with only these options:
+
+	 dem_file tga_file [-m n -s n | -a | -H] [--window=w,s,e,n] [-r WxH]
+					   [-p n] [-F f] [--rle] [--north-up]
+					   [--hillshade[=az,alt]] [--slope] [--aspect]
+
+   separated by spaces (so no spaces in file names), with relative
+   paths taken from the server's directory.  The server answers each
+   with a line of "ok" or "error " and the message.  Anything the
+   server was started with (-j, -v, --stats) applies to every request.
+
+   Decoded grids and their Type A records are kept in an LRU cache of
+   at most cache_bytes, keyed by path and checked against the file's
+   size and modification time on every use.  Clients are served on a
+   thread each, so the entries in use are counted and only idle ones
+   are evicted; the cache can go over its limit while more than that
+   is in use at once.
+*/
+#define kSERVE_CACHE_MB 256
+#define kSERVE_LINE 4096
+#define kSERVE_ARGS 32
+
+struct gridentry { 
+  char *path;
+  off_t size;
+  long long mtime;        // nanoseconds
+  struct demheader h;
+  struct demgrid grid;
+  size_t bytes;
+  int refs;
+  int stale;              // out of the list, freed when refs gets to 0
+  struct gridentry *prev, *next;
+};
+
+struct gridcache { 
+  struct gridentry *head, *tail;  // most recently used first
+  size_t bytes, limit;
+  long hits, misses;
+  pthread_mutex_t lock;
+};
+
+struct serveclient { 
+  int fd;
+  struct gridcache *cache;
+  const struct convopts *opts;
+};
+
+static volatile sig_atomic_t serve_stop;
+
+static void stopserving(int sig) { 
+  serve_stop = 1;
+}
+
+static void freegrid(struct gridentry *e) { 
+  free(e->grid.elev);
+  free(e->path);
+  free(e);
+}
+
+static void unlinkgrid(struct gridcache *c, struct gridentry *e) { 
+  if ( e->prev != NULL ) { e->prev->next = e->next; } else { c->head = e->next; }
+  if ( e->next != NULL ) { e->next->prev = e->prev; } else { c->tail = e->prev; }
+  e->prev = e->next = NULL;
+  c->bytes -= e->bytes;
+}
+
+static void pushgrid(struct gridcache *c, struct gridentry *e) { 
+  e->prev = NULL;
+  e->next = c->head;
+  if ( c->head != NULL ) { c->head->prev = e; } else { c->tail = e; }
+  c->head = e;
+  c->bytes += e->bytes;
+}
+
+/* Drop idle entries, least recently used first, until the cache fits.
+   Called with the lock held.
+*/
+static void trimgrids(struct gridcache *c) { 
+  struct gridentry *e, *prev;
+  for(e = c->tail; e != NULL && c->bytes > c->limit; e = prev) { 
+	prev = e->prev;
+	if ( e->refs == 0 ) { 
+	  unlinkgrid(c, e);
+	  freegrid(e);
+	}
+  }
+}
+
+/* Decode path into a new entry */
+static struct gridentry *decodeentry(const char *path, const struct stat *st, int nthreads, char *err, size_t errlen) { 
+  struct gridentry *e;
+  struct demmap dem;
+  int profile_elevs;
+
+  if ((e = calloc(1, sizeof(*e))) == NULL || (e->path = strdup(path)) == NULL) { 
+	snprintf(err, errlen, "Out of memory.");
+	free(e);
+	return(NULL);
+  }
+  e->size = st->st_size;
+  e->mtime = mtimens(st);
+  if ( mapdem(&dem, path) != 0 ) { 
+	snprintf(err, errlen, "%s: %s.", path, strerror(errno));
+	freegrid(e);
+	return(NULL);
+  }
+  if ( dem.size < kTYPE_A_SIZE + 24 ) { 
+	snprintf(err, errlen, "%s: truncated DEM file.", path);
+	unmapdem(&dem);
+	freegrid(e);
+	return(NULL);
+  }
+  parsetypea(dem.data, &e->h);
+  profile_elevs = getnextint(&dem.data[kTYPE_A_SIZE + 12]);
+  if ( checkheader(&e->h, err, errlen) != 0 ) { 
+	unmapdem(&dem);
+	freegrid(e);
+	return(NULL);
+  }
+  if ( indexdem(&dem, e->h.profile_num) != 0 ) { 
+	snprintf(err, errlen, "Out of memory.");
+	unmapdem(&dem);
+	freegrid(e);
+	return(NULL);
+  }
+  if ( decodegrid(&dem, e->h.profile_num, e->h.profile_dim, profile_elevs, nthreads, &e->grid, NULL, err, errlen) != 0 ) { 
+	unmapdem(&dem);
+	freegrid(e);
+	return(NULL);
+  }
+  unmapdem(&dem);
+  e->bytes = sizeof(*e) + (size_t)e->grid.rows * e->grid.cols * sizeof(int16_t);
+  return(e);
+}
+
+/* Take e, changed on disk, out of the cache; it is freed once nobody
+   is using it
+*/
+static void forgetgrid(struct gridcache *c, struct gridentry *e) { 
+  unlinkgrid(c, e);
+  e->stale = 1;
+  if ( e->refs == 0 ) { 
+	freegrid(e);
+  }
+}
+
+/* The decoded grid of path, from the cache or decoded and added to it.
+   The caller holds a reference until it calls releasegrid().  Returns
+   NULL with a message in err on failure.
+*/
+static struct gridentry *usegrid(struct gridcache *c, const char *path, int nthreads, char *err, size_t errlen) { 
+  struct gridentry *e, *n;
+  struct stat st;
+
+  if ( stat(path, &st) != 0 ) { 
+	snprintf(err, errlen, "%s: %s.", path, strerror(errno));
+	return(NULL);
+  }
+  pthread_mutex_lock(&c->lock);
+  for(e = c->head; e != NULL && strcmp(e->path, path) != 0; e = e->next) { 
+	;
+  }
+  if ( e != NULL && (e->size != st.st_size || e->mtime != mtimens(&st)) ) { 
+	forgetgrid(c, e);
+	e = NULL;
+  }
+  if ( e != NULL ) { 
+	unlinkgrid(c, e);
+	pushgrid(c, e);
+	e->refs++;
+	c->hits++;
+	pthread_mutex_unlock(&c->lock);
+	return(e);
+  }
+  c->misses++;
+  pthread_mutex_unlock(&c->lock);
+
+  // decode outside the lock; if another client beat us to it, use theirs
+  if ((n = decodeentry(path, &st, nthreads, err, errlen)) == NULL) { 
+	return(NULL);
+  }
+  pthread_mutex_lock(&c->lock);
+  for(e = c->head; e != NULL && strcmp(e->path, path) != 0; e = e->next) { 
+	;
+  }
+  if ( e != NULL && e->size == n->size && e->mtime == n->mtime ) { 
+	freegrid(n);
+	n = e;
+	unlinkgrid(c, n);
+  } else if ( e != NULL ) { 
+	// theirs is of another version of the file, keep only ours
+	forgetgrid(c, e);
+  }
+  pushgrid(c, n);
+  n->refs++;
+  trimgrids(c);
+  pthread_mutex_unlock(&c->lock);
+  return(n);
+}
+
+static void releasegrid(struct gridcache *c, struct gridentry *e) { 
+  pthread_mutex_lock(&c->lock);
+  e->refs--;
+  if ( e->stale && e->refs == 0 ) { 
+	freegrid(e);
+  } else { 
+	trimgrids(c);
+  }
+  pthread_mutex_unlock(&c->lock);
+}
+
+/* Split a request line into o, dem_name and tga_name.  Returns 0, or
+   -1 with a message in err.
+*/
+static int parserequest(char *line, struct convopts *o, char **dem_name, char **tga_name, char *err, size_t errlen) { 
+  char *args[kSERVE_ARGS], *a, *v, junk;
+  int n, i, nfiles;
+
+  for(n = 0, a = strtok(line, " \t\r\n"); a != NULL; a = strtok(NULL, " \t\r\n")) { 
+	if ( n == kSERVE_ARGS ) { 
+	  snprintf(err, errlen, "too many arguments.");
+	  return(-1);
+	}
+	args[n++] = a;
+  }
+  nfiles = 0;
+  for(i=0; i < n; i++) { 
+	a = args[i];
+	if ( a[0] != '-' ) { 
+	  if ( nfiles == 2 ) { 
+		snprintf(err, errlen, "expected one dem_file and one tga_file.");
+		return(-1);
+	  }
+	  if ( nfiles++ == 0 ) { *dem_name = a; } else { *tga_name = a; }
+	  continue;
+	}
+	// the options that take a value
+	v = NULL;
+	if ( strcmp(a, "-m") == 0 || strcmp(a, "-s") == 0 || strcmp(a, "-r") == 0 ||
+		 strcmp(a, "-p") == 0 || strcmp(a, "-F") == 0 ) { 
+	  if ( i + 1 == n ) { 
+		snprintf(err, errlen, "%s needs a value.", a);
+		return(-1);
+	  }
+	  v = args[++i];
+	}
+	if ( strcmp(a, "-m") == 0 ) { 
+	  o->provided_elev = atof(v);
+	  o->min_elev_provided = 1;
+	} else if ( strcmp(a, "-s") == 0 ) { 
+	  if ((o->scale = atof(v)) <= 0.0) { 
+		snprintf(err, errlen, "scale less than or equal to zero. \"%s\"", v);
+		return(-1);
+	  }
+	  o->scale_provided = 1;
+	} else if ( strcmp(a, "-r") == 0 ) { 
+	  if ( sscanf(v, "%dx%d%c", &o->resample_cols, &o->resample_rows, &junk) != 2 ||
+		   o->resample_cols < 1 || o->resample_rows < 1 ||
+		   o->resample_cols > kTGA_MAX_DIM || o->resample_rows > kTGA_MAX_DIM ) { 
+		snprintf(err, errlen, "size must be WxH, 1 to %d each. \"%s\"", kTGA_MAX_DIM, v);
+		return(-1);
+	  }
+	} else if ( strcmp(a, "-p") == 0 ) { 
+	  if ((o->pyramid_levels = atoi(v)) < 1 || o->pyramid_levels > 16) { 
+		snprintf(err, errlen, "pyramid levels must be 1 to 16. \"%s\"", v);
+		return(-1);
+	  }
+	} else if ( strcmp(a, "-F") == 0 ) { 
+	  if ((o->filter = parsefilter(v)) < 0) { 
+		snprintf(err, errlen, "unknown filter \"%s\"", v);
+		return(-1);
+	  }
+	} else if ( strcmp(a, "-a") == 0 ) { 
+	  o->data_scale = 1;
+	} else if ( strcmp(a, "-H") == 0 ) { 
+	  o->equalize = 1;
+	} else if ( strncmp(a, "--window=", 9) == 0 ) { 
+	  if ( parsewindow(a + 9, o->window_box) != 0 ) { 
+		snprintf(err, errlen, "window must be west,south,east,north. \"%s\"", a + 9);
+		return(-1);
+	  }
+	  o->window = 1;
+	} else if ( strcmp(a, "--rle") == 0 ) { 
+	  o->rle = 1;
+	} else if ( strcmp(a, "--north-up") == 0 ) { 
+	  o->north_up = 1;
+	} else if ( strcmp(a, "--hillshade") == 0 || strncmp(a, "--hillshade=", 12) == 0 ) { 
+	  if ( a[11] == '=' && (sscanf(a + 12, "%lf,%lf%c", &o->sun_azimuth, &o->sun_altitude, &junk) != 2 ||
+							o->sun_altitude <= 0.0 || o->sun_altitude > 90.0) ) { 
+		snprintf(err, errlen, "sun must be azimuth,altitude in degrees. \"%s\"", a + 12);
+		return(-1);
+	  }
+	  o->terrain |= kTERRAIN_HILLSHADE;
+	} else if ( strcmp(a, "--slope") == 0 ) { 
+	  o->terrain |= kTERRAIN_SLOPE;
+	} else if ( strcmp(a, "--aspect") == 0 ) { 
+	  o->terrain |= kTERRAIN_ASPECT;
+	} else { 
+	  snprintf(err, errlen, "unknown or unsupported option \"%s\"", a);
+	  return(-1);
+	}
+  }
+  if ( nfiles != 2 ) { 
+	snprintf(err, errlen, "expected one dem_file and one tga_file.");
+	return(-1);
+  }
+  return(checkopts(o, 0, 0, err, errlen));
+}
+
+static void *serveworker(void *arg) { 
+  struct serveclient *sc = arg;
+  struct gridentry *e;
+  struct convopts o;
+  char line[kSERVE_LINE], err[256], *dem_name, *tga_name;
+  FILE *in;
+  int status;
+
+  if ((in = fdopen(sc->fd, "r")) == NULL) { 
+	close(sc->fd);
+	free(sc);
+	return(NULL);
+  }
+  while ( fgets(line, sizeof(line), in) != NULL ) { 
+	if ( strchr(line, '\n') == NULL && !feof(in) ) { 
+	  int ch;
+	  while ((ch = fgetc(in)) != EOF && ch != '\n') { ; }
+	  dprintf(sc->fd, "error request longer than %d bytes.\n", kSERVE_LINE - 1);
+	  continue;
+	}
+	// -v logs the requests rather than every conversion's details
+	o = *sc->opts;
+	o.verbose = 0;
+	dem_name = tga_name = NULL;
+	status = parserequest(line, &o, &dem_name, &tga_name, err, sizeof(err));
+	if ( status == 0 && (e = usegrid(sc->cache, dem_name, o.nthreads, err, sizeof(err))) == NULL ) { 
+	  status = -1;
+	} else if ( status == 0 ) { 
+	  o.grid_h = &e->h;
+	  o.grid = &e->grid;
+	  status = convertdem(dem_name, tga_name, &o, err, sizeof(err));
+	  releasegrid(sc->cache, e);
+	}
+	if ( sc->opts->verbose == 1 ) { 
+	  pthread_mutex_lock(&sc->cache->lock);
+	  if ( status == 0 ) { 
+		fprintf(stderr,"%s -> %s", dem_name, tga_name);
+	  } else { 
+		fprintf(stderr,"Error: %s", err);
+	  }
+	  fprintf(stderr," (cache %zu bytes, %ld hits, %ld misses)\n", sc->cache->bytes, sc->cache->hits, sc->cache->misses);
+	  pthread_mutex_unlock(&sc->cache->lock);
+	}
+	if ( status == 0 ) { 
+	  dprintf(sc->fd, "ok\n");
+	} else { 
+	  dprintf(sc->fd, "error %s\n", err);
+	}
+  }
+  fclose(in);
+  free(sc);
+  return(NULL);
+}
+
+/* Serve conversions on the Unix domain socket sock_path until SIGINT
+   or SIGTERM, caching up to cache_bytes of decoded grids.  Returns 0,
+   or -1 with a message in err.
+*/
+int servedem(const char *sock_path, const struct convopts *opts, size_t cache_bytes, char *err, size_t errlen) { 
+  struct gridcache cache;
+  struct gridentry *e, *next;
+  struct serveclient *sc;
+  struct sockaddr_un addr;
+  struct sigaction sa;
+  sigset_t stop, mask;
+  struct stat st;
+  pthread_attr_t attr;
+  pthread_t tid;
+  int fd, cfd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if ( strlen(sock_path) >= sizeof(addr.sun_path) ) { 
+	snprintf(err, errlen, "%s: socket path too long.", sock_path);
+	return(-1);
+  }
+  strcpy(addr.sun_path, sock_path);
+  // a socket left behind by an earlier server is fair game, anything else isn't
+  if ( lstat(sock_path, &st) == 0 && S_ISSOCK(st.st_mode) ) { 
+	unlink(sock_path);
+  }
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	  bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0 ) { 
+	snprintf(err, errlen, "%s: %s.", sock_path, strerror(errno));
+	if ( fd >= 0 ) { close(fd); }
+	return(-1);
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stopserving;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  // only this thread takes the signals, so they interrupt accept()
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  sigaddset(&stop, SIGTERM);
+
+  memset(&cache, 0, sizeof(cache));
+  cache.limit = cache_bytes;
+  pthread_mutex_init(&cache.lock, NULL);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if ( opts->verbose == 1 ) { 
+	fprintf(stderr,"Serving on %s with a %zu byte cache\n",sock_path,cache_bytes);
+  }
+  while ( !serve_stop ) { 
+	if ((cfd = accept(fd, NULL, NULL)) < 0) { 
+	  if ( errno == EINTR || errno == ECONNABORTED ) { 
+		continue;
+	  }
+	  snprintf(err, errlen, "%s: accept: %s.", sock_path, strerror(errno));
+	  break;
+	}
+	if ((sc = malloc(sizeof(*sc))) == NULL) { 
+	  close(cfd);
+	  continue;
+	}
+	sc->fd = cfd;
+	sc->cache = &cache;
+	sc->opts = opts;
+	pthread_sigmask(SIG_BLOCK, &stop, &mask);
+	if ( pthread_create(&tid, &attr, serveworker, sc) != 0 ) { 
+	  dprintf(cfd, "error can't start a thread for this client.\n");
+	  close(cfd);
+	  free(sc);
+	}
+	pthread_sigmask(SIG_SETMASK, &mask, NULL);
+  }
+  close(fd);
+  unlink(sock_path);
+  if ( !serve_stop ) { 
+	return(-1);
   }
-  buf[kDOUBLE_LENGTH] = '\0';
-  return(atof(buf));
-}
-
-float getnextfloat(char *s) { 
-  char buf[kFLOAT_LENGTH+1];
-  int i;
-  for(i=0;i<kFLOAT_LENGTH;i++) { 
-	buf[i] = s[i]; 
-	if( buf[i] == 'D' ) { 
-	  buf[i] = 'E';
+  // clients still connected when we stop go down with the process, so
+  // the cache is only freed when it's idle
+  pthread_mutex_lock(&cache.lock);
+  for(e = cache.head; e != NULL; e = next) { 
+	next = e->next;
+	if ( e->refs == 0 ) { 
+	  unlinkgrid(&cache, e);
+	  freegrid(e);
 	}
   }
-  buf[kFLOAT_LENGTH+1] = '\0';
-  return((float)atof(buf));
+  pthread_mutex_unlock(&cache.lock);
+  return(0);
 }
 
 int main(int argc, char **argv) {
-  FILE *demfile;
-  FILE *tgafile;
-  char name[145], type_a_record[1025], type_b_record[8193];
-  int dem_level_code, pattern_code, plan_ref_sys_code, zone_code, accuracy_code;  
-  int ground_units_code, elev_units_code,poly_sides, profile_dim, profile_num;
-  int profile_elevs, tga_dim_x, tga_dim_y, current_profile, this_profile_dim, elev;
-  int this_profile_id, this_profile_elevs, this_profile_columns, i, offset;
-  float x_res, y_res, z_res;
-  double map_proj_param[15], poly_verts[8], width, height, this_profile_long, this_profile_lat;
-  double min_elev, max_elev, elev_range, scaling_factor, angle_from_axis, this_profile_local_elev;
-  double this_profile_min_elev, this_profile_max_elev;
-
-  int verbose, ch, dump_header, scale_provided, min_elev_provided, output_location;
-  double scale, elev_extract, provided_elev;
-  double global_min_elev, global_max_elev;
-  int first_min_elev = 0;
-  global_min_elev = 0.0;
-  global_max_elev = 0.0;
-  output_location = 0;
+  char errmsg[256], *catalog_name, *stats_name, *serve_path, *build_name, junk;
+  size_t cache_mb;
+  int i, ch, elev_extract, batch, mosaic, nthreads, nthreads_given, percentile;
+  struct demheader *hs;
+  struct convopts opts;
+  struct batchjob *jobs;
+  int njobs, jobs_cap;
+  double min_elev, scaling_factor, percentile_lo, percentile_hi;
 
-  verbose = 0;
-  dump_header = 0;
-  scale_provided = 0;
-  min_elev_provided = 0;
+  memset(&opts, 0, sizeof(opts));
+  opts.nthreads = 1;
+  opts.sun_azimuth = 315.0;
+  opts.sun_altitude = 45.0;
+  nthreads = 1;
+  nthreads_given = 0;
+  catalog_name = NULL;
+  stats_name = NULL;
+  serve_path = NULL;
+  build_name = NULL;
+  cache_mb = kSERVE_CACHE_MB;
+  hs = NULL;
   elev_extract = 0;
+  percentile = 0;
+  percentile_lo = kHIST_LOW;
+  percentile_hi = kHIST_HIGH;
+  batch = 0;
+  mosaic = 0;
+  jobs = NULL;
+  njobs = 0;
+  jobs_cap = 0;
 
-  while ((ch = getopt(argc, argv, "delm:ns:v")) != -1)
+  while ((ch = getopt_long(argc, argv, "abB:cC:def:F:Hj:lm:Mnp:r:s:v", long_options, NULL)) != -1)
 	switch(ch) { 
+	case kOPT_STATS:
+	  if ( strcmp(optarg, "json") != 0 ) { 
+		fprintf(stderr,"Error : unknown stats format \"%s\"\n",optarg);
+		exit(1);
+	  }
+	  if ( opts.stats == NULL ) { opts.stats = stderr; }
+	  break;
+	case kOPT_STATS_OUT:
+	  stats_name = optarg;
+	  break;
+	case kOPT_WINDOW:
+	  if ( parsewindow(optarg, opts.window_box) != 0 ) { 
+		fprintf(stderr,"Error : window must be west,south,east,north. \"%s\"\n",optarg);
+		exit(1);
+	  }
+	  opts.window = 1;
+	  break;
+	case kOPT_HILLSHADE:
+	  if ( optarg != NULL && (sscanf(optarg, "%lf,%lf%c", &opts.sun_azimuth, &opts.sun_altitude, &junk) != 2 ||
+							  opts.sun_altitude <= 0.0 || opts.sun_altitude > 90.0) ) { 
+		fprintf(stderr,"Error : sun must be azimuth,altitude in degrees. \"%s\"\n",optarg);
+		exit(1);
+	  }
+	  opts.terrain |= kTERRAIN_HILLSHADE;
+	  break;
+	case kOPT_SLOPE:
+	  opts.terrain |= kTERRAIN_SLOPE;
+	  break;
+	case kOPT_ASPECT:
+	  opts.terrain |= kTERRAIN_ASPECT;
+	  break;
+	case kOPT_RLE:
+	  opts.rle = 1;
+	  break;
+	case kOPT_NORTH_UP:
+	  opts.north_up = 1;
+	  break;
+	case kOPT_SERVE:
+	  serve_path = optarg;
+	  break;
+	case kOPT_REBUILD:
+	  build_name = optarg;
+	  break;
+	case kOPT_PERCENTILE:
+	  if ( optarg != NULL && (sscanf(optarg, "%lf,%lf%c", &percentile_lo, &percentile_hi, &junk) != 2 ||
+							  percentile_lo < 0.0 || percentile_hi > 100.0 || percentile_lo >= percentile_hi) ) { 
+		fprintf(stderr,"Error : percentiles must be lo,hi between 0 and 100. \"%s\"\n",optarg);
+		exit(1);
+	  }
+	  percentile = 1;
+	  break;
+	case kOPT_CACHE_MB:
+	  if ( sscanf(optarg, "%zu%c", &cache_mb, &junk) != 1 ) { 
+		fprintf(stderr,"Error : cache size must be a number of megabytes. \"%s\"\n",optarg);
+		exit(1);
+	  }
+	  break;
+	case 'a':
+	  opts.data_scale = 1;
+	  if ( opts.verbose == 1 ) { fprintf(stderr,"Scaling from decoded elevations\n"); }
+	  break;
+	case 'b':
+	  batch = 1;
+	  break;
+	case 'B':
+	  batch = 1;
+	  if ( readmanifest(optarg, &jobs, &njobs, &jobs_cap, errmsg, sizeof(errmsg)) != 0 ) { 
+		fprintf(stderr,"%s  Exiting.\n",errmsg);
+		exit(1);
+	  }
+	  break;
+	case 'c':
+	  opts.write_cache = 1;
+	  if ( opts.verbose == 1 ) { fprintf(stderr,"Writing decoded grid caches\n"); }
+	  break;
+	case 'C':
+	  catalog_name = optarg;
+	  if ( opts.verbose == 1 ) { fprintf(stderr,"Using header catalog %s\n",catalog_name); }
+	  break;
 	case 'e':
 	  elev_extract=1;
-	  if ( verbose == 1 ) { fprintf(stderr,"Extracting Elevations from given files\n"); }
+	  if ( opts.verbose == 1 ) { fprintf(stderr,"Extracting Elevations from given files\n"); }
+	  break;
+	case 'f':
+	  if ( strcmp(optarg, "raw") == 0 ) { 
+		opts.formats |= kFORMAT_RAW;
+	  } else if ( strcmp(optarg, "pgm") == 0 ) { 
+		opts.formats |= kFORMAT_PGM;
+	  } else if ( strcmp(optarg, "f32") == 0 ) { 
+		opts.formats |= kFORMAT_F32;
+	  } else { 
+		fprintf(stderr,"Error : unknown output format \"%s\"\n",optarg);
+		exit(1);
+	  }
+	  break;
+	case 'F':
+	  if ((opts.filter = parsefilter(optarg)) < 0) { 
+		fprintf(stderr,"Error : unknown filter \"%s\"\n",optarg);
+		exit(1);
+	  }
+	  break;
+	case 'H':
+	  opts.equalize = 1;
+	  if ( opts.verbose == 1 ) { fprintf(stderr,"Histogram equalizing\n"); }
+	  break;
+	case 'j':
+	  if ((nthreads = atoi(optarg)) < 1) { 
+		fprintf(stderr,"Error : thread count must be at least 1. \"%s\"\n",optarg);
+		exit(1);
+	  }
+	  opts.nthreads = nthreads;
+	  nthreads_given = 1;
+	  if ( opts.verbose == 1 ) { fprintf(stderr,"Decoding with %d threads\n",nthreads); }
 	  break;
 	case 'l':
-	  output_location = 1;
-	  if ( verbose == 1 ) { fprintf(stderr,"Writing DEM Location to stdout\n"); }
+	  opts.output_location = 1;
+	  if ( opts.verbose == 1 ) { fprintf(stderr,"Writing DEM Location to stdout\n"); }
 	  break;	  
 	case 'm':
-	  if ( min_elev_provided != 0 ) { 
+	  if ( opts.min_elev_provided != 0 ) { 
 		fprintf(stderr,"Error: min elev already provided\n");
 		exit(1);
 	  }
-	  provided_elev = atof(optarg);
-	  if ( verbose == 1 ) { fprintf(stderr,"Using given min elev %.8f\n",provided_elev); }
-	  min_elev_provided = 1;
+	  opts.provided_elev = atof(optarg);
+	  if ( opts.verbose == 1 ) { fprintf(stderr,"Using given min elev %.8f\n",opts.provided_elev); }
+	  opts.min_elev_provided = 1;
+	  break;
+	case 'M':
+	  mosaic = 1;
+	  if ( opts.verbose == 1 ) { fprintf(stderr,"Building a mosaic\n"); }
 	  break;
 	case 'n':
 	case 'd':
-	  dump_header=1;
-	  if ( verbose == 1 ) { fprintf(stderr,"Writing DEM name to stdout\n"); }
+	  opts.dump_header=1;
+	  if ( opts.verbose == 1 ) { fprintf(stderr,"Writing DEM name to stdout\n"); }
+	  break;
+	case 'p':
+	  if ((opts.pyramid_levels = atoi(optarg)) < 1 || opts.pyramid_levels > 16) { 
+		fprintf(stderr,"Error : pyramid levels must be 1 to 16. \"%s\"\n",optarg);
+		exit(1);
+	  }
+	  break;
+	case 'r':
+	  if ( sscanf(optarg, "%dx%d%c", &opts.resample_cols, &opts.resample_rows, &junk) != 2 ||
+		   opts.resample_cols < 1 || opts.resample_rows < 1 ||
+		   opts.resample_cols > kTGA_MAX_DIM || opts.resample_rows > kTGA_MAX_DIM ) { 
+		fprintf(stderr,"Error : size must be WxH, 1 to %d each. \"%s\"\n",kTGA_MAX_DIM,optarg);
+		exit(1);
+	  }
 	  break;
 	case 's':
-	  if ( scale_provided != 0 ) { 
+	  if ( opts.scale_provided != 0 ) { 
 		fprintf(stderr,"Error: scale already provided\n");
 		exit(1);
 	  }
-	  if (( scale = atof(optarg)) <= 0.0 ) {
+	  if (( opts.scale = atof(optarg)) <= 0.0 ) {
 		fprintf(stderr,"Error : scale less than or equal to zero. \"%s\"\n",optarg);
 		exit(1);
 	  } else { 
-		if ( verbose == 1 ) { fprintf(stderr,"Using given scaling factor %.8f\n",scale); }
-		scale_provided = 1;
+		if ( opts.verbose == 1 ) { fprintf(stderr,"Using given scaling factor %.8f\n",opts.scale); }
+		opts.scale_provided = 1;
 	  }
 	  break;
 	case 'v':
-	  verbose=1;
-	  if ( verbose == 1 ) { fprintf(stderr,"Verbose set\n"); }
+	  opts.verbose=1;
+	  if ( opts.verbose == 1 ) { fprintf(stderr,"Verbose set\n"); }
 	  break;
 	case '?':
 	default:
@@ -171,7 +4948,17 @@ int main(int argc, char **argv) {
   argv += optind;
 
   // expect an input and an output file.
-  if ( elev_extract == 0 && dump_header != 1 ) {
+  if ( serve_path != NULL ) { 
+	// requests name their own
+	if ( argc != 0 ) { 
+	  usage();
+	}
+  } else if ( batch == 1 && elev_extract == 0 && opts.dump_header != 1 ) { 
+	// pairs of input and output files, on top of any manifest
+	if ( (argc % 2) != 0 || (argc == 0 && njobs == 0) ) { 
+	  usage();
+	}
+  } else if ( elev_extract == 0 && opts.dump_header != 1 ) {
 	if(argc < 2) {
 	  usage();
 	}
@@ -181,525 +4968,142 @@ int main(int argc, char **argv) {
 	}
   }
 
-  if ( ((scale_provided == 1) ^ (min_elev_provided == 1)) ) { 
-	fprintf(stderr,"Error:  need both scale and min_elev.  Exiting.\n");
+  if ( checkopts(&opts, batch, mosaic, errmsg, sizeof(errmsg)) != 0 ) { 
+	fprintf(stderr,"Error:  %s  Exiting.\n",errmsg);
+	exit(1);
+  }
+  if ( build_name != NULL && (batch == 0 || elev_extract == 1 || opts.dump_header == 1) ) { 
+	fprintf(stderr,"Error:  --rebuild only applies to batch conversions (-b or -B).  Exiting.\n");
+	exit(1);
+  }
+  if ( serve_path != NULL && (batch == 1 || mosaic == 1 || elev_extract == 1 || opts.dump_header == 1 ||
+							  opts.data_scale == 1 || opts.write_cache == 1) ) { 
+	fprintf(stderr,"Error:  --serve can't be combined with -a, -b, -c, -e, -n or -M.  Exiting.\n");
 	exit(1);
   }
 
-  if ( elev_extract == 1) { 
-	/* for each argv, extract elevation extremes, update global
-	   elevations, then calculate scaling factor based on elevation
-	   extremes and output scaling factor
-	*/
-	i=0;
-	while ( i < argc ) { 
-	  if ( verbose == 1 ) { fprintf(stderr,"DEM File %s: ",argv[i]); }
-	  if((demfile = fopen(argv[i], "r")) == NULL) {
-		fprintf(stderr, "Error : %s.  Exiting.\n",strerror(errno));
-		exit(1);
-	  }
-	  fread(type_a_record,sizeof(char),kTYPE_A_SIZE,demfile);
-	  fclose(demfile);
-	  type_a_record[kTYPE_A_SIZE] = '\0';
-	  min_elev = getnextdouble(&type_a_record[738]);
-	  max_elev = getnextdouble(&type_a_record[762]);
-	  elev_range = max_elev - min_elev;
-	  if ( verbose == 1 ) { 
-		fprintf(stderr, " min,max elev: %.2f to %.2f, range %.2f\n", min_elev,max_elev,elev_range);
-	  }
-	  if ( elev_range < 0.0 ) { 
-		fprintf(stderr,"Negative elevation range.  Exiting.\n");
-		exit(1);
-	  }
-	  if ( first_min_elev == 0 ) { 
-		global_min_elev = min_elev;
-		first_min_elev = 1;
-	  } else {
-		if ( min_elev < global_min_elev ) { 
-		  global_min_elev = min_elev;
-		}
-	  }
-	  if ( max_elev > global_max_elev ) { 
-		global_max_elev = max_elev;
-	  }
-	  i++;
-	}
-	elev_range = global_max_elev - global_min_elev;
-	if ( verbose == 1 ) { 
-	  fprintf(stderr, "Global min,max elev: %.2f to %.2f, range %.2f\n", global_min_elev,global_max_elev,elev_range);
-	}
-	if ( elev_range == 0.0 ) { 
-	  scaling_factor = 0.0;
-	}
-	else { 
-	  scaling_factor = 255.0 / elev_range;
-	}
-	fprintf(stdout,"%g %g\n",global_min_elev,scaling_factor);
-	exit(0);
-  } else if ( dump_header == 1 ) { 
-	// dump name
-	// dump last lat,long pair
-	i=0;
-	while ( i < argc ) { 
-	  int j=0;
-	  if((demfile = fopen(argv[i], "r")) == NULL) {
-		fprintf(stderr, "Error : %s.  Exiting.\n",strerror(errno));
-		exit(1);
-	  }
-	  fread(type_a_record,sizeof(char),kTYPE_A_SIZE,demfile);
-	  fclose(demfile);
-	  type_a_record[kTYPE_A_SIZE] = '\0';
-	  for(j=0; j <= 39; j++) { name[j] = type_a_record[j]; }
-	  name[40] = '\0';
-	  for(j=39; j > 0; j--) {
-		if(!isspace(name[j])) { j=0; } else { name[j] = '\0'; }
-	  }
-	  fprintf(stdout,"NAME=\"%s\";\n",name);
-	  for(i=0; i < 8; i++) {
-		poly_verts[i] = getnextdouble(&type_a_record[546 + i * kDOUBLE_LENGTH]);
-	  }
-	  if ( poly_verts[7] < 0.0 ) { 
-		fprintf(stdout,"LOC=\"%.2fS,",fabs(poly_verts[7]/3600));
-	  } else { 
-		fprintf(stdout,"LOC=\"%.2fN,",fabs(poly_verts[7]/3600));
-	  }
-	  if ( poly_verts[6] < 0.0 ) { 
-		fprintf(stdout,"%.2fW\";\n",fabs(poly_verts[6]/3600));
-	  } else { 
-		fprintf(stdout,"%.2fE\";\n",fabs(poly_verts[6]/3600));		
-	  }
-	  i++;
-	}
-	exit(0);
-  } else  { 
-
-	// fprintf(stderr,"%s %s\n",argv[0],argv[1]);
-	if((demfile = fopen(argv[0], "r")) == NULL) {
-	  fprintf(stderr, "Error : %s.  Exiting.\n",strerror(errno));
-	  exit(1);
-	}
-	
-	/* DEM Type A Records */
-	
-	// slurp in the Type A Record header.  It consists of the first 1024
-	// bytes of the DEM file.
-	
-	fread(type_a_record,sizeof(char),kTYPE_A_SIZE,demfile);
-	type_a_record[kTYPE_A_SIZE] = '\0';
-	
-	//  fprintf(stderr,"### RAW HEADER ####\n");
-	//  fprintf(stderr,"%s\n",type_a_record);
-	//  fprintf(stderr,"### END HEADER ####\n");
-	
-	/*
-	  All fields are represented in ASCII
-	  chars are the literal ascii string
-	  flags are 2 bytes 
-	  shorts are 4 bytes 
-	  ints are 6 bytes 
-	  floats are 12 bytes
-	  doubles are 24 bytes
-	*/
-	
-	/* Field 1 - char string DEM name field.  bytes 0 to 143 
-	   used only if outputting name
-	*/
-	if ( dump_header == 1 ) { 
-	  char cur_c, prev_c;
-	  for(i=0; i <= 39; i++) { name[i] = type_a_record[i]; }
-	  name[40] = '\0';
-	  for(i=39; i > 0; i--) {
-		if(!isspace(name[i])) { i=0; } else { name[i] = '\0'; }
-	  }
-	  
-	  // REMOVE all ocurrences of 2 spaces in a row
-	  cur_c = '.'; 
-	  prev_c = '.';
-	  i = 0;
-	  while ( cur_c != '\0' && i <= 39 ) { 
-		cur_c = name[i];
-		if ( cur_c == ' ' && prev_c == ' ' ) { 
-		  bcopy(&name[i],&name[i-1],strlen(&name[i]));
-		  name[strlen(name)-1] = '\0';
-		  i=0;
-		  prev_c = '.';
-		} else { 
-		  prev_c = cur_c;
-		  i++;
-		}
-	  }
-	  // REPLACE ' - ' with '-'
-	  i = 0;
-	  while ( name[i] != '\0' && i < (strlen(name) - 2) ) { 
-		if ( name[i] == ' ' && name[i+1] == '-' && name[i+2] == ' ' ) {
-		  // replace name[i] with '-'
-		  name[i] = '-';
-		  // move name[i+3] to name[i+1]
-		  // add nulls to end
-		  bcopy(&name[i+3],&name[i+1],strlen(&name[i+3]));
-		  name[strlen(name)-2] = '\0';
-		  //reset i
-		  i = 0;
-		} else { 
-		  i++;
-		}
-	  }
-	  // REPLAE ' ' with '_'
-	  i = 0;
-	  while ( name[i] != '\0' && i < (strlen(name)) ) { 
-		if ( name[i] == ' ' ) { 
-		  name[i] = '_';
-		}
-		i++;
-	  }
-	  fprintf(stdout, "DEM Name:\"%s\"\n", name);
-	}
-	
-	/* Field 2 - int DEM level code bytes 144 to 149 
-	   unused
-	*/
-	if ( verbose == 1 ) { 
-	  dem_level_code = getnextint(&type_a_record[144]);
-	  fprintf(stderr, "DEM Level Code %d ",dem_level_code);
-	  if ( dem_level_code == 3 ) { 
-		fprintf(stderr,"(processed by DMA)\n");
-	  } else { 
-		fprintf(stderr,"(unknown)\n");
-	  }
-	}
-
-	/* Field 3 - int pattern code bytes 150 to 155
-	   unused
-	*/
-	if ( verbose == 1 ) { 
-	  pattern_code = getnextint(&type_a_record[150]);
-	  fprintf(stderr, "Pattern Code %d ",pattern_code);
-	  if ( pattern_code == 1 ) { 
-		fprintf(stderr,"(regular elevation pattern)\n");
-	  } else { 
-		fprintf(stderr,"(unknown)\n");
-	  }
-	}
-
-	/* Field 4 - int planimetric reference system code bytes 156 to 161
-	   unused
-	*/
-	if ( verbose == 1 ) {   
-	  plan_ref_sys_code = getnextint(&type_a_record[156]);
-	  fprintf(stderr, "Planimetric Reference System Code %d ",plan_ref_sys_code);
-	  if ( plan_ref_sys_code == 0 ) { 
-		fprintf(stderr,"(geographic coordinate system)\n");
-	  } else { 
-		fprintf(stderr,"(unknown)\n");
-	  }
-	}
-
-	/* Field 5 - int zone code bytes 162 to 167
-	   unused
-	*/
-	if ( verbose == 1 ) { 
-	  zone_code = getnextint(&type_a_record[162]);
-	  fprintf(stderr, "Zone Code %d ",zone_code);
-	  if ( zone_code != 0 ) { 
-		fprintf(stderr,"- Unexpected Value");
-	  }
-	  fprintf(stderr,"\n");
-	}
-
-	/* Field 6 - double x 15 map projection parameters bytes 168 to 527
-	   unused
-	*/
-	if ( verbose == 1 ) { 
-	  fprintf(stderr, "Map projection parameters ");
-	  for(i=0; i < 15; i++) { 
-		map_proj_param[i] = getnextdouble(&type_a_record[168+i*kDOUBLE_LENGTH]);
-		fprintf(stderr,".");
-	  }
-	  fprintf(stderr,"\n");
-	}
-	
-	/* Field 7 - int ground units code bytes 528 to 533
-	 */
-	ground_units_code = getnextint(&type_a_record[528]);
-	if ( verbose == 1 ) { 
-	  fprintf(stderr, "Ground Units Code %d ",ground_units_code);
-	  if ( ground_units_code == 3 ) { 
-		fprintf(stderr, "(arc-seconds)\n");
-	  } else { 
-		fprintf(stderr, "(unknown)\n");
-	  }
-	}
+  if ( stats_name != NULL && opts.stats == NULL ) { 
+	fprintf(stderr,"Error:  --stats-out needs --stats=json.  Exiting.\n");
+	exit(1);
+  }
+  if ( opts.stats != NULL && (elev_extract == 1 || opts.dump_header == 1 || mosaic == 1) ) { 
+	fprintf(stderr,"Error:  --stats only applies to conversions.  Exiting.\n");
+	exit(1);
+  }
+  if ( stats_name != NULL && (opts.stats = fopen(stats_name, "a")) == NULL ) { 
+	fprintf(stderr,"%s: %s.  Exiting.\n",stats_name,strerror(errno));
+	exit(1);
+  }
 
-	/* Field 8 - int elevation units code bytes 534 to 539
-	 */
-	elev_units_code = getnextint(&type_a_record[534]);
-	if ( verbose == 1 ) { 
-	  fprintf(stderr, "Elevation Units %i ", elev_units_code);
-	  if ( elev_units_code == 2 ) {
-		fprintf(stderr, "(meters)\n");
-	  } else { 
-		fprintf(stderr, "(unknown)\n");
-	  }
-	}
+  if ( percentile == 1 && elev_extract == 0 ) { 
+	fprintf(stderr,"Error:  --percentile only applies to -e.  Exiting.\n");
+	exit(1);
+  }
+  if ( percentile == 1 && catalog_name != NULL ) { 
+	fprintf(stderr,"Error:  -C doesn't apply to --percentile, use -c to keep histograms.  Exiting.\n");
+	exit(1);
+  }
 
-	/* Field 9 - int dem polygon sides bytes 540 545
-	 */
-	poly_sides = getnextint(&type_a_record[540]);
-	if ( verbose == 1 ) { 
-	  fprintf(stderr,"Number of sides of the DEM polygon: %d\n",poly_sides);
-	}
-	if ( poly_sides != 4 ) {
-	  fprintf(stderr,"I don't know how to deal with non-rectangluar DEMs.  Exiting.\n");
+  if ( catalog_name != NULL && (elev_extract == 1 || opts.dump_header == 1) ) { 
+	// the header fields of every file at once, from the catalog where we can
+	if ((hs = malloc(argc * sizeof(struct demheader))) == NULL) { 
+	  fprintf(stderr, "Out of memory.  Exiting.\n");
 	  exit(1);
-	} 
-  
-	/* Field 10 - (double,double) x 4 polygon vertex coords bytes 546 to 737
-	 */
-	if ( verbose == 1 ) {   fprintf(stderr,"Ground coordinates of 4 corners of DEM: "); }
-	for(i=0; i < 8; i++) {
-	  poly_verts[i] = getnextdouble(&type_a_record[546 + i * kDOUBLE_LENGTH]);
-	  if ( verbose == 1 ) { 
-		if ( (i%2) == 0 ) {
-		  fprintf(stderr,"(%.0f,",poly_verts[i]/3600.0);
-		} else { 
-		  fprintf(stderr,"%.0f) ",poly_verts[i]/3600.0);
-		}
-	  }
 	}
-	width = fabs(poly_verts[0] - poly_verts[4]);
-	height = fabs(poly_verts[1] - poly_verts[3]);
-
-	if ( verbose == 1 ) { 
-	  fprintf(stderr,"\nDEM ground coordinate width,height : %.2f,%.2f\n",width,height);
-	}
-	
-	if ( output_location == 1 ) { 
-	  fprintf(stdout,"DEM Location:(%.4f,%.4f)-",poly_verts[0]/3600,poly_verts[1]/3600);
-	  fprintf(stdout,"(%.4f,%.4f)\n",poly_verts[4]/3600,poly_verts[5]/3600);
+	if ( catalogheaders(catalog_name, argv, argc, nthreads_given ? nthreads : kCATALOG_THREADS,
+						opts.verbose, hs, errmsg, sizeof(errmsg)) != 0 ) { 
+	  fprintf(stderr,"%s  Exiting.\n",errmsg);
+	  exit(1);
 	}
+  } else if ( catalog_name != NULL ) { 
+	fprintf(stderr,"Error:  -C only applies to -e and -n.  Exiting.\n");
+	exit(1);
+  }
 
-	/* Field 11 double,double min and max elevations in DEM bytes 738 to
-	   761 and 762 to 785
-	*/
-	min_elev = getnextdouble(&type_a_record[738]);
-	max_elev = getnextdouble(&type_a_record[762]);
-	elev_range = max_elev - min_elev;
-	if ( verbose == 1 ) { 
-	  fprintf(stderr, "DEM min,max elevation: %.2f to %.2f, range %.2f\n", min_elev,max_elev,elev_range);
+  if ( elev_extract == 1 && percentile == 1 ) { 
+	// from the decoded samples, a file per thread
+	if ( !nthreads_given && (nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN)) < 1 ) { 
+	  nthreads = 1;
 	}
-	if ( elev_range < 0.0 ) { 
-	  fprintf(stderr,"Negative elevation range.  Exiting.\n");
+	if ( percentilescale(argv, argc, percentile_lo, percentile_hi, nthreads, opts.write_cache, opts.verbose,
+						 &min_elev, &scaling_factor, errmsg, sizeof(errmsg)) != 0 ) { 
+	  fprintf(stderr,"%s  Exiting.\n",errmsg);
 	  exit(1);
 	}
-	if ( min_elev_provided == 1 ) {
-	  min_elev = provided_elev;
-	  if ( verbose == 1 ) { 
-		fprintf(stderr, "Using Provided min elev : %.8f\n", min_elev);
+	fprintf(stdout,"%g %g\n",min_elev,scaling_factor);
+	exit(0);
+  } else if ( elev_extract == 1 && hs != NULL ) { 
+	int first_min_elev = 0;
+	double global_min_elev = 0.0, global_max_elev = 0.0;
+	for(i=0; i < argc; i++) { 
+	  if ( opts.verbose == 1 ) { fprintf(stderr,"DEM File %s: ",argv[i]); }
+	  if ( foldrange(&hs[i], opts.verbose, &first_min_elev, &global_min_elev, &global_max_elev, errmsg, sizeof(errmsg)) != 0 ) { 
+		fprintf(stderr,"%s  Exiting.\n",errmsg);
+		exit(1);
 	  }
 	}
-  
-	/* this is the value to multiply elevations by to get a number
-	   between 0 and 255 to determine the color of the pixel */
-	if ( elev_range == 0.0 ) { 
-	  scaling_factor = 0.0;
-	} else { 
-	  scaling_factor = 255.0 / elev_range;
-	}
-	if ( verbose == 1 ) { 
-	  fprintf(stderr, "Calculated Scaling factor : %.5f\n", scaling_factor);
-	}
-	if ( scale_provided == 1 ) { 
-	  scaling_factor = scale; 
-	  if ( verbose == 1 ) { 
-		fprintf(stderr, "Using Provided Scaling factor : %.5f\n", scaling_factor);
-	  }
-	} 
-	
-	/* Field 12 double ccw angle from primary axis bytes 786 to 809
-	   unused
+	rangescale(global_min_elev, global_max_elev, opts.verbose, &min_elev, &scaling_factor);
+	fprintf(stdout,"%g %g\n",min_elev,scaling_factor);
+	exit(0);
+  } else if ( elev_extract == 1) { 
+	/* for each argv, extract elevation extremes, update global
+	   elevations, then calculate scaling factor based on elevation
+	   extremes and output scaling factor
 	*/
-	angle_from_axis = getnextdouble(&type_a_record[786]);
-	if ( verbose == 1 ) { 
-	  fprintf(stderr, "CCW Angle from primary axis: %.2f\n",angle_from_axis);
+	if ( extractscale(argv, argc, opts.verbose, &min_elev, &scaling_factor, errmsg, sizeof(errmsg)) != 0 ) { 
+	  fprintf(stderr,"%s  Exiting.\n",errmsg);
+	  exit(1);
 	}
-
-	/* Field 13 int accuracy code bytes 810 to 815
-	   unused
-	*/
-	accuracy_code = getnextint(&type_a_record[810]);
-	if ( verbose == 1 ) { 
-	  fprintf(stderr, "Accuracy code %d, ",accuracy_code);
-	  if ( accuracy_code == 0 ) { 
-		fprintf(stderr,"no class C records follow.\n");
-	  } else {
-		fprintf(stderr,"class C records follow.\n");
+	fprintf(stdout,"%g %g\n",min_elev,scaling_factor);
+	exit(0);
+  } else if ( opts.dump_header == 1 ) { 
+	// dump name
+	// dump last lat,long pair
+	for(i=0; i < argc; i++) { 
+	  struct demheader h;
+	  if ( hs != NULL ) { 
+		h = hs[i];
+	  } else if ( readheader(argv[i], &h, errmsg, sizeof(errmsg)) != 0 ) { 
+		fprintf(stderr,"%s  Exiting.\n",errmsg);
+		exit(1);
 	  }
+	  printlocation(&h);
 	}
-
-	/* Field 14 float x 3 DEM spatial resolution bytes 816 to 851
-	 */
-	x_res = getnextfloat(&type_a_record[816]);
-	y_res = getnextfloat(&type_a_record[828]);
-	z_res = getnextfloat(&type_a_record[840]);
-	if ( verbose == 1 ) { 
-	  fprintf(stderr,"X, Y, Z Spatial Resolution : %.2f, %.2f, %.2f ",x_res,y_res,z_res);
-	  if ( ground_units_code == 3 ) { 
-		fprintf(stderr,"arcseconds");
-	  } 
-	  fprintf(stderr,"\nExpecting %d profiles ",(int)(height/x_res+1));
-	  fprintf(stderr,"of %d elevations each.\n",(int)(width/y_res+1));
-	}
-	
-	/* Field 15 int x 2 profile array rows and columns bytes 852 to 857
-	   and 858 to 863
-	*/
-	profile_dim = getnextint(&type_a_record[852]);
-	profile_num = getnextint(&type_a_record[858]);
-	if ( verbose == 1 ) { 
-	  fprintf(stderr,"There are %d %d dimensional profiles in this DEM.\n",profile_num,profile_dim);
-	}
-	if ( profile_dim != 1 ) { 
-	  fprintf(stderr, "Can't handle %d dimensional DEM files.  Exiting\n",profile_dim);
-	  exit(1);
-	}
-	if ( profile_num != (int)(height/x_res+1) ) { 
-	  fprintf(stderr, "Unexpected number of profiles.  Exiting.\n");
+	exit(0);
+  } else if ( serve_path != NULL ) { 
+	if ( servedem(serve_path, &opts, cache_mb << 20, errmsg, sizeof(errmsg)) != 0 ) { 
+	  fprintf(stderr,"%s  Exiting.\n",errmsg);
 	  exit(1);
 	}
-	
-	if ( verbose == 1 ) { 
-	  fprintf(stderr,"Discarding remaining Type A Record fields.\n");
-	}
-	
-	// dive into first Type B Record to retrieve
-	// the rows(elevations) per profile
-	if ( verbose == 1 ) { 
-	  fprintf(stderr,"Entering First Type B Record to get elevations per profile: ");
-	}
-	fseek(demfile,1036,SEEK_SET);
-	fread(type_a_record,sizeof(char),6,demfile);
-	// RE-USE type_a_record buffer space
-	type_a_record[6] = '\0';
-	profile_elevs = getnextint(&type_a_record[0]);
-	if ( verbose == 1 ) { fprintf(stderr," %d\n",profile_elevs); }
-	
-	tga_dim_x = profile_elevs;
-	tga_dim_y = profile_num;
-	
-	if ( verbose == 1 ) { 
-	  fprintf(stderr,"TGA Image is %d x %d \n",tga_dim_x,tga_dim_y);
-	  fprintf(stderr,"Writing TGA header\n");
-	}
-	if((tgafile = fopen(argv[1], "wb+")) == NULL ) { 
-	  fprintf(stderr, "%s: fopen: %s", argv[0], strerror(errno));
+	exit(0);
+  } else if ( mosaic == 1 ) { 
+	if ( mosaicdem(argv[0], &argv[1], argc - 1, &opts, errmsg, sizeof(errmsg)) != 0 ) { 
+	  fprintf(stderr,"%s  Exiting.\n",errmsg);
 	  exit(1);
 	}
-	writetgaheader(tgafile, tga_dim_y, tga_dim_x);
-	
-	if ( verbose == 1 ) { 
-	  fprintf(stderr,"Setting File Offset to first Type B Record\n");
-	}
-	fseek(demfile,kTYPE_A_SIZE,SEEK_SET);
-	fflush(stderr);
-
-	/***************************************************************************** 
-	 * DEM Type B Records  
-	 *****************************************************************************/
-	if ( verbose == 1 ) { 
-	  fprintf(stderr,"Parsing DEM Type B Records (dot every 100 profiles): ");
-	}
-	current_profile = 1;
-	while( current_profile <= profile_num ) {
-	  i = current_profile -1;
-	  if ( verbose == 1 ) { 
-		if ( (i > 0) && ((i%100) == 0) ) { 
-		  fprintf(stderr,".");
-		}
-	  }
-
-	  // read type b record into 8k buffer
-	  fread(type_b_record,sizeof(char),kTYPE_B_SIZE,demfile);
-	  type_b_record[kTYPE_B_SIZE] = '\0';
-	  
-	  /* Field 1 int x 2
-		 profile row and column id
-		 column appears to be profile id
-		 row appears to be this profiles dimension number
-		 bytes 0 to 5 and 6 to 11
-	  */
-	  this_profile_dim =  getnextint(&type_b_record[0]);
-	  this_profile_id = getnextint(&type_b_record[6]);
-	  if ( this_profile_id != current_profile ) { 
-		fprintf(stderr,"Expecting profile id %d, got %d.  Exiting.\n",current_profile,this_profile_id);
-		exit(1);
-	  }
-	  if ( this_profile_dim != profile_dim ) { 
-		fprintf(stderr,"Expecting profile dimension %d, got %d.  Exiting.\n",profile_dim,this_profile_dim);
-		exit(1);
-	  }
-	  /* Field 2 int x 2 
-		 profile rows and columns
-		 rows is elevations (samples) in this profile
-		 columns  matches dimensions?	   
-		 bytes 12 to 17 and 18 to 23
-	  */
-	  this_profile_elevs = getnextint(&type_b_record[12]);
-	  this_profile_columns = getnextint(&type_b_record[18]);
-	  if ( this_profile_elevs != profile_elevs ) { 
-		fprintf(stderr,"Expecting %d elevations, got %d.  Exiting.\n",this_profile_elevs,profile_elevs);
-		exit(1);
-	  }
-	  if ( this_profile_columns != 1 ) { 
-		fprintf(stderr,"Expecting 1 profile columns, got %d.  Exiting.\n",this_profile_columns);
-		exit(1);
-	  }
-	  
-	  /* Field 3 double x 2
-		 ground coords of first elevation in profile
-		 bytes 24 to 47 and 48 to 71 
-	  */
-	  this_profile_long = getnextdouble(&type_b_record[24]);
-	  this_profile_lat = getnextdouble(&type_b_record[48]);
-	  /* !!! check to make sure these are not out of bounds of the information in the DEM header */
-	  
-	  /* Field 4 double 
-		 profile local datum elevation
-		 always 0.0 (sealevel) for 1 degree DEM
-		 bytes 72 to 95
-	  */
-	  this_profile_local_elev = getnextdouble(&type_b_record[72]);
-	  if ( this_profile_local_elev != 0.0 ) { 
-		fprintf(stderr,"Expecting 0.0, got %.1f.  Exiting.\n",this_profile_local_elev);
-		exit(1);
-	  } 
-	  
-	  /* Field 5 double x 2 
-		 min and max elevations for this profile 
-		 bytes 96 to 119 and 120 to 143
-	  */
-	  this_profile_min_elev = getnextdouble(&type_b_record[96]);
-	  this_profile_max_elev = getnextdouble(&type_b_record[120]);
-	  /* !!! check to make sure these are not out of bounds of the information in the DEM header */
-	  
-	  /* Field 6 int x profile_elevs
-		 elevation samples
-		 byte 144 to the end
-	  */
-	  offset = 144;
-	  for(i=0; i < profile_elevs; i++) { 
-		// correct at 1k boundaries
-		if ( i>0 && ((i-146) % 170 == 0) ) {
-		  offset += 4;
+	exit(0);
+  } else if ( batch == 1 ) { 
+	for(i=0; i + 1 < argc; i += 2) { 
+	  if ( njobs == jobs_cap ) { 
+		jobs_cap = jobs_cap ? jobs_cap * 2 : 64;
+		if ((jobs = realloc(jobs, jobs_cap * sizeof(struct batchjob))) == NULL) { 
+		  fprintf(stderr, "Out of memory.  Exiting.\n");
+		  exit(1);
 		}
-		elev = getnextint(&type_b_record[offset+(i*kINT_LENGTH)]);
-		fputc((int)( (elev - min_elev) * scaling_factor),tgafile);
 	  }
-	  current_profile++;
+	  memset(&jobs[njobs], 0, sizeof(struct batchjob));
+	  jobs[njobs].dem_name = argv[i];
+	  jobs[njobs].tga_name = argv[i+1];
+	  njobs++;
+	}
+	exit(runbatch(jobs, njobs, &opts, nthreads, build_name) == 0 ? 0 : 1);
+  } else  { 
+	if ( convertdem(argv[0], argv[1], &opts, errmsg, sizeof(errmsg)) != 0 ) { 
+	  fprintf(stderr,"%s  Exiting.\n",errmsg);
+	  exit(1);
 	}
-	if ( verbose == 1 ) { fprintf(stderr, " done.\n"); }
-	fclose(tgafile);
-	fclose(demfile);
 	return(0);
   }
   return(0);
 }
+#endif
@@ -0,0 +1,123 @@
+/* demclient.c
+ *
+ *  A small client for `dem2tga --serve', for testing and scripting.
+ *  Given a request on the command line it sends that one, otherwise it
+ *  sends each line of stdin, and prints the server's answer to each.
+ *
+ *    demclient /tmp/dem2tga.sock in.dem out.tga -m 0 -s 0.1275
+ *
+ *  Requests given on the command line have their dem_file and tga_file
+ *  made absolute first, since the server runs in a directory of its
+ *  own; lines from stdin are sent as they are.  Exits 0 if every
+ *  request came back ok.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define kLINE 4096
+
+void usage() {
+  fprintf(stderr,"usage: demclient socket [dem_file tga_file [options]]\n");
+  fprintf(stderr,"                with no request, send each line of stdin as one\n");
+  exit(1);
+}
+
+/* Append s to the request, made absolute if it's a file name */
+static int addarg(char *req, size_t len, const char *s, int is_file, const char *cwd) {
+  size_t n = strlen(req);
+  int w;
+  if ( is_file && s[0] != '/' ) {
+	w = snprintf(req + n, len - n, "%s%s/%s", n ? " " : "", cwd, s);
+  } else {
+	w = snprintf(req + n, len - n, "%s%s", n ? " " : "", s);
+  }
+  return(w < 0 || (size_t)w >= len - n ? -1 : 0);
+}
+
+/* Send one request line and print the answer.  Returns 0 if it was ok,
+   1 if the server said no and -1 if the connection failed.
+*/
+static int request(FILE *sock, const char *req) {
+  char answer[kLINE];
+  if ( fprintf(sock, "%s\n", req) < 0 || fflush(sock) != 0 ) {
+	return(-1);
+  }
+  if ( fgets(answer, sizeof(answer), sock) == NULL ) {
+	return(-1);
+  }
+  fputs(answer, stdout);
+  return(strncmp(answer, "ok", 2) == 0 ? 0 : 1);
+}
+
+int main(int argc, char **argv) {
+  struct sockaddr_un addr;
+  char req[kLINE], cwd[PATH_MAX], *nl;
+  FILE *sock;
+  int fd, i, nfiles, status, r;
+
+  if ( argc < 2 || argc == 3 ) {
+	usage();
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if ( strlen(argv[1]) >= sizeof(addr.sun_path) ) {
+	fprintf(stderr,"%s: socket path too long.  Exiting.\n",argv[1]);
+	exit(1);
+  }
+  strcpy(addr.sun_path, argv[1]);
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	  connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	  (sock = fdopen(fd, "r+")) == NULL) {
+	fprintf(stderr,"%s: %s.  Exiting.\n",argv[1],strerror(errno));
+	exit(1);
+  }
+
+  status = 0;
+  if ( argc > 3 ) {
+	if ( getcwd(cwd, sizeof(cwd)) == NULL ) {
+	  fprintf(stderr,"getcwd: %s.  Exiting.\n",strerror(errno));
+	  exit(1);
+	}
+	req[0] = '\0';
+	nfiles = 0;
+	for(i=2; i < argc; i++) {
+	  int is_file = argv[i][0] != '-' && nfiles++ < 2;
+	  // the values of options that take one aren't files
+	  if ( argv[i][0] == '-' && strchr("msrpF", argv[i][1]) != NULL && argv[i][1] != '\0' &&
+		   argv[i][2] == '\0' && i + 1 < argc ) {
+		if ( addarg(req, sizeof(req), argv[i], 0, cwd) != 0 ) {
+		  fprintf(stderr,"Request too long.  Exiting.\n");
+		  exit(1);
+		}
+		i++;
+	  }
+	  if ( addarg(req, sizeof(req), argv[i], is_file, cwd) != 0 ) {
+		fprintf(stderr,"Request too long.  Exiting.\n");
+		exit(1);
+	  }
+	}
+	status = request(sock, req);
+  } else {
+	while ( status >= 0 && fgets(req, sizeof(req), stdin) != NULL ) {
+	  if ((nl = strchr(req, '\n')) != NULL) { *nl = '\0'; }
+	  if ( req[0] == '\0' ) {
+		continue;
+	  }
+	  if ((r = request(sock, req)) != 0) {
+		status = r;
+	  }
+	}
+  }
+  if ( status < 0 ) {
+	fprintf(stderr,"%s: connection lost.  Exiting.\n",argv[1]);
+  }
+  fclose(sock);
+  return(status == 0 ? 0 : 1);
+}
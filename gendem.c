@@ -0,0 +1,290 @@
+/* gendem.c
+ *
+ *  Writes a synthetic USGS DEM for exercising and benchmarking dem2tga:
+ *  a Type A record followed by one Type B record per profile, laid out
+ *  the way dem2tga reads them.  Samples are 6 character fields, 146 in
+ *  the first 1024 byte block of a profile and 170 in each block after
+ *  that, with the last 4 bytes of every block left blank.  Profiles
+ *  that fit are padded out to 8192 bytes, as many producers do; longer
+ *  ones, or all of them with -b, end at their last 1024 byte block.
+ *
+ *  The output is reproducible: the same options always give the same
+ *  bytes.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#define kTYPE_A_SIZE 1024
+#define kTYPE_B_SIZE 8192
+#define kBLOCK_SIZE 1024
+#define kPROFILE_HEADER_SIZE 144
+#define kFIRST_BLOCK_ELEVS 146
+#define kBLOCK_ELEVS 170
+
+#define kDIST_FLAT 0
+#define kDIST_RAMP 1
+#define kDIST_NOISE 2
+#define kDIST_HILLS 3
+
+void usage() {
+  fprintf(stderr,"usage: gendem [-p profiles] [-n samples] [-r resolution] [-d distribution] [-e min,max] [-s seed] [-x lon] [-y lat] [-b] dem_file\n");
+  fprintf(stderr,"                -p n : profiles (default 1201)\n");
+  fprintf(stderr,"                -n n : samples per profile (default 1201)\n");
+  fprintf(stderr,"                -r n : spacing in arc-seconds (default 3)\n");
+  fprintf(stderr,"                -d d : elevations, flat, ramp, noise or hills (default)\n");
+  fprintf(stderr,"                -e min,max : elevation range (default 0,2000)\n");
+  fprintf(stderr,"                -s n : random seed (default 1)\n");
+  fprintf(stderr,"                -x n -y n : south west corner in degrees (default -120,45)\n");
+  fprintf(stderr,"                -b : end every record on its last 1024 byte block, don't pad to 8192 bytes\n");
+  exit(1);
+}
+
+/* xorshift, so the same seed gives the same file everywhere */
+static uint32_t rng_state;
+
+static uint32_t nextrand() {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return(rng_state);
+}
+
+/* put a right justified field of the given width at s, which is not
+   terminated
+*/
+static void putfield(char *s, int width, const char *fmt, double v, int is_int) {
+  char buf[64];
+  char *e;
+  if ( is_int ) {
+	snprintf(buf, sizeof(buf), fmt, width, (int)v);
+  } else {
+	snprintf(buf, sizeof(buf), fmt, width, v);
+	// DEMs write their exponents with a D
+	if ((e = strchr(buf, 'E')) != NULL) { *e = 'D'; }
+  }
+  memcpy(s, buf, width);
+}
+
+#define putint(s, v)    putfield((s), 6, "%*d", (v), 1)
+#define putfloat(s, v)  putfield((s), 12, "%*.6E", (v), 0)
+#define putdouble(s, v) putfield((s), 24, "%*.15E", (v), 0)
+
+/* elevation of sample s of profile p */
+static int elevation(int dist, int p, int s, int profiles, int samples, int lo, int hi) {
+  double range = hi - lo, v;
+  switch(dist) {
+  case kDIST_FLAT:
+	return(lo);
+  case kDIST_RAMP:
+	v = (double)(p + s) / (double)(profiles + samples - 2 > 0 ? profiles + samples - 2 : 1);
+	return(lo + (int)(v * range));
+  case kDIST_NOISE:
+	return(lo + (int)(nextrand() % (uint32_t)(hi - lo + 1)));
+  default:
+	// a couple of octaves of rolling hills with some roughness on top
+	v = 0.5 + 0.3 * sin(p / 37.0) * cos(s / 53.0) + 0.15 * sin(p / 11.0 + s / 13.0);
+	v += ((double)(nextrand() % 1000) / 1000.0 - 0.5) * 0.1;
+	if ( v < 0.0 ) { v = 0.0; }
+	if ( v > 1.0 ) { v = 1.0; }
+	return(lo + (int)(v * range));
+  }
+}
+
+int main(int argc, char **argv) {
+  int profiles, samples, dist, lo, hi, seed, block_records;
+  int ch, p, s, i, off, min_elev, max_elev, *elevs;
+  double res, lon, lat, verts[8];
+  size_t record_size;
+  char type_a_record[kTYPE_A_SIZE], *type_b_record;
+  FILE *fp;
+
+  profiles = 1201;
+  samples = 1201;
+  res = 3.0;
+  dist = kDIST_HILLS;
+  lo = 0;
+  hi = 2000;
+  seed = 1;
+  lon = -120.0;
+  lat = 45.0;
+  block_records = 0;
+
+  while ((ch = getopt(argc, argv, "bd:e:n:p:r:s:x:y:")) != -1)
+	switch(ch) {
+	case 'b':
+	  block_records = 1;
+	  break;
+	case 'd':
+	  if ( strcmp(optarg, "flat") == 0 ) {
+		dist = kDIST_FLAT;
+	  } else if ( strcmp(optarg, "ramp") == 0 ) {
+		dist = kDIST_RAMP;
+	  } else if ( strcmp(optarg, "noise") == 0 ) {
+		dist = kDIST_NOISE;
+	  } else if ( strcmp(optarg, "hills") == 0 ) {
+		dist = kDIST_HILLS;
+	  } else {
+		fprintf(stderr,"Error : unknown distribution \"%s\"\n",optarg);
+		exit(1);
+	  }
+	  break;
+	case 'e':
+	  if ( sscanf(optarg, "%d,%d", &lo, &hi) != 2 || lo > hi || lo < -99999 || hi > 999999 ) {
+		fprintf(stderr,"Error : bad elevation range \"%s\"\n",optarg);
+		exit(1);
+	  }
+	  break;
+	case 'n':
+	  if ((samples = atoi(optarg)) < 2) {
+		fprintf(stderr,"Error : need at least 2 samples. \"%s\"\n",optarg);
+		exit(1);
+	  }
+	  break;
+	case 'p':
+	  if ((profiles = atoi(optarg)) < 2) {
+		fprintf(stderr,"Error : need at least 2 profiles. \"%s\"\n",optarg);
+		exit(1);
+	  }
+	  break;
+	case 'r':
+	  if ((res = atof(optarg)) <= 0.0) {
+		fprintf(stderr,"Error : resolution must be positive. \"%s\"\n",optarg);
+		exit(1);
+	  }
+	  break;
+	case 's':
+	  seed = atoi(optarg);
+	  break;
+	case 'x':
+	  lon = atof(optarg);
+	  break;
+	case 'y':
+	  lat = atof(optarg);
+	  break;
+	case '?':
+	default:
+	  usage();
+	}
+  argc -= optind;
+  argv += optind;
+  if ( argc != 1 ) {
+	usage();
+  }
+
+  // bytes in a profile, rounded up to whole blocks
+  if ( samples <= kFIRST_BLOCK_ELEVS ) {
+	record_size = kBLOCK_SIZE;
+  } else {
+	record_size = kBLOCK_SIZE * (1 + (samples - kFIRST_BLOCK_ELEVS + kBLOCK_ELEVS - 1) / kBLOCK_ELEVS);
+  }
+  if ( block_records == 0 && record_size < kTYPE_B_SIZE ) {
+	record_size = kTYPE_B_SIZE;
+  }
+
+  if ((elevs = malloc((size_t)profiles * samples * sizeof(int))) == NULL ||
+	  (type_b_record = malloc(record_size)) == NULL) {
+	fprintf(stderr,"Out of memory.  Exiting.\n");
+	exit(1);
+  }
+  rng_state = 2463534242u ^ (uint32_t)seed;
+  if ( rng_state == 0 ) { rng_state = 1; }
+  min_elev = hi;
+  max_elev = lo;
+  for(p=0; p < profiles; p++) {
+	for(s=0; s < samples; s++) {
+	  int e = elevation(dist, p, s, profiles, samples, lo, hi);
+	  elevs[(size_t)p * samples + s] = e;
+	  if ( e < min_elev ) { min_elev = e; }
+	  if ( e > max_elev ) { max_elev = e; }
+	}
+  }
+
+  if ((fp = fopen(argv[0], "wb")) == NULL) {
+	fprintf(stderr,"%s: %s.  Exiting.\n",argv[0],strerror(errno));
+	exit(1);
+  }
+
+  /* Type A record.  Profiles run west to east, samples south to north;
+	 dem2tga wants the latitude extent to match the profile count.
+  */
+  memset(type_a_record, ' ', sizeof(type_a_record));
+  snprintf(type_a_record, 145, "SYNTHETIC DEM %dx%d seed %d", profiles, samples, seed);
+  type_a_record[strlen(type_a_record)] = ' ';
+  putint(&type_a_record[144], 1);          // level code
+  putint(&type_a_record[150], 1);          // regular elevation pattern
+  putint(&type_a_record[156], 0);          // geographic
+  putint(&type_a_record[162], 0);          // zone
+  for(i=0; i < 15; i++) {
+	putdouble(&type_a_record[168 + i * 24], 0.0);
+  }
+  putint(&type_a_record[528], 3);          // arc-seconds
+  putint(&type_a_record[534], 2);          // meters
+  putint(&type_a_record[540], 4);
+  lon *= 3600.0;
+  lat *= 3600.0;
+  verts[0] = lon;                             verts[1] = lat;
+  verts[2] = lon;                             verts[3] = lat + (profiles - 1) * res;
+  verts[4] = lon + (samples - 1) * res;       verts[5] = lat + (profiles - 1) * res;
+  verts[6] = lon + (samples - 1) * res;       verts[7] = lat;
+  for(i=0; i < 8; i++) {
+	putdouble(&type_a_record[546 + i * 24], verts[i]);
+  }
+  putdouble(&type_a_record[738], min_elev);
+  putdouble(&type_a_record[762], max_elev);
+  putdouble(&type_a_record[786], 0.0);
+  putint(&type_a_record[810], 0);
+  putfloat(&type_a_record[816], res);
+  putfloat(&type_a_record[828], res);
+  putfloat(&type_a_record[840], 1.0);
+  putint(&type_a_record[852], 1);
+  putint(&type_a_record[858], profiles);
+  if ( fwrite(type_a_record, kTYPE_A_SIZE, 1, fp) != 1 ) {
+	fprintf(stderr,"%s: write: %s.  Exiting.\n",argv[0],strerror(errno));
+	exit(1);
+  }
+
+  for(p=0; p < profiles; p++) {
+	const int *e = &elevs[(size_t)p * samples];
+	int pmin = e[0], pmax = e[0];
+	for(s=1; s < samples; s++) {
+	  if ( e[s] < pmin ) { pmin = e[s]; }
+	  if ( e[s] > pmax ) { pmax = e[s]; }
+	}
+	memset(type_b_record, ' ', record_size);
+	putint(&type_b_record[0], 1);
+	putint(&type_b_record[6], p + 1);
+	putint(&type_b_record[12], samples);
+	putint(&type_b_record[18], 1);
+	putdouble(&type_b_record[24], lon + p * res);
+	putdouble(&type_b_record[48], lat);
+	putdouble(&type_b_record[72], 0.0);
+	putdouble(&type_b_record[96], pmin);
+	putdouble(&type_b_record[120], pmax);
+	off = kPROFILE_HEADER_SIZE;
+	for(s=0; s < samples; s++) {
+	  // skip the unused tail of each block
+	  if ( s > 0 && ((s - kFIRST_BLOCK_ELEVS) % kBLOCK_ELEVS) == 0 ) {
+		off += 4;
+	  }
+	  putint(&type_b_record[off], e[s]);
+	  off += 6;
+	}
+	if ( fwrite(type_b_record, record_size, 1, fp) != 1 ) {
+	  fprintf(stderr,"%s: write: %s.  Exiting.\n",argv[0],strerror(errno));
+	  exit(1);
+	}
+  }
+  if ( fclose(fp) != 0 ) {
+	fprintf(stderr,"%s: close: %s.  Exiting.\n",argv[0],strerror(errno));
+	exit(1);
+  }
+  free(type_b_record);
+  free(elevs);
+  return(0);
+}
@@ -0,0 +1,158 @@
+/* tgacmp.c
+ *
+ *  Compare the images in two 8 bit TGAs, for `make check'.  Colour
+ *  mapped and grayscale TGAs are read raw (types 1 and 3) or run length
+ *  encoded (9 and 11), bottom up or top down, so a --rle output can be
+ *  checked against a plain one.  The colour maps are compared too, but
+ *  not how the pixels were stored.
+ *
+ *    tgacmp plain.tga rle.tga
+ *
+ *  Exits 0 if the images are the same, 1 if they differ and 2 if a
+ *  file couldn't be read.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#define kTGA_HEADER_SIZE 18
+
+struct tgaimage {
+  int width, height;
+  int map_len, map_bytes;
+  unsigned char *map;      // map_len x map_bytes
+  unsigned char *pixels;   // bottom row first
+};
+
+void usage() {
+  fprintf(stderr,"usage: tgacmp tga_file1 tga_file2\n");
+  exit(2);
+}
+
+/* Read name into img.  Returns 0, or -1 with a message in err. */
+static int readtga(const char *name, struct tgaimage *img, char *err, size_t errlen) {
+  unsigned char hdr[kTGA_HEADER_SIZE], *row;
+  size_t n, i, len;
+  int type, c, k, count, top_down;
+  FILE *fp;
+
+  memset(img, 0, sizeof(*img));
+  if ((fp = fopen(name, "rb")) == NULL) {
+	snprintf(err, errlen, "%s: %s.", name, strerror(errno));
+	return(-1);
+  }
+  if ( fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) ) {
+	snprintf(err, errlen, "%s: truncated TGA file.", name);
+	fclose(fp);
+	return(-1);
+  }
+  type = hdr[2];
+  img->map_len = hdr[1] == 1 ? hdr[5] | (hdr[6] << 8) : 0;
+  img->map_bytes = hdr[1] == 1 ? (hdr[7] + 7) / 8 : 0;
+  img->width = hdr[12] | (hdr[13] << 8);
+  img->height = hdr[14] | (hdr[15] << 8);
+  top_down = (hdr[17] & 0x20) != 0;
+  if ( (type != 1 && type != 3 && type != 9 && type != 11) || hdr[16] != 8 ) {
+	snprintf(err, errlen, "%s: not an 8 bit colour mapped or grayscale TGA.", name);
+	fclose(fp);
+	return(-1);
+  }
+  len = (size_t)img->width * img->height;
+  img->map = malloc((size_t)img->map_len * img->map_bytes + 1);
+  img->pixels = malloc(len + 1);
+  if ( img->map == NULL || img->pixels == NULL ) {
+	snprintf(err, errlen, "Out of memory.");
+	fclose(fp);
+	return(-1);
+  }
+  if ( fseek(fp, hdr[0], SEEK_CUR) != 0 ||
+	   fread(img->map, img->map_bytes, img->map_len, fp) != (size_t)img->map_len ) {
+	snprintf(err, errlen, "%s: truncated TGA file.", name);
+	fclose(fp);
+	return(-1);
+  }
+
+  if ( type == 1 || type == 3 ) {
+	n = fread(img->pixels, 1, len, fp);
+  } else {
+	// a packet header, then one pixel repeated or count raw ones
+	for(n=0; n < len; n += count) {
+	  if ((c = getc(fp)) == EOF) {
+		break;
+	  }
+	  count = (c & 0x7f) + 1;
+	  if ( n + count > len ) {
+		snprintf(err, errlen, "%s: RLE packet runs past the image.", name);
+		fclose(fp);
+		return(-1);
+	  }
+	  if ( c & 0x80 ) {
+		if ((k = getc(fp)) == EOF) {
+		  break;
+		}
+		memset(img->pixels + n, k, count);
+	  } else if ( fread(img->pixels + n, 1, count, fp) != (size_t)count ) {
+		break;
+	  }
+	}
+  }
+  fclose(fp);
+  if ( n != len ) {
+	snprintf(err, errlen, "%s: truncated TGA file.", name);
+	return(-1);
+  }
+
+  // bottom row first, whichever way it was stored
+  if ( top_down && img->height > 1 ) {
+	if ((row = malloc(img->width)) == NULL) {
+	  snprintf(err, errlen, "Out of memory.");
+	  return(-1);
+	}
+	for(i=0; i < (size_t)img->height / 2; i++) {
+	  unsigned char *a = img->pixels + i * img->width;
+	  unsigned char *b = img->pixels + (img->height - 1 - i) * (size_t)img->width;
+	  memcpy(row, a, img->width);
+	  memcpy(a, b, img->width);
+	  memcpy(b, row, img->width);
+	}
+	free(row);
+  }
+  return(0);
+}
+
+int main(int argc, char **argv) {
+  struct tgaimage a, b;
+  char errmsg[256];
+  size_t i, len;
+
+  if ( argc != 3 ) {
+	usage();
+  }
+  if ( readtga(argv[1], &a, errmsg, sizeof(errmsg)) != 0 ||
+	   readtga(argv[2], &b, errmsg, sizeof(errmsg)) != 0 ) {
+	fprintf(stderr,"%s  Exiting.\n",errmsg);
+	exit(2);
+  }
+  if ( a.width != b.width || a.height != b.height ) {
+	fprintf(stdout,"%s %s differ: %d x %d, %d x %d\n",argv[1],argv[2],a.width,a.height,b.width,b.height);
+	exit(1);
+  }
+  if ( a.map_len != b.map_len || a.map_bytes != b.map_bytes ||
+	   memcmp(a.map, b.map, (size_t)a.map_len * a.map_bytes) != 0 ) {
+	fprintf(stdout,"%s %s differ: colour maps\n",argv[1],argv[2]);
+	exit(1);
+  }
+  len = (size_t)a.width * a.height;
+  for(i=0; i < len; i++) {
+	if ( a.pixels[i] != b.pixels[i] ) {
+	  fprintf(stdout,"%s %s differ: pixel %zu, %zu from the bottom left\n",argv[1],argv[2],
+			  i % a.width,i / a.width);
+	  exit(1);
+	}
+  }
+  free(a.map); free(a.pixels);
+  free(b.map); free(b.pixels);
+  return(0);
+}